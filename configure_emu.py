@@ -11,6 +11,7 @@ def saveConfig():
     config['Display']['theme'] = selected_option1.get()
     config['Performance']['refresh_rate'] = selected_option2.get()
     config['Extension']['variant'] = selected_option3.get()
+    config['Extension']['quirks'] = selected_option5.get()
     config['Sound']['note'] = selected_option4.get()
 
     config['Display']['window_scale'] = selected_value1.get()
@@ -97,12 +98,23 @@ label4 = ttk.Label(chip8_frame, text="Extension:")
 label4.grid(row=0, column=0, padx=5, pady=5)
 
 #Adding dropdown menu
-options = ["", "Standard", "Super"]
+options = ["", "Standard", "Super", "XO"]
 selected_option3 = tk.StringVar()
 selected_option3.set(options[0])
 dropdown3 = ttk.OptionMenu(chip8_frame, selected_option3, *options)
 dropdown3.grid(row=0, column=1, padx=5, pady=5)
 
+# Adding label9
+label9 = ttk.Label(chip8_frame, text="Quirks:")
+label9.grid(row=1, column=0, padx=5, pady=5)
+
+#Adding dropdown menu
+options = ["", "Auto", "VIP", "Standard", "Super", "XO"]
+selected_option5 = tk.StringVar()
+selected_option5.set(options[0])
+dropdown5 = ttk.OptionMenu(chip8_frame, selected_option5, *options)
+dropdown5.grid(row=1, column=1, padx=5, pady=5)
+
 #adding label5(checkbox)
 #debugging
 checkbox_var1 = tk.BooleanVar()
@@ -185,7 +197,8 @@ config['Debug_logs'] = {
 }
 
 config['Extension'] = {
-    'variant': 'Standard'
+    'variant': 'Standard',
+    'quirks': 'Auto'
 }
 
 if os.path.exists("config.ini"):
@@ -201,6 +214,7 @@ else:
 selected_option1.set(config['Display']['theme'])
 selected_option2.set(config['Performance']['refresh_rate'])
 selected_option3.set(config['Extension']['variant'])
+selected_option5.set(config['Extension'].get('quirks', 'Auto'))
 selected_option4.set(config['Sound']['note'])
 
 selected_value1.set(int(config['Display']['window_scale']))
@@ -1,22 +1,252 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
+#include <deque>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "../include/Chip8.h"
+#include "../include/SourceMap.h"
 
-#define MAX_LINE_SIZE 100
-#define MAX_WORD_SIZE 30
+#define ASM_MAX_DEPTH 16        // Nested includes and macro expansions
 
+// Program assembled into memory
+struct assembly_t {
+    u32 size;                                       // Bytes written to the buffer
+    std::vector<std::string> errors;                // "line N: message", empty on success
+    std::unordered_map<std::string, Address> symtab;
+    u32 insts;                                      // Instructions in the program
+    u32 unoptimized_size, unoptimized_insts;        // Before the peephole pass, same as above if it's off
+    std::string listing;                            // Only if Assembler::listing is set
+    SourceMap map;                                  // Lines and labels by address
+};
+
+// Operands a mnemonic takes, the registers and values are or'ed into its opcode
+enum asm_form_t {
+    ASM_NONE,           // cls
+    ASM_X,              // addi vx
+    ASM_XY,             // sub vx,vy
+    ASM_XY_XNN,         // se vx,vy or se vx,nn, the byte form uses opcode_nn
+    ASM_XNN,            // rnd vx,nn
+    ASM_XYN,            // drw vx,vy,n
+    ASM_ADDR,           // jp label
+    ASM_V0_ADDR,        // jpr v0,label
+    ASM_DB,             // db expr, expr, ...
+    ASM_DW,             // dw expr, expr, ...
+    ASM_ORG,            // org expr
+    ASM_ALIGN,          // align expr
+    ASM_EQU,            // name equ expr
+    ASM_INCLUDE,        // include "file"
+    ASM_MACRO,          // name macro param, param, ...
+    ASM_REPT,           // rept count or rept count, counter
+    ASM_ENDM,           // Ends a macro or rept
+};
+
+// Where an expression's value goes
+enum asm_field_t {
+    ASM_FIELD_NNN,      // Address in the low 12 bits of an instruction
+    ASM_FIELD_NN,       // Low byte of an instruction
+    ASM_FIELD_N,        // Low nibble of an instruction
+    ASM_FIELD_BYTE,     // db
+    ASM_FIELD_WORD,     // dw, big endian
+};
+
+// Relocatable object, the linker places its sections and patches the relocations
+// A section starts at a label (not a .local one) the code before it can't fall into,
+// so a section that nothing refers to can be left out as a whole.
+struct asm_section_t {
+    u32 offset, size;               // Bytes of the object's code
+};
+
+struct asm_symbol_t {
+    std::string name;               // Names starting with '.' are private to the object
+    i32 section;                    // -1 for an equ
+    i32 value;                      // Offset into the section, or the equ value
+};
+
+// Operand the linker evaluates once every section has its address
+struct asm_reloc_t {
+    u32 section;
+    u32 offset;                     // Into the section
+    u32 here;                       // Value of $ on its line, section relative
+    asm_field_t field;
+    std::string expr;
+};
+
+struct asm_object_t {
+    std::vector<u8> code;
+    std::vector<asm_section_t> sections;
+    std::vector<asm_symbol_t> symbols;
+    std::vector<asm_reloc_t> relocs;
+    std::vector<std::string> files;
+    std::vector<source_line_t> lines;   // addr is the offset into code
+};
+
+// Expressions for the linker, every symbol has to be in symtab. error is set when it fails.
+bool asm_evaluate(std::string_view expr, const std::unordered_map<std::string_view, i32> &symtab, u32 here,
+                  i32 *value, std::string *error);
+// Symbols an expression names
+void asm_symbols(std::string_view expr, std::vector<std::string_view> *names);
+// Range check a value for its field, false if it doesn't fit
+bool asm_encode(asm_field_t field, i32 value, u16 *bits);
+const char *asm_field_name(asm_field_t field);
+
+struct lexer_t;
+
+// Mnemonic or directive
+struct asm_mnemonic_t {
+    const char *name;
+    asm_form_t form;
+    u16 opcode;
+    u16 opcode_nn;
+};
+
+// Single pass assembler over a memory mapped source
+// Labels used before they are defined leave a fixup that is patched once the whole
+// source has been read. Lines and names can be of any length. Macros are expanded as
+// they are used, so they have to be defined above. A .8o source is read as Octo, which
+// shares everything past the parsing.
 class Assembler {
 private:
-    std::unordered_map<std::string, Address> symtab;
-    char line[MAX_LINE_SIZE], label[MAX_WORD_SIZE], opcode[MAX_WORD_SIZE], operand[MAX_WORD_SIZE];
+    // Operand that uses a symbol which wasn't defined yet
+    struct fixup_t {
+        u32 offset;                 // Instruction or data in the buffer
+        u32 file;                   // Index into sources
+        u32 line_no;
+        u32 here;                   // Value of $ on its line
+        asm_field_t field;
+        std::string_view expr;      // Points into the source, valid until assemble returns
+        bool name;                  // expr is a single symbol, Octo names may hold '-' and the like
+    };
+
+    // Instruction as emitted, for the peephole pass
+    struct emitted_t {
+        u32 index;                  // Instruction number in the source, edits are keyed by it
+        u32 offset;
+        std::string operand;        // Value operand as assembled, empty if none
+    };
+
+    // Peephole rewrite of one source instruction, applied by the next pass
+    struct edit_t {
+        bool drop;
+        u16 opcode;                 // Replacement opcode with the same operands, 0 to keep
+        std::string operand;        // Replacement value operand, empty to keep
+    };
+
+    // Lines between macro or rept and endm, expanded with the parameters replaced
+    struct macro_t {
+        std::vector<std::string_view> params;
+        std::vector<std::string_view> body;
+        u32 line_no;                // Source line of a rept body, expansions keep it; 0 for macros
+    };
+
+    // Source line for the listing, the bytes are filled in once the fixups are patched
+    struct listed_t {
+        u32 offset, size;
+        u32 file, line_no;
+        u32 expansion;              // Macro nesting, 0 for a line of the source
+        std::string_view text;
+    };
 
-    bool get_line(FILE *source);
+    // Main source and the files it includes, mapped until assemble returns
+    struct source_t {
+        std::string path;
+        const char *data;
+        u32 size;
+        bool octo;                  // Octo syntax, a .8o file
+    };
+
+    // Octo front end and its state, in Octo.cpp
+    struct octo_t;
+
+    std::unordered_map<std::string_view, i32> symtab;   // Labels and equ values
+    std::vector<source_t> sources;
+    std::vector<fixup_t> fixups;
+    std::vector<emitted_t> emitted;
+    std::vector<u32> label_offsets;
+    std::vector<edit_t> edits;
+    u32 inst_no;                    // Instructions seen so far, dropped ones included
+    bool relative;                  // An operand uses $ in arithmetic, code can't move
+    asm_object_t *object;           // Assembling a relocatable object, NULL for a program
+    std::unordered_set<std::string_view> equs;          // Symbols that aren't labels
+    std::vector<u32> section_starts;
+    std::unordered_map<std::string_view, u32> label_sections;  // A label at the end of a section stays in it
+    bool falls_through;             // The last thing emitted is code that can run into the next line
+    u16 last_inst;
+    std::unordered_map<std::string_view, macro_t> macros;
+    std::deque<std::string> expansions;         // Expanded text, names and fixups point into it
+    macro_t *recording;             // Macro or rept whose body is being read, NULL if none
+    macro_t rept;
+    u32 rept_count;
+    u32 nesting;                    // macro and rept inside the body being read
+    u32 expansion;                  // Macros being expanded
+    u32 expansion_count;            // For \@, unique in every expansion
+    std::string_view macro_name;    // Innermost macro being expanded and the line in it
+    u32 macro_line;
+    bool source_lines;              // The lines being assembled have their own line numbers
+    std::vector<listed_t> listed;
+    assembly_t *result;
+    u8 *buffer;
+    u32 capacity;
+    Address starting_addr;
+    u32 here;                       // Address of the line being assembled
+    u32 file;                       // Source being assembled
+    u32 depth;                      // Include and macro nesting
+    u32 line_no;                    // Line being assembled, 0 once past the source
+    std::string_view operand_text;  // Last value operand, for the peephole pass
+
+    bool error(const char *format, ...);
+    bool assemble_line(const char *p, const char *end);
+    bool define(std::string_view name, i32 value);
+    bool define_label(std::string_view name);
+    bool evaluate(lexer_t &lex, u32 here, bool final, i32 *value, bool *deferred,
+                  std::vector<std::string_view> *used = NULL);
+    bool uses_label(const std::vector<std::string_view> &used) const;
+    bool operand(lexer_t &lex, asm_field_t field, u32 offset, u16 *bits);
+    bool constant(lexer_t &lex, i32 *value);
+    bool encode(asm_field_t field, i32 value, std::string_view expr, u16 *bits);
+    bool data(lexer_t &lex, asm_field_t field);
+    void fill(u32 count);
+    void emit_byte(u8 byte);
+    void emit(u16 inst);
+    bool include(lexer_t &lex);
+    bool define_macro(std::string_view name, lexer_t &lex);
+    bool start_rept(lexer_t &lex);
+    void record(const char *p, const char *end);
+    bool invoke(const macro_t &macro, std::string_view name, lexer_t &lex);
+    bool expand(const macro_t &macro, std::string_view name, const std::vector<std::string> &args);
+    void assemble_text(const char *p, const char *end, bool expanded, u32 first_line);
+    void assemble_source(u32 index);
+    void assemble_octo(u32 index);
+    bool pass();
+    bool peephole();
+    bool build(const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result);
+    void make_object();
+    void make_listing();
 
 public:
-    bool assemble(const char *file_path, const Address starting_addr);
+    bool optimize;                  // Run the peephole pass
+    bool listing;                   // Fill assembly_t::listing
+
+    Assembler() : inst_no(0), relative(false), object(NULL), falls_through(false), last_inst(0), recording(NULL),
+                  rept_count(0), nesting(0), expansion(0), expansion_count(0), macro_line(0),
+                  source_lines(false), result(NULL),
+                  buffer(NULL), capacity(0), starting_addr(0), here(0), file(0), depth(0), line_no(0),
+                  optimize(false), listing(false) {}
+
+    // Assemble the source at file_path into buffer, which is loaded at starting_addr
+    // and holds capacity bytes. Nothing touches the disk besides reading the source.
+    bool assemble(const char *file_path, const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result);
+
+    // Same for source text already in memory, includes are relative to the working directory
+    bool assemble(const char *source, u32 size, const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result);
+
+    // Assemble the source at file_path into a relocatable object for the linker.
+    // org and align need addresses, so objects can't use them, and equ only takes constants.
+    // Octo sources can't be objects.
+    bool compile(const char *file_path, asm_object_t *object, assembly_t *result);
 };
 
-#endif // ASSEMBLER_H
\ No newline at end of file
+#endif // ASSEMBLER_H
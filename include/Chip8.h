@@ -5,6 +5,16 @@
 #include "Emulator.h"
 #include "types.h"
 
+#define DISPLAY_WIDTH 128       // SUPER-CHIP hi-res X resolution
+#define DISPLAY_HEIGHT 64       // SUPER-CHIP hi-res Y resolution
+#define DISPLAY_PLANES 4        // XO-CHIP bitplanes, CHIP-8/SUPER-CHIP only use plane 0
+#define BIG_FONT_ADDR 0x50      // SUPER-CHIP 8x10 font is loaded after the 4x5 font
+#define RAM_SIZE 0x1000         // CHIP-8/SUPER-CHIP memory
+#define XO_RAM_SIZE 0x10000     // XO-CHIP memory
+#define RAM_PADDING 0x40        // Slack after the end of memory for I-relative accesses near the top
+#define HASH_CHUNK 64           // Bytes of ram per cached state hash chunk
+#define HASH_CHUNKS ((XO_RAM_SIZE + RAM_PADDING) / HASH_CHUNK)
+
 class Chip8 {
 public:
     // registers
@@ -18,15 +28,33 @@ public:
     u8 delay_timer;
 
     // memory
-    u8 ram[4096];
+    // ram points to core_ram, or to a heap block when XO-CHIP is selected,
+    // so classic ROMs don't carry the 64K around
+    u8 *ram;
+    u32 ram_size;
+    u8 core_ram[RAM_SIZE + RAM_PADDING];
     u16 stack[16];
 
     // hexadecimal input keypad
     u8 keypad[16];
 
     // display
-    bool display[64 * 32];
-    u32 pixel_color[64 * 32];
+    // Every row is packed into one 128-bit word, leftmost pixel in the MSB.
+    // Lo-res (64x32) uses the top 64 bits of rows 0-31.
+    u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    u32 pixel_color[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    bool hires;
+    u8 planes;      // XO-CHIP selected bitplanes (FN01), bit 0 is plane 0
+
+    // SUPER-CHIP (8) / XO-CHIP (16) RPL user flags (FX75/FX85)
+    u8 rpl[16];
+
+    // Machine state that used to live outside the object, kept here so a copy of
+    // Chip8 (plus XO-CHIP ram) is a complete snapshot for replay
+    u32 rng;            // xorshift32 state for CXNN, never 0
+    u8 fx0a_key;        // Key FX0A waits to be released, 0xFF if none yet
+    bool fx0a_pressed;
+    u64 insts;          // Instructions executed since init_chip8
 
     // Currently running ROM/Program
     const char *rom_name;
@@ -46,18 +74,98 @@ public:
     void push(u16 data);
     u16 pop();
 
-    // Debug
-    void debug_inst();
-    void debug_reg();
+    // CXNN random byte
+    u8 random() {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng >> 24;
+    }
+
+    // display helpers
+    u8 display_width() const { return hires ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2; }
+    u8 display_height() const { return hires ? DISPLAY_HEIGHT : DISPLAY_HEIGHT / 2; }
+    u8 pixel(u8 x, u8 y) const {
+        u8 color = 0;   // Bit p is set if the pixel is lit on plane p
+        for (u8 p = 0; p < DISPLAY_PLANES; p++)
+            color |= ((display[p][y] >> (DISPLAY_WIDTH - 1 - x)) & 1) << p;
+        return color;
+    }
+
+    // SUPER-CHIP/XO-CHIP scrolling, only the selected planes move
+    void clear_planes();
+    void scroll_up(u8 n);
+    void scroll_down(u8 n);
+    void scroll_right(u8 n);
+    void scroll_left(u8 n);
+
+    // RPL user flags persistence
+    void load_rpl();
+    void save_rpl();
 
     // Initialize CHIP8 machine
-    bool init_chip8(const config_t *config, const char *rom_name);
+    // With an image the program is copied from it instead of loaded or assembled from rom_name
+    bool init_chip8(const config_t *config, const char *rom_name, const u8 *image = NULL, u32 image_size = 0);
+    void free_chip8();
 
     // Whether screen be updated? (yes/no)
     bool draw;
 
+    // Display rows changed since the last screen update, bit y for row y
+    u64 dirty_rows;
+
+    // Set by the emulator every frame, consumed by DXYN with the display wait quirk
+    bool vblank;
+
+    // Incremental 64-bit state hash, Zobrist style: every ram byte and display row
+    // contributes a key of (location, value), zero values contribute nothing.
+    // Writes only mark their ram chunk or display row stale, state_hash() rehashes
+    // the stale ones and XORs the difference into the totals
+    u64 ram_hash;
+    u64 display_hash;
+    u64 chunk_hash[HASH_CHUNKS];
+    u64 row_hash[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    u64 stale_chunks[(HASH_CHUNKS + 63) / 64];
+    u64 stale_rows[DISPLAY_PLANES];
+
+    static u64 hash_mix(u64 x) {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    // Mark written ram and display rows for the hash
+    void touch(u32 addr, u32 len) {
+        for (u32 chunk = addr / HASH_CHUNK; chunk <= (addr + len - 1) / HASH_CHUNK; chunk++)
+            stale_chunks[chunk / 64] |= 1ULL << (chunk % 64);
+    }
+    void set_row(u8 p, u8 y, u128 row) {
+        display[p][y] = row;
+        stale_rows[p] |= 1ULL << y;
+    }
+
+    // Everything is stale after loading a ROM
+    void rehash();
+
+    // Registers, stack, timers, display mode, ram and display
+    u64 state_hash();
+
+    // skip the next instruction
+    void skip(const config_t &config);
+
+    // Interpreter specialized for one quirk profile and debug hooks (Debug.h)
+    template <typename Quirks, typename Debug>
+    void execute(const config_t &config);
+
+    // Interpreter selected for the configured quirk profile and debug options
+    void (Chip8::*interpreter)(const config_t &config);
+    void select_interpreter(const config_t *config);
+
     // fetch, decode and execute a chip-8 instruction
-    void emulate_inst(const config_t &config);
+    void emulate_inst(const config_t &config) { (this->*interpreter)(config); }
 };
 
 #endif // CHIP8_H
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "types.h"
+
+#define DEBUG_BUFFER_SIZE 4096  // Records buffered per thread before they are flushed
+
+// Debug interpreter hooks
+// The interpreter is instantiated with one of these, debug_off compiles every
+// hook out of the hot path, debug_on checks the Debug_logs options at runtime
+// and debug_insts only logs instructions, so tracing them costs no more than that
+struct debug_off {
+    static constexpr bool enabled = false;
+    static constexpr bool insts = false;
+};
+
+struct debug_on {
+    static constexpr bool enabled = true;
+    static constexpr bool insts = false;    // Checked at runtime
+};
+
+struct debug_insts {
+    static constexpr bool enabled = false;
+    static constexpr bool insts = true;
+};
+
+// Kind of debug record
+enum debug_event_t : u8 {
+    DEBUG_INST,         // Instruction fetched and decoded, arg is what its log line shows besides
+                        // the opcode: the timer for FX07/FX15/FX18, the second word of F000 NNNN, else I
+    DEBUG_MEM_READ,     // Memory read at arg
+    DEBUG_MEM_WRITE,    // Memory write at arg
+    DEBUG_STACK_PUSH,   // arg pushed on the stack
+    DEBUG_STACK_POP,    // Return address popped into arg
+    DEBUG_REG,          // Register reg changed to arg, reg 0x10 is I
+};
+
+// Fixed size binary debug record, formatted later by debug_print
+// Only the one field the event needs is recorded, so tracing every instruction stays cheap
+struct debug_record_t {
+    u16 pc;             // Address of the instruction
+    u16 opcode;         // 16-bit instruction
+    u16 arg;            // Value the event logs, see debug_event_t
+    u8 event;           // debug_event_t
+    u8 reg;             // Changed register, for DEBUG_INST nonzero when the timer FX15/FX18 set isn't known
+};
+
+static_assert(sizeof(debug_record_t) == 8, "debug records are written as raw 8 byte blocks");
+
+// Per-thread record buffer, appended to by the debug interpreter
+// records points at storage, or while a trace file is open at slots reserved in the
+// trace ring so records are written where the writer thread reads them. It starts
+// out NULL with no capacity, the first push flushes to set it up.
+struct debug_buffer_t {
+    debug_record_t *records;
+    u32 count, capacity;
+    debug_record_t storage[DEBUG_BUFFER_SIZE];
+};
+
+// __thread rather than thread_local, the buffer needs no constructor so every push is a
+// plain %fs relative access instead of going through the thread_local init wrapper
+extern __thread debug_buffer_t debug_buffer;
+
+// Opcode filter e.g. DXYN, 8XY4, FX55
+// Hex digits must match, X/Y/N match any nibble
+struct opcode_filter_t {
+    u16 mask;
+    u16 value;
+};
+
+bool parse_opcode_filter(const char *pattern, opcode_filter_t *filter);
+
+// Print one record in the instruction/memory/stack/register log format
+void debug_print(const debug_record_t &record);
+
+// Print (or send to the trace file) and drop every buffered record of the calling thread
+void debug_flush();
+
+inline void debug_push(const debug_record_t &record) {
+    if (debug_buffer.count == debug_buffer.capacity)
+        debug_flush();
+    debug_buffer.records[debug_buffer.count++] = record;
+}
+
+#endif // DEBUG_H
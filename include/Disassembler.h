@@ -0,0 +1,84 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// What a byte of the program turned out to be
+enum disasm_kind_t : u8 {
+    DISASM_DATA,        // Never reached as code
+    DISASM_CODE,        // First byte of an instruction
+    DISASM_OPERAND,     // Other bytes of an instruction
+};
+
+// Where execution goes after an instruction, or after the last one of a block
+enum disasm_flow_t {
+    DISASM_NEXT,        // Next instruction
+    DISASM_CALL,        // Subroutine, then the next instruction
+    DISASM_JUMP,        // jp
+    DISASM_INDIRECT,    // jpr, only the table at v0 = 0 is followed
+    DISASM_SKIP,        // Next instruction or the one after it
+    DISASM_RETURN,      // ret
+    DISASM_EXIT,        // 00FD
+    DISASM_INVALID,     // Not an instruction, or the block runs into one or the end
+};
+
+struct disasm_inst_t {
+    u16 opcode;
+    u16 size;           // 4 for XO-CHIP F000 NNNN
+    disasm_flow_t flow;
+    i32 target;         // jp, call, jpr and ldi address, -1 for none
+};
+
+// Straight run of instructions only entered at the top
+struct disasm_block_t {
+    Address start, end;                 // end is exclusive
+    u32 insts;
+    disasm_flow_t exit;                 // Flow of the last instruction
+    std::vector<Address> successors;    // Fall through or skipped to first, then the jump target
+    std::vector<Address> calls;         // Subroutines called in the block, they return into it
+};
+
+// Static analysis of a ROM
+// Walks the program from the entry point through jumps, calls and both ways of every
+// skip. What is reached is code and the rest is data. A walk stops at an opcode the
+// interpreter doesn't know, at a jump into the middle of an instruction it already
+// decoded and at jpr, whose table is only followed at v0 = 0. The code is cut into
+// basic blocks at every target and after every jump, skip and return.
+class Disassembler {
+public:
+    bool xo;                                // F000 NNNN is one instruction, skips step over all 4 bytes
+    Address start;                          // Load address and entry point of the last program
+    std::vector<u8> rom;
+    std::vector<u8> kind;                   // disasm_kind_t of every byte
+    std::vector<disasm_block_t> blocks;     // By address
+    std::map<Address, std::string> labels;  // Jump, call and ldi targets in the program
+    u32 insts, data_size;
+
+    Disassembler() : xo(false), start(0x200), insts(0), data_size(0) {}
+
+    // Decode the instruction at addr, flow is DISASM_INVALID for an unknown opcode or one cut off by the end
+    disasm_inst_t decode(u32 addr) const;
+
+    void analyze(const u8 *program, u32 size, Address start = 0x200);
+
+    // Block starting at addr, NULL if none does
+    const disasm_block_t *block_at(Address addr) const;
+
+    // Source in the Assembler syntax that assembles back to the same bytes
+    std::string source() const;
+
+    // Control flow graph
+    void write_dot(FILE *out) const;
+    void write_json(FILE *out) const;
+
+private:
+    bool in_program(u32 addr) const { return addr >= start && addr < start + rom.size(); }
+    std::string reference(u32 addr) const;
+    std::string text(u32 addr) const;
+};
+
+#endif // DISASSEMBLER_H
@@ -3,11 +3,13 @@
 
 #include <SDL2/SDL.h>
 #include "types.h"
+#include "Quirks.h"
 
 // SDL Container object
 struct sdl_t {
     SDL_Window *window;
     SDL_Renderer *renderer;
+    SDL_Texture *texture;               // Streaming texture big enough for the hi-res display
     SDL_AudioSpec want, have;
     SDL_AudioDeviceID dev;
 };
@@ -23,6 +25,7 @@ enum emu_state_t {
 enum extension_t {
     CHIP8,
     SUPERCHIP8,
+    XOCHIP,
 };
 
 // Emulator configuration object
@@ -31,6 +34,7 @@ struct config_t {
     u32 window_height;                  // SDL window height
     u32 fg_color;                       // Foreground color RGBA8888
     u32 bg_color;                       // Background color RGBA8888
+    u32 plane_colors[16];               // XO-CHIP colors indexed by lit planes, [0] = bg, [1] = fg
     u32 scale_factor;                   // Amount to scale a CHIP8 pixel by e.g. 20x will be a 20x larger window
     bool pixel_outlines;                // Draw pixel "outlines" yes/no
     u32 insts_per_second;               // CHIP8 CPU "clock rate" or hz
@@ -38,6 +42,7 @@ struct config_t {
     u32 audio_sample_rate;              // Sample rate of audio e.g. 44100hz for CD quality
     i16 volume;                         // How loud or not is the sound
     extension_t current_extension;      // Current quirks/extension support for e.g. CHIP8 vs. SUPERCHIP
+    quirks_t quirks;                    // Quirk profile the interpreter is specialized for
     u8 refresh_rate;                    // refresh rate of screen
     // Debug logs
     bool instruction_execution;
@@ -47,6 +52,24 @@ struct config_t {
     bool input_keys;
     bool timers;
     bool performance_metrics;
+    char trace_file[256];               // Binary trace of the debug logs instead of printing them, empty if off
+    bool profiler;                      // Profile guest PCs/opcodes, report on exit or F2
+    char profile_file[256];             // Collapsed guest stacks for flamegraph tools
+    bool latency_metrics;               // Frame time and input to photon latency histograms, reported on exit
+    char latency_file[256];             // Write the latency report here instead of stdout, empty for stdout
+    char metrics_shm[64];               // POSIX shared memory name for chip8-top e.g. /chip8, empty if off
+    char metrics_file[256];             // Prometheus text file, rewritten every second, empty if off
+    bool heatmap;                       // Count reads/writes/executes per byte of ram, dumped on exit or F3
+    char heatmap_file[256];             // Prefix of the heatmap PGM images
+    char gdb[256];                      // GDB remote port e.g. 1234, or Unix socket path, empty if off
+    bool trace_db;                      // Record every instruction into a columnar trace database for chip8-tdb
+    char trace_db_dir[256];             // Directory of the trace database
+    bool reverse;                       // Keep checkpoints so the debugger can step/continue backwards
+    u32 checkpoint_interval;            // Instructions between checkpoints, the most a step back replays
+    u32 checkpoints;                    // Checkpoints kept, history is about interval * checkpoints instructions
+    // Assembler
+    bool optimize;                      // Peephole optimize programs assembled from source
+    bool watch;                         // Reassemble the source when it's saved and patch the running program
 };
 
 #endif // EMULATOR_H
\ No newline at end of file
@@ -0,0 +1,90 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include <string>
+#include "types.h"
+
+#define GDB_BUFFER_SIZE 0x4000      // Largest packet we accept, advertised as PacketSize
+#define GDB_ADDRESSES 0x10000       // Breakpoint/watchpoint bitmaps cover XO-CHIP memory
+
+class Chip8;
+struct config_t;
+
+// Why the target stopped, reported to the debugger as a GDB signal
+enum gdb_stop_t {
+    GDB_RUNNING,
+    GDB_INTERRUPT,      // SIGINT, attach or Ctrl-C
+    GDB_TRAP,           // SIGTRAP, breakpoint, step or watchpoint
+};
+
+// GDB remote serial protocol server on a TCP port or a Unix socket
+// Polled from the main loop, never blocks. Registers are V0-VF (8 bit), I and PC
+// (16 bit little endian) and SP (8 bit), memory is ram.
+class GdbStub {
+private:
+    i32 listen_fd;
+    i32 client_fd;
+    std::string unix_path;
+    std::string in;                 // Received bytes not yet parsed into packets
+
+    u64 breakpoints[GDB_ADDRESSES / 64];
+    u64 write_watch[GDB_ADDRESSES / 64];
+    u64 read_watch[GDB_ADDRESSES / 64];
+    u32 breakpoint_count;
+    u32 watchpoint_count;
+
+    bool stepping;                  // Stop after the next instruction
+    bool resumed;                   // Don't stop on a breakpoint at the PC we resume from
+    i32 watch_hit;                  // Address of the watchpoint hit by the last instruction, -1 if none
+    char watch_kind;                // 'w' write, 'r' read
+    bool unwatched;                 // Watchpoints went away with the client, poll switches the interpreter back
+
+    void send_packet(const std::string &data);
+    void stopped(gdb_stop_t reason);
+    void handle_packet(const std::string &packet, Chip8 *chip8, const config_t &config);
+    bool set_point(const std::string &packet, bool insert, Chip8 *chip8, const config_t &config);
+    void reverse_step(Chip8 *chip8, const config_t &config);
+    void reverse_continue(Chip8 *chip8, const config_t &config);
+    void disconnect();
+
+    static bool test(const u64 *bitmap, u32 addr) { return bitmap[addr >> 6] >> (addr & 63) & 1; }
+
+public:
+    gdb_stop_t stop;                // GDB_RUNNING while the emulator runs freely
+
+    GdbStub() : listen_fd(-1), client_fd(-1), breakpoint_count(0), watchpoint_count(0),
+                stepping(false), resumed(false), watch_hit(-1), watch_kind(0), unwatched(false),
+                stop(GDB_RUNNING) {}
+
+    // "1234" for a TCP port on localhost, or a path for a Unix socket
+    bool open(const char *address);
+    void close();
+    bool active() const { return listen_fd >= 0; }
+    bool halted() const { return client_fd >= 0 && stop != GDB_RUNNING; }
+
+    // Accept a debugger and handle its packets, once per main loop iteration
+    void poll(Chip8 *chip8, const config_t &config);
+
+    // Whether the burst has to go through run(), false keeps the hot loop untouched
+    bool checking() const { return breakpoint_count || watchpoint_count || stepping; }
+    bool watching() const { return watchpoint_count != 0; }
+
+    // Instruction burst that stops on breakpoints, watchpoints and steps
+    void run(Chip8 *chip8, const config_t &config, u32 insts);
+
+    // Called by the instrumented interpreter on memory accesses
+    inline void access(u32 addr, u32 len, bool write) {
+        const u64 *bitmap = write ? write_watch : read_watch;
+        for (u32 i = 0; i < len; i++) {
+            if (test(bitmap, (addr + i) & (GDB_ADDRESSES - 1))) {
+                watch_hit = (addr + i) & (GDB_ADDRESSES - 1);
+                watch_kind = write ? 'w' : 'r';
+                return;
+            }
+        }
+    }
+};
+
+extern GdbStub gdb_stub;
+
+#endif // GDBSTUB_H
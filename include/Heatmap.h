@@ -0,0 +1,48 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <cstdio>
+#include "Chip8.h"
+
+#define HEATMAP_SIZE (XO_RAM_SIZE + RAM_PADDING)   // Any I + offset the interpreter can reach
+
+// Per byte read/write/execute counters over ram
+// Updated by the instrumented interpreter only, a range access is a few increments
+class Heatmap {
+private:
+    u32 *reads;
+    u32 *writes;
+    u32 *execs;
+
+    bool write_pgm(const char *path, const u32 *counts, u32 size);
+
+public:
+    Heatmap() : reads(NULL), writes(NULL), execs(NULL) {}
+
+    bool start();
+    void stop();
+    bool active() const { return reads != NULL; }
+
+    inline void read(u32 addr, u32 len) {
+        for (u32 i = 0; i < len; i++)
+            reads[addr + i]++;
+    }
+    inline void write(u32 addr, u32 len) {
+        for (u32 i = 0; i < len; i++)
+            writes[addr + i]++;
+    }
+    inline void exec(u32 addr, u32 len) {
+        for (u32 i = 0; i < len; i++)
+            execs[addr + i]++;
+    }
+
+    // <prefix>_read.pgm, <prefix>_write.pgm and <prefix>_exec.pgm, one pixel per byte
+    bool dump(const char *prefix, u32 ram_size);
+
+    // Address ranges that were both written and executed
+    void report(FILE *out, u32 ram_size);
+};
+
+extern Heatmap heatmap;
+
+#endif // HEATMAP_H
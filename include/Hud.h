@@ -0,0 +1,57 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include <atomic>
+#include <SDL2/SDL.h>
+#include "types.h"
+
+#define HUD_FRAMES 120          // Frame times kept for the graph
+#define HUD_SCALE 3             // Window pixels per font pixel
+#define HUD_GLYPH_WIDTH 3
+#define HUD_GLYPH_HEIGHT 5
+
+class Chip8;
+struct config_t;
+
+// Performance overlay, toggled with F1
+// Text is drawn from a glyph atlas texture built once at startup, so a frame only
+// costs a few texture copies and one line strip
+class Hud {
+private:
+    SDL_Texture *atlas;
+    i8 glyph_index[128];        // ASCII -> atlas glyph, -1 if the font doesn't have it
+
+    u32 frame_us[HUD_FRAMES];   // Ring of frame times
+    u32 frame_head;
+    SDL_Point graph[HUD_FRAMES];
+    u64 last_frame;
+
+    u64 second_tick;            // IPS over the last full second
+    u64 second_insts;
+    u64 ips;
+
+    std::atomic<u64> last_callback;     // Set by the audio thread
+    std::atomic<u32> callback_samples;
+
+    void draw_text(SDL_Renderer *renderer, i32 x, i32 y, const char *text);
+
+public:
+    bool visible;
+    u32 dirty_rows;             // Rows uploaded by the last update_screen
+
+    Hud() : atlas(NULL), visible(false) {}
+
+    bool init(SDL_Renderer *renderer);
+    void destroy();
+
+    // Main loop, once per emulator frame
+    void frame(u32 insts);
+    void audio_callback(u32 samples);
+
+    // Draw over the current frame, before SDL_RenderPresent
+    void render(SDL_Renderer *renderer, const Chip8 *chip8, const config_t &config);
+};
+
+extern Hud hud;
+
+#endif // HUD_H
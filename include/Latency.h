@@ -0,0 +1,70 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <cstdio>
+#include "types.h"
+
+#define HISTOGRAM_SUB_BUCKETS 32    // Linear buckets per power of 2, ~3% resolution
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 40)
+
+// Log-linear histogram of durations in nanoseconds
+class Histogram {
+private:
+    u32 buckets[HISTOGRAM_BUCKETS];
+    u64 count;
+    u64 max;
+
+    static u32 bucket(u64 value);
+    static u64 bucket_value(u32 bucket);
+
+public:
+    void add(u64 ns);
+    u64 percentile(f64 p) const;
+    u64 samples() const { return count; }
+    u64 maximum() const { return max; }
+};
+
+// Frame time breakdown and input latency
+// Timestamps come from SDL_GetPerformanceCounter
+class LatencyStats {
+private:
+    u64 key_down[16];           // When a pending key press was received, 0 if none
+    u64 key_observed[16];       // Receipt time of observed presses waiting to be presented
+    u64 frame_start_time;
+    u64 burst_end_time;
+    u64 render_start_time;
+    u64 last_present_time;
+    u64 ticks_per_us;
+
+    u64 ns(u64 from, u64 to) const { return (to - from) * 1000 / ticks_per_us; }
+
+public:
+    Histogram input_to_observe;     // SDL event receipt -> first EX9E/EXA1/FX0A that sees the key
+    Histogram input_to_photon;      // SDL event receipt -> SDL_RenderPresent after it was seen
+    Histogram burst;                // Instruction burst
+    Histogram wait;                 // End of burst -> update_screen
+    Histogram render;               // update_screen -> after SDL_RenderPresent
+    Histogram frame;                // Present to present
+
+    void start();
+    void stop();
+    bool active() const { return ticks_per_us != 0; }
+
+    void key_pressed(u8 key);
+    inline void key_read(u8 key) {
+        if (key_down[key & 0xF])
+            observe(key & 0xF);
+    }
+    void observe(u8 key);
+
+    void frame_started();
+    void burst_ended();
+    void render_started();
+    void presented();
+
+    void report(FILE *out) const;
+};
+
+extern LatencyStats latency;
+
+#endif // LATENCY_H
@@ -0,0 +1,48 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <string>
+#include <vector>
+#include "Assembler.h"
+
+#define OBJECT_MAGIC "C8OBJCT"     // Object file starts with the magic and an object_header_t
+#define OBJECT_VERSION 2
+
+// Object file header, followed by the code, the sections as u32 offset and size,
+// the symbols as i32 section, i32 value, u32 name length and name, the relocations
+// as u32 section, offset, here, field, expression length and expression, the source
+// file names as u32 length and name and the raw source_line_t records
+struct object_header_t {
+    char magic[8];
+    u32 version;
+    u32 code_size;
+    u32 sections;
+    u32 symbols;
+    u32 relocs;
+    u32 files;
+    u32 lines;
+};
+
+bool save_object(const char *path, const asm_object_t &object);
+bool load_object(const char *path, asm_object_t *object);
+
+// Places the sections of relocatable objects in memory and patches their relocations
+// Names starting with '.' are private to their object, the others are shared by all of
+// them and must be unique. Unless gc is off only the sections the entry section reaches
+// through its relocations, directly or not, end up in the program.
+class Linker {
+public:
+    bool gc;                        // Leave out sections nothing refers to
+    u32 sections, kept_sections;    // Of the last link
+    u32 total_size;                 // Bytes of code in all the objects
+
+    Linker() : gc(true), sections(0), kept_sections(0), total_size(0) {}
+
+    // Link objects into buffer, which is loaded at starting_addr and holds capacity bytes.
+    // The section with the entry label goes first, the first object's first section if it's NULL.
+    // names are the objects' files, for the errors.
+    bool link(const std::vector<asm_object_t> &objects, const std::vector<std::string> &names, const char *entry,
+              const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result);
+};
+
+#endif // LINKER_H
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdio>
+#include "types.h"
+
+#define METRICS_MAGIC "C8METRC"     // Shared memory starts with the magic and a metrics_shm_t
+#define METRICS_VERSION 1
+#define METRICS_BURST_BUCKETS 16    // Burst time buckets, bucket i counts bursts under 2^i us
+
+// Live counters, every field is a u64 so readers can copy them word by word
+struct metrics_data_t {
+    u64 uptime_ms;
+    u64 insts;                  // Instructions executed
+    u64 ips;                    // Instructions per second over the last second
+    u64 frames_presented;       // Frames drawn with SDL_RenderPresent
+    u64 frames_skipped;         // Frames whose burst overran the refresh period
+    u64 audio_underruns;        // Audio callbacks that came late while the tone played
+    u64 fx0a_waits;             // Completed FX0A key waits
+    u64 fx0a_wait_us;           // Total time spent in them
+    u64 burst_us[METRICS_BURST_BUCKETS];
+};
+
+// Shared memory layout, a seqlock: seq is odd while the emulator updates data,
+// readers retry until they copy data with the same even seq before and after
+struct metrics_shm_t {
+    char magic[8];
+    u32 version;
+    u32 pid;
+    std::atomic<u64> seq;
+    metrics_data_t data;
+};
+
+// Metrics export, updated by the emulation thread once per frame
+// The emulator never waits on readers
+class Metrics {
+private:
+    metrics_shm_t *shm;
+    char shm_name[64];
+    const char *prometheus_file;
+
+    u64 start_tick;
+    u64 second_tick;            // Start of the current IPS window
+    u64 second_insts;
+    u64 fx0a_start;             // When the running FX0A wait started, 0 if none
+
+    bool audio_playing;
+    std::atomic<bool> audio_resumed;    // Set by the emulator when the tone starts
+    std::atomic<u64> audio_underruns;   // Updated by the audio thread
+    u64 last_callback;                  // Audio thread only
+
+    bool write_prometheus();
+
+public:
+    metrics_data_t data;        // Emulation thread's copy, published to shm
+
+    Metrics() : shm(NULL), prometheus_file(NULL) {}
+
+    bool open(const char *name, const char *prometheus_path);
+    void close();
+    bool active() const { return shm != NULL || prometheus_file != NULL; }
+
+    void burst(u32 insts, u64 ticks, bool overran);
+    void presented() { data.frames_presented++; }
+    void fx0a_waiting();
+    void fx0a_done();
+    void audio_state(bool playing);
+    void audio_callback(u32 samples, u32 sample_rate);
+
+    // Copy data to shared memory, and to the Prometheus file once per second
+    void publish();
+
+    // Reader side, false if the writer kept updating or the segment is invalid
+    static bool read(const metrics_shm_t *shm, metrics_data_t *out);
+};
+
+extern Metrics metrics;
+
+#endif // METRICS_H
@@ -0,0 +1,78 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+#include <SDL2/SDL.h>
+#include "types.h"
+
+// Guest call stack node, one per distinct chain of CALLs
+struct stack_node_t {
+    Address addr;       // Subroutine entry point (0x200 for the root)
+    u32 parent;         // Index of the caller's node
+    u8 depth;           // Number of CALLs below the root
+    u64 insts;          // Instructions executed with exactly this stack
+};
+
+// Exact guest profiler
+// Counts executions and host time per guest PC and per opcode, host time of an
+// instruction is the time until the next instruction starts (or the burst ends)
+class Profiler {
+private:
+    u64 *pc_insts;              // Indexed by PC
+    u64 *pc_ticks;
+    u64 *op_insts;              // Indexed by opcode
+    u64 *op_ticks;
+
+    std::vector<stack_node_t> nodes;
+    std::unordered_map<u64, u32> children;  // (parent << 16 | addr) -> node
+    u32 current;                // Node of the running subroutine
+    u32 dropped;                // CALLs past the deepest node, their RETs don't leave it
+
+    u64 last_tick;              // When the previous instruction started, 0 if paused
+    Address last_pc;
+    u16 last_opcode;
+
+public:
+    Profiler() : pc_insts(NULL), pc_ticks(NULL), op_insts(NULL), op_ticks(NULL),
+                 current(0), dropped(0), last_tick(0), last_pc(0), last_opcode(0) {}
+
+    bool start(Address entry_point);
+    void stop();
+    bool active() const { return pc_insts != NULL; }
+
+    // Called by the interpreter for every instruction it starts
+    inline void inst(Address pc, u16 opcode) {
+        const u64 now = SDL_GetPerformanceCounter();
+
+        if (last_tick) {
+            pc_ticks[last_pc] += now - last_tick;
+            op_ticks[last_opcode] += now - last_tick;
+        }
+        pc_insts[pc]++;
+        op_insts[opcode]++;
+        nodes[current].insts++;
+
+        last_tick = now;
+        last_pc = pc;
+        last_opcode = opcode;
+    }
+
+    // Guest CALL/RET, maintain the guest call stack
+    void call(Address target);
+    void ret();
+
+    // End of an instruction burst, time until the next burst isn't the last instruction's
+    void pause();
+
+    // Ranked per PC and per opcode class report
+    void report(FILE *out);
+
+    // Collapsed stacks (one "main;sub_0234;sub_0300 count" line per stack) for flamegraph tools
+    bool write_collapsed(const char *path);
+};
+
+extern Profiler profiler;
+
+#endif // PROFILER_H
@@ -0,0 +1,64 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+// CHIP-8 variant behaviors
+// Every profile is a set of compile time constants, the interpreter is instantiated
+// once per profile so none of these cost a branch while emulating
+//
+// shift_vy         - 8XY6/8XYE shift VY into VX instead of shifting VX in place
+// load_store_inc_i - FX55/FX65 leave I pointing after the last register
+// vf_reset         - 8XY1/8XY2/8XY3 clear VF
+// jump_vx          - BNNN is BXNN and jumps to XNN + VX instead of NNN + V0
+// clip_sprites     - Sprites are clipped at the screen edges instead of wrapping around
+// display_wait     - DXYN waits for the next frame, at most one sprite per frame
+
+// COSMAC VIP, the original interpreter
+struct quirks_vip {
+    static constexpr bool shift_vy = true;
+    static constexpr bool load_store_inc_i = true;
+    static constexpr bool vf_reset = true;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip_sprites = true;
+    static constexpr bool display_wait = true;
+};
+
+// What this emulator has always done for plain CHIP-8
+struct quirks_standard {
+    static constexpr bool shift_vy = false;
+    static constexpr bool load_store_inc_i = true;
+    static constexpr bool vf_reset = false;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip_sprites = true;
+    static constexpr bool display_wait = false;
+};
+
+// SUPER-CHIP 1.1 on the HP48
+struct quirks_schip {
+    static constexpr bool shift_vy = false;
+    static constexpr bool load_store_inc_i = false;
+    static constexpr bool vf_reset = false;
+    static constexpr bool jump_vx = true;
+    static constexpr bool clip_sprites = true;
+    static constexpr bool display_wait = false;
+};
+
+// XO-CHIP as implemented by Octo
+struct quirks_xochip {
+    static constexpr bool shift_vy = true;
+    static constexpr bool load_store_inc_i = true;
+    static constexpr bool vf_reset = false;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip_sprites = false;
+    static constexpr bool display_wait = false;
+};
+
+// Named quirk profiles selectable from config.ini
+enum quirks_t {
+    QUIRKS_AUTO,        // Follow the selected extension
+    QUIRKS_VIP,
+    QUIRKS_STANDARD,
+    QUIRKS_SCHIP,
+    QUIRKS_XOCHIP,
+};
+
+#endif // QUIRKS_H
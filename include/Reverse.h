@@ -0,0 +1,78 @@
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include <deque>
+#include <vector>
+#include "Chip8.h"
+
+// Machine state the emulator changes between instruction bursts
+struct input_event_t {
+    u64 insts;          // Applied before instruction number insts + 1 runs
+    u16 keypad;         // Bit k for key k down
+    u8 delay_timer;
+    u8 sound_timer;
+    bool vblank;
+};
+
+// Full copy of the machine, XO-CHIP ram lives outside the object
+struct checkpoint_t {
+    Chip8 chip8;
+    std::vector<u8> xo_ram;
+};
+
+// Reverse execution
+// Takes a checkpoint of Chip8 every `interval` instructions into a ring of `count`,
+// and logs what the emulator changes between bursts. Going back restores the nearest
+// checkpoint and replays forward, so a step back costs at most `interval` instructions.
+// The interpreter itself is deterministic (RNG and FX0A state are part of Chip8).
+class Reverse {
+private:
+    std::vector<checkpoint_t> ring;
+    u32 oldest;                 // Ring index of the oldest checkpoint
+    u32 used;                   // Checkpoints in the ring
+    u64 interval;
+    u64 next_checkpoint;        // Instruction count of the next checkpoint
+
+    std::deque<input_event_t> events;   // Since the oldest checkpoint
+    size_t cursor;              // Next event to apply while replaying
+    config_t replay_config;
+
+    void take(const Chip8 &chip8);
+    void apply_events(Chip8 *chip8);
+
+public:
+    Reverse() : oldest(0), used(0), interval(0), next_checkpoint(0), cursor(0), replay_config() {}
+
+    bool start(u32 interval, u32 count);
+    void stop();
+    bool active() const { return interval != 0; }
+
+    // Instruction count of the oldest state we can go back to
+    u64 begin() const { return used ? ring[oldest].chip8.insts : 0; }
+
+    // Start of every instruction burst, after the emulator updated keypad/timers/vblank
+    void frame(const Chip8 &chip8);
+
+    // The debugger changed registers or memory, history no longer leads here
+    void reset(const Chip8 &chip8);
+
+    // Restore the newest checkpoint at or before target, false if it's before begin()
+    // Replay runs with the debug logs and other instrumentation off
+    bool rewind(Chip8 *chip8, const config_t &config, u64 target);
+
+    // Replay one instruction with the logged inputs
+    void step(Chip8 *chip8);
+
+    // Go to exactly target instructions (after that point's logged inputs)
+    bool seek(Chip8 *chip8, const config_t &config, u64 target);
+
+    // Newest checkpoint taken before insts instructions, false if none
+    bool checkpoint_before(u64 insts, u64 *checkpoint) const;
+
+    // Back to live emulation at the current state, history after it is dropped
+    void finish(Chip8 *chip8, const config_t &config);
+};
+
+extern Reverse reverse;
+
+#endif // REVERSE_H
@@ -0,0 +1,67 @@
+#ifndef SOURCEMAP_H
+#define SOURCEMAP_H
+
+#include <string>
+#include <vector>
+#include "types.h"
+
+#define SOURCEMAP_MAGIC "C8SRCMP"   // File starts with the magic and a sourcemap_header_t
+#define SOURCEMAP_VERSION 2
+
+// Map file header, followed by the file names as u32 length and name, the raw
+// source_line_t records and the symbols as u16 addr, u32 end, u32 length and name
+struct sourcemap_header_t {
+    char magic[8];
+    u32 version;
+    u32 files;
+    u32 lines;
+    u32 symbols;
+};
+
+// Bytes assembled from one source line, macro expansions count as the line they are used on
+struct source_line_t {
+    u16 addr;
+    u16 size;
+    u16 file;           // Index into SourceMap::files
+    u16 reserved;
+    u32 line;
+};
+
+static_assert(sizeof(source_line_t) == 12, "source lines are written as raw 12 byte blocks");
+
+// Label and the addresses up to the next one
+struct source_symbol_t {
+    u16 addr;
+    u32 end;            // Exclusive, 0x10000 for a label that runs to the end of XO-CHIP memory
+    std::string name;
+};
+
+// Address to source line and label lookups for an assembled program
+// Lines and symbols are sorted by address.
+class SourceMap {
+public:
+    std::vector<std::string> files;
+    std::vector<source_line_t> lines;
+    std::vector<source_symbol_t> symbols;
+
+    bool empty() const { return lines.empty() && symbols.empty(); }
+    void clear();
+
+    // Symbols from labels and their addresses, each one ends where the next starts or at end
+    void set_symbols(std::vector<source_symbol_t> labels, u32 end);
+
+    bool save(const char *path) const;
+    // False without a message if there is no file at path
+    bool load(const char *path);
+
+    const source_line_t *line_at(u32 addr) const;
+    const source_symbol_t *symbol_at(u32 addr) const;
+
+    // "label+offset file:line", empty if addr isn't in the program
+    std::string describe(u32 addr) const;
+};
+
+// Map of the running program, annotates the instruction log, the profile and the trace tools
+extern SourceMap source_map;
+
+#endif // SOURCEMAP_H
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include "Debug.h"
+
+#define TRACE_MAGIC "C8TRACE"   // File starts with the magic and a trace_header_t
+#define TRACE_VERSION 2
+#define TRACE_RING_SIZE (1 << 16)   // Records, must be a power of 2, small enough to stay in cache
+
+// Trace file header, followed by raw debug_record_t records
+struct trace_header_t {
+    char magic[8];
+    u32 version;
+    u32 record_size;
+};
+
+// Binary trace sink
+// The emulation thread pushes debug records into a single producer/single consumer
+// ring, a writer thread drains the ring to the trace file
+class TraceSink {
+private:
+    debug_record_t *ring;
+    std::atomic<u64> head;      // Next record the producer writes
+    std::atomic<u64> tail;      // Next record the writer drains
+    std::atomic<bool> running;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;   // Writer is woken once a quarter of the ring is pending
+    FILE *file;
+
+    void drain();
+
+public:
+    TraceSink() : ring(NULL), head(0), tail(0), running(false), file(NULL) {}
+
+    bool open(const char *path);
+    void close();
+    bool active() const { return file != NULL; }
+
+    // Called by the emulation thread only, waits for the writer if the ring is full
+    void push(const debug_record_t *records, u32 count);
+
+    // Zero copy push for debug_flush: reserve the free slots up to the end of the ring,
+    // fill them in place, then hand the first count of them to the writer
+    debug_record_t *reserve(u32 *capacity);
+    void commit(u32 count);
+    bool holds(const debug_record_t *records) const { return ring && records >= ring && records < ring + TRACE_RING_SIZE; }
+};
+
+extern TraceSink trace_sink;
+
+#endif // TRACE_H
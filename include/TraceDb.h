@@ -0,0 +1,170 @@
+#ifndef TRACEDB_H
+#define TRACEDB_H
+
+#include <string>
+#include <vector>
+#include "Chip8.h"
+
+#define TRACEDB_MAGIC "C8TRCDB"     // meta file starts with the magic
+#define TRACEDB_VERSION 1
+#define TRACEDB_BLOCK 65536         // Instructions per block, the most a seek replays
+#define TRACEDB_ADDRESSES 0x10000   // Write index covers XO-CHIP memory
+#define TRACEDB_REG_I 0x10          // Register number of I in the regs column
+
+// Columns, one file each in the trace directory
+//   ops       u16 opcode per instruction
+//   branches  varint delta, u16 PC, only where PC isn't the previous PC + 2
+//   regs      varint delta, u8 register, new value (u8, u16 for I)
+//   writes    varint delta, u16 address, u8 new value
+//   frames    u64 first instruction of every frame
+//   blocks    tracedb_block_t every TRACEDB_BLOCK instructions
+//   ram       memory before the first instruction
+//   index     per address write list, built on close
+// Deltas are instruction numbers relative to the previous record of the column,
+// or to the start of the block for its first record, so any block can be read alone.
+
+// State before the block's first instruction and where its records start
+struct tracedb_block_t {
+    u64 branches;       // Byte offsets into the varint columns
+    u64 regs;
+    u64 writes;
+    u16 pc;
+    u16 I;
+    u8 V[16];
+};
+
+struct tracedb_meta_t {
+    char magic[8];
+    u32 version;
+    u32 ram_size;
+    u64 insts;
+    u64 frames;
+    u64 writes;
+};
+
+// index file: u64 start[TRACEDB_ADDRESSES + 1] into the entries that follow,
+// entry = instruction << 8 | value, in instruction order for every address
+#define TRACEDB_INDEX_INST(entry) ((entry) >> 8)
+#define TRACEDB_INDEX_VALUE(entry) ((u8) (entry))
+
+// Buffered append-only column file
+struct tracedb_column_t {
+    FILE *file;
+    std::vector<u8> buffer;
+    u64 size;           // Bytes written so far, buffered ones included
+    u64 last;           // Instruction of the previous record, for the deltas
+
+    void put(u8 byte) {
+        buffer.push_back(byte);
+        if (buffer.size() >= (1 << 16))
+            flush();
+    }
+    void put16(u16 value) { put(value & 0xFF); put(value >> 8); }
+    void put64(u64 value) { for (u8 i = 0; i < 8; i++) put(value >> (8 * i)); }
+    void varint(u64 value) {
+        for (; value >= 0x80; value >>= 7)
+            put(value | 0x80);
+        put(value);
+    }
+    void delta(u64 inst) { varint(inst - last); last = inst; }
+    void flush();
+};
+
+// Execution trace recorder
+// Fed by the instrumented interpreter, one call before and one after every instruction
+class TraceDb {
+private:
+    std::string dir;
+    tracedb_column_t ops, branches, regs, writes, frames, blocks;
+    u64 insts;
+    u64 write_count;
+    u16 next_pc;        // PC of the next instruction if nothing branches
+    u32 ram_size;
+
+    // Memory the current instruction writes, values are read after it ran
+    struct { u32 addr, len; } pending[4];
+    u32 pending_count;
+
+    bool open_column(tracedb_column_t *column, const char *name);
+    bool write_ram(const Chip8 &chip8);
+    bool build_index();
+
+public:
+    TraceDb() : ops(), branches(), regs(), writes(), frames(), blocks(),
+                insts(0), write_count(0), next_pc(0), ram_size(0), pending_count(0) {}
+
+    // Creates the directory, chip8 is the machine before the first instruction
+    bool open(const char *path, const Chip8 &chip8);
+    void close();
+    bool active() const { return ops.file != NULL; }
+
+    void frame();
+
+    // Before the instruction at chip8.PC runs, its opcode already fetched
+    void inst(const Chip8 &chip8);
+
+    // Instrumented interpreter's memory writes
+    inline void write(u32 addr, u32 len) {
+        if (pending_count < 4)
+            pending[pending_count++] = {addr, len};
+    }
+
+    // After the instruction ran, V and I as they were before it
+    void retire(const Chip8 &chip8, const u8 *prev_V, u16 prev_I);
+
+    // Memory changed between instructions by the debugger, a hot patch or a reset, recorded
+    // as writes of the next instruction. The second one only records bytes that differ from before
+    void patch(const Chip8 &chip8, u32 addr, u32 len);
+    void patch(const Chip8 &chip8, const u8 *before);
+};
+
+extern TraceDb tracedb;
+
+// Read side, every column is memory mapped
+class TraceDbReader {
+private:
+    struct mapping_t { const u8 *data; u64 size; };
+    mapping_t ops, branches, regs, writes, frames, blocks, ram, index;
+
+    bool map(const std::string &dir, const char *name, mapping_t *mapping);
+
+public:
+    tracedb_meta_t meta;
+
+    TraceDbReader() : ops(), branches(), regs(), writes(), frames(), blocks(), ram(), index(), meta() {}
+    ~TraceDbReader() { close(); }
+
+    bool open(const char *path);
+    void close();
+
+    u64 frame_count() const { return frames.size / 8; }
+    u64 frame_start(u64 frame) const;
+    u64 frame_of(u64 inst) const;
+    u16 opcode(u64 inst) const { return ops.data[2 * inst] | ops.data[2 * inst + 1] << 8; }
+    u8 initial(u32 addr) const { return addr < ram.size ? ram.data[addr] : 0; }
+
+    // Writes to addr in instruction order
+    const u64 *writes_to(u32 addr, u64 *count) const;
+
+    // Walks instructions in order, pc is the instruction's, registers the state before it ran
+    struct cursor_t {
+        const TraceDbReader *db;
+        u64 inst;
+        u16 pc;
+        u16 I;
+        u8 V[16];
+        const u8 *branch, *branch_end;      // Rest of this block's records
+        const u8 *reg, *reg_end;
+        u64 next_branch, next_reg;          // Instruction of the next record, ~0 if none
+
+        void seek(u64 target);
+        void next();        // Apply inst's register changes and move to the next instruction
+
+    private:
+        void load_block(u64 block);
+    };
+
+    cursor_t cursor(u64 inst) const;
+};
+
+#endif // TRACEDB_H
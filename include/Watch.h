@@ -0,0 +1,45 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <string>
+#include <vector>
+#include "Chip8.h"
+#include "SourceMap.h"
+
+// Reassembles the running program whenever one of its source files is saved
+// Uses inotify on the directories of the sources, as editors often replace a file
+// instead of writing to it. The new image is diffed against the last one and only
+// the changed bytes are written to ram, so registers, timers, the stack and the
+// display carry on. If labels moved or the PC or a return address no longer starts
+// an instruction the machine is reset from the new image instead.
+class Watch {
+private:
+    i32 fd;                             // inotify instance, -1 if off
+    std::vector<i32> dirs;              // Watch descriptors
+    std::vector<std::string> files;     // Sources of the program
+    std::string file_path;              // Main source
+    std::vector<u8> image;              // Last assembled program
+    u32 size;
+    SourceMap map;                      // Of the last assembled program
+
+    bool watch_files(const std::vector<std::string> &sources);
+    bool saved();                       // Drains the pending events
+    bool can_patch(const Chip8 &chip8, const SourceMap &next, u32 next_size) const;
+
+public:
+    u32 patched, resets;                // Reloads of either kind
+
+    Watch() : fd(-1), size(0), patched(0), resets(0) {}
+
+    // Remember the program chip8 was just initialized with and start watching its sources
+    bool start(const Chip8 &chip8, const config_t &config, const char *file_path);
+    void stop();
+    bool active() const { return fd >= 0; }
+
+    // Once per frame, true if the program was reloaded
+    bool poll(Chip8 *chip8, const config_t &config);
+};
+
+extern Watch watch;
+
+#endif // WATCH_H
@@ -7,6 +7,7 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef unsigned __int128 u128;
 typedef uint16_t Address;
 typedef int8_t i8;
 typedef int16_t i16;
@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../include/Assembler.h"
+#include "../include/Linker.h"
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] <source.asm | source.8o | object.o>...\n"
+            "  -o <file>          output, a.ch8 by default, or <source>.o for each source with -c.\n"
+            "                     The source map for the emulator and trace tools goes next to it as .map\n"
+            "  -c                 compile the sources to relocatable objects, don't link\n"
+            "  -O                 peephole optimizer, when assembling a single source\n"
+            "  -l <file>          listing with the addresses, bytes and macro expansions of a single source\n"
+            "  --entry <label>    section to start the program with, the first one by default\n"
+            "  --no-gc            keep the sections nothing refers to\n"
+            "  --xo               link for the 64K of XO-CHIP memory\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+    const size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && !strcmp(s + n - m, suffix);
+}
+
+static void print_errors(const char *path, const assembly_t &result) {
+    for (const std::string &error : result.errors)
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+}
+
+// Path next to the ROM with its extension swapped
+static std::string beside(const char *path, const char *extension) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    return std::string(path, dot && (!slash || dot > slash) ? dot - path : strlen(path)) + extension;
+}
+
+static bool write_file(const char *path, const u8 *data, u32 size) {
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(data, 1, size, file) != size) {
+        fprintf(stderr, "Could not write %s\n", path);
+        if (file)
+            fclose(file);
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<const char *> inputs;
+    const char *output = NULL;
+    const char *entry = NULL;
+    const char *listing = NULL;
+    bool compile_only = false;
+    bool optimize = false;
+    bool gc = true;
+    u32 ram_size = RAM_SIZE;
+
+    for (i32 i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-c")) {
+            compile_only = true;
+        } else if (!strcmp(argv[i], "-O")) {
+            optimize = true;
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            listing = argv[++i];
+        } else if (!strcmp(argv[i], "--entry") && i + 1 < argc) {
+            entry = argv[++i];
+        } else if (!strcmp(argv[i], "--no-gc")) {
+            gc = false;
+        } else if (!strcmp(argv[i], "--xo")) {
+            ram_size = XO_RAM_SIZE;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (inputs.empty() || (compile_only && output && inputs.size() > 1))
+        usage(argv[0]);
+
+    Assembler assembler;
+    assembly_t result;
+    std::vector<u8> program(ram_size - 0x200);
+
+    // Sources to objects, each next to its source unless -o names the one
+    if (compile_only) {
+        bool success = true;
+        for (const char *input : inputs) {
+            asm_object_t object;
+            const std::string path = output ? output : beside(input, ".o");
+            if (!assembler.compile(input, &object, &result)) {
+                print_errors(input, result);
+                success = false;
+            } else if (!save_object(path.c_str(), object)) {
+                success = false;
+            }
+        }
+        exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (!output)
+        output = "a.ch8";
+
+    // A single source is assembled the way the emulator does it, there is nothing to link
+    if (inputs.size() == 1 && !ends_with(inputs[0], ".o")) {
+        assembler.optimize = optimize;
+        assembler.listing = listing != NULL;
+        const bool success = assembler.assemble(inputs[0], 0x200, program.data(), program.size(), &result);
+        if (listing && !write_file(listing, (const u8 *) result.listing.data(), result.listing.size()))
+            exit(EXIT_FAILURE);
+        if (!success) {
+            print_errors(inputs[0], result);
+            exit(EXIT_FAILURE);
+        }
+        if (!write_file(output, program.data(), result.size) || !result.map.save(beside(output, ".map").c_str()))
+            exit(EXIT_FAILURE);
+        printf("%s: %u bytes", output, result.size);
+        if (optimize)
+            printf(", %u before the peephole pass", result.unoptimized_size);
+        printf("\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    if (optimize || listing)
+        fprintf(stderr, "-O and -l only apply to a single source, linking without them\n");
+
+    std::vector<asm_object_t> objects(inputs.size());
+    std::vector<std::string> names(inputs.begin(), inputs.end());
+    bool loaded = true;
+    for (u32 i = 0; i < inputs.size(); i++) {
+        if (ends_with(inputs[i], ".o")) {
+            loaded &= load_object(inputs[i], &objects[i]);
+        } else if (!assembler.compile(inputs[i], &objects[i], &result)) {
+            print_errors(inputs[i], result);
+            loaded = false;
+        }
+    }
+    if (!loaded)
+        exit(EXIT_FAILURE);
+
+    Linker linker;
+    linker.gc = gc;
+    if (!linker.link(objects, names, entry, 0x200, program.data(), program.size(), &result)) {
+        for (const std::string &error : result.errors)
+            fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (!write_file(output, program.data(), result.size) || !result.map.save(beside(output, ".map").c_str()))
+        exit(EXIT_FAILURE);
+
+    printf("%s: %u bytes, kept %u of %u sections, %u of %u bytes\n", output, result.size,
+           linker.kept_sections, linker.sections, result.size, linker.total_size);
+    exit(EXIT_SUCCESS);
+}
@@ -1,360 +1,1354 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "../include/Assembler.h"
 
-bool Assembler::get_line(FILE *source) {
-    line[0] = label[0] = opcode[0] = operand[0] = '\0';
+#define MNEMONIC_SLOTS 128      // Perfect hash table size, a power of two
+#define ASM_PEEPHOLE_ROUNDS 8   // Passes the optimizer gets before it stops looking
+#define ASM_REPT_MAX 0x10000
 
-    fgets(line, MAX_LINE_SIZE, source); // get a line from source file
+static constexpr asm_mnemonic_t mnemonics[] = {
+    {"cls",    ASM_NONE,    0x00E0, 0},
+    {"ret",    ASM_NONE,    0x00EE, 0},
+    {"jp",     ASM_ADDR,    0x1000, 0},
+    {"jpr",    ASM_V0_ADDR, 0xB000, 0},
+    {"call",   ASM_ADDR,    0x2000, 0},
+    {"se",     ASM_XY_XNN,  0x5000, 0x3000},
+    {"sne",    ASM_XY_XNN,  0x9000, 0x4000},
+    {"add",    ASM_XY_XNN,  0x8004, 0x7000},
+    {"addi",   ASM_X,       0xF01E, 0},
+    {"sub",    ASM_XY,      0x8005, 0},
+    {"subn",   ASM_XY,      0x8007, 0},
+    {"or",     ASM_XY,      0x8001, 0},
+    {"and",    ASM_XY,      0x8002, 0},
+    {"xor",    ASM_XY,      0x8003, 0},
+    {"shr",    ASM_XY,      0x8006, 0},
+    {"shl",    ASM_XY,      0x800E, 0},
+    {"rnd",    ASM_XNN,     0xC000, 0},
+    {"skp",    ASM_X,       0xE09E, 0},
+    {"sknp",   ASM_X,       0xE0A1, 0},
+    {"drw",    ASM_XYN,     0xD000, 0},
+    {"ld",     ASM_XY_XNN,  0x8000, 0x6000},
+    {"ldi",    ASM_ADDR,    0xA000, 0},
+    {"ldd",    ASM_X,       0xF015, 0},
+    {"lds",    ASM_X,       0xF018, 0},
+    {"std",    ASM_X,       0xF007, 0},
+    {"wait",   ASM_X,       0xF00A, 0},
+    {"sprite", ASM_X,       0xF029, 0},
+    {"bcd",    ASM_X,       0xF033, 0},
+    {"read",   ASM_X,       0xF065, 0},
+    {"write",  ASM_X,       0xF055, 0},
+    {"db",     ASM_DB,      0,      0},
+    {"dw",     ASM_DW,      0,      0},
+    {"org",    ASM_ORG,     0,      0},
+    {"align",  ASM_ALIGN,   0,      0},
+    {"equ",    ASM_EQU,     0,      0},
+    {"include", ASM_INCLUDE, 0,     0},
+    {"macro",  ASM_MACRO,   0,      0},
+    {"rept",   ASM_REPT,    0,      0},
+    {"endm",   ASM_ENDM,    0,      0},
+};
 
-    if (line[0] == '\0') return false;  // end of input
-    
-    if (line[0] == ' ' || line[0] == '\t') 
-        // if there is no label get only opcode and operands
-        sscanf(line, "%s %s\n", opcode, operand);
-    else
-        // if there is label, get all of them
-        sscanf(line, "%s %s %s\n", label, opcode, operand);
-    
-    label[strlen(label)-1] = '\0';  // remove ":" at the end of label
+#define MNEMONIC_COUNT (sizeof(mnemonics) / sizeof(mnemonics[0]))
 
-    return true;
+// Seeded FNV-1a, the top bits pick the slot
+static constexpr u32 mnemonic_hash(const char *name, u32 len, u32 seed) {
+    u32 hash = seed;
+    for (u32 i = 0; i < len; i++)
+        hash = (hash ^ (u8) name[i]) * 0x01000193;
+    return hash >> (32 - __builtin_ctz(MNEMONIC_SLOTS));
 }
 
-// checks if a is of the for v0 to vf
-bool is_vx(char *a) {
-    return a[0] == 'v' && ((a[1] >= '0' && a[1] <= '9') || (a[1] >= 'a' && a[1] <= 'f'));
+static constexpr u32 name_length(const char *name) {
+    u32 len = 0;
+    while (name[len]) len++;
+    return len;
 }
 
-bool is_nibble(char *a) {
-    return (a[0] >= '0' && a[0] <= '9') || (a[0] >= 'a' && a[0] <= 'f');
+// First seed that gives every mnemonic a slot of its own, searched by the compiler
+static constexpr u32 find_mnemonic_seed() {
+    for (u32 seed = 1; seed < 1000000; seed++) {
+        bool used[MNEMONIC_SLOTS] = {};
+        bool collision = false;
+        for (u32 i = 0; i < MNEMONIC_COUNT && !collision; i++) {
+            const u32 slot = mnemonic_hash(mnemonics[i].name, name_length(mnemonics[i].name), seed);
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if (!collision)
+            return seed;
+    }
+    return 0;
 }
 
-bool is_byte(char *a) {
-    return ((a[0] >= '0' && a[0] <= '9') || (a[0] >= 'a' && a[0] <= 'f')) &&
-           ((a[1] >= '0' && a[1] <= '9') || (a[1] >= 'a' && a[1] <= 'f'));
+static constexpr u32 mnemonic_seed = find_mnemonic_seed();
+static_assert(mnemonic_seed != 0, "No perfect hash seed for the mnemonics");
+
+// Slot -> mnemonic index + 1, 0 for an empty slot
+struct mnemonic_table_t {
+    u8 slot[MNEMONIC_SLOTS];
+};
+
+static constexpr mnemonic_table_t make_mnemonic_table() {
+    mnemonic_table_t table = {};
+    for (u32 i = 0; i < MNEMONIC_COUNT; i++)
+        table.slot[mnemonic_hash(mnemonics[i].name, name_length(mnemonics[i].name), mnemonic_seed)] = i + 1;
+    return table;
 }
 
-u8 hextodec(char *a) {
-    if (a[0] >= '0' && a[0] <= '9')
-        return a[0] - '0';
-    return a[0] - 'a' + 10;
+static constexpr mnemonic_table_t mnemonic_table = make_mnemonic_table();
+
+// One hash and one compare, NULL if name isn't a mnemonic
+static const asm_mnemonic_t *find_mnemonic(std::string_view name) {
+    const u8 index = mnemonic_table.slot[mnemonic_hash(name.data(), name.size(), mnemonic_seed)];
+    if (!index || name != mnemonics[index - 1].name)
+        return NULL;
+    return &mnemonics[index - 1];
 }
 
-bool Assembler::assemble(const char *file_path, const Address starting_addr) {
-    FILE *source = fopen(file_path, "r");
-    FILE *output = fopen("build/out.ch8", "wb");
+static bool is_word(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
 
-    Address LOCCTR = starting_addr;
-    u32 line_no = 1;
-    
-    // pass 1
-    while (get_line(source)) {
-        if (label[0] != '\0') {
-            if (symtab.find(label) != symtab.end()) {
-                SDL_Log("line %d: Duplicate label used: %s\n", line_no, label);
-                return false;
-            }
-            symtab[label] = LOCCTR;
+static i32 hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Cursor over one source line, ';' starts a comment
+struct lexer_t {
+    const char *p, *end;
+
+    void skip_space() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+    }
+
+    // Nothing but whitespace or a comment left
+    bool done() {
+        skip_space();
+        return p == end || *p == ';';
+    }
+
+    bool accept(char c) {
+        skip_space();
+        if (p == end || *p != c)
+            return false;
+        p++;
+        return true;
+    }
+
+    std::string_view word() {
+        skip_space();
+        const char *start = p;
+        while (p < end && is_word(*p))
+            p++;
+        return std::string_view(start, p - start);
+    }
+};
+
+// checks if word is of the form v0 to vf
+static bool parse_vx(std::string_view word, u8 *x) {
+    if (word.size() != 2 || (word[0] != 'v' && word[0] != 'V') || hex_digit(word[1]) < 0)
+        return false;
+    *x = hex_digit(word[1]);
+    return true;
+}
+
+// Digits in base 16 (or 10), false if there are none, others or too many
+static bool parse_number(std::string_view digits, u32 base, i32 *value) {
+    u64 result = 0;
+    if (digits.empty())
+        return false;
+    for (char c : digits) {
+        const i32 digit = hex_digit(c);
+        if (digit < 0 || (u32) digit >= base || (result = result * base + digit) > 0xFFFFFFFF)
+            return false;
+    }
+    *value = (i32) result;
+    return true;
+}
+
+// Recursive descent over one expression, the binary operators bind like in C
+// A word of hex digits is a number unless a symbol has that name, the same
+// rule as the bare hex bytes the assembler always took.
+struct evaluator_t {
+    lexer_t &lex;
+    const std::unordered_map<std::string_view, i32> &symtab;
+    u32 here;
+    bool final;                 // Every symbol has been seen, unknown ones are errors
+    bool deferred;              // Uses a symbol that may still be defined further down
+    const char *problem;        // First error, NULL while the expression is valid
+    std::string_view token;     // Where it happened
+    std::vector<std::string_view> *used;    // Symbols it found, if not NULL
+
+    i32 fail(const char *why, std::string_view where) {
+        if (!problem) {
+            problem = why;
+            token = where;
         }
-        LOCCTR += 2;
-        line_no++;
+        return 0;
     }
 
-    rewind(source);
-    line_no = 1;
+    i32 symbol(std::string_view name) {
+        auto it = symtab.find(name);
+        if (it != symtab.end()) {
+            if (used)
+                used->push_back(name);
+            return it->second;
+        }
 
-    // pass 2
-    while (get_line(source)) {
-        u16 inst;
+        i32 value;
+        if (!final) {
+            deferred = true;
+            return 0;
+        }
+        if (parse_number(name, 16, &value))
+            return value;
+        return fail("Undefined symbol", name);
+    }
 
-        if (!strcmp(opcode, "cls")) {
-            inst = 0x00E0;
-        } else if (!strcmp(opcode, "ret")) {
-            inst = 0x00EE;
-        } else if (!strcmp(opcode, "jp")) {
-            auto it = symtab.find(operand);
-            if (it != symtab.end()) {
-                inst = 0x1000 + it->second;
-            } else {
-                SDL_Log("line %d: Undefined label used: %s\n", line_no, operand);
-                return false;
-            }
-        } else if (!strcmp(opcode, "jpr")) {
-            if (strlen(operand) > 3 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-            auto it = symtab.find(operand + 3);
-            if (it != symtab.end()) {
-                inst = 0x1000 + it->second;
-            } else {
-                SDL_Log("line %d: Undefined label used: %s\n", line_no, operand);
-                return false;
-            }
-        } else if (!strcmp(opcode, "call")) {
-            auto it = symtab.find(operand);
-            if (it != symtab.end()) {
-                inst = 0x2000 + it->second;
-            } else {
-                SDL_Log("line %d: Undefined label used: %s\n", line_no, operand);
-                return false;
-            }
-        } else if (!strcmp(opcode, "se")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    i32 primary() {
+        lex.skip_space();
+        if (lex.p == lex.end)
+            return fail("Missing value", std::string_view());
 
-            if (is_vx(operand + 3)) {
-                inst = 0x5000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else if (is_byte(operand + 3)) {
-                inst = 0x3000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 3) << 4) + hextodec(operand + 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "sne")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        const char *start = lex.p;
+        i32 value;
+        switch (*lex.p) {
+        case '(':
+            lex.p++;
+            value = binary(1);
+            return lex.accept(')') ? value : fail("Missing ')'", std::string_view(start, lex.p - start));
+        case '-':
+            lex.p++;
+            return (i32) (0u - (u32) primary());
+        case '+':
+            lex.p++;
+            return primary();
+        case '~':
+            lex.p++;
+            return ~primary();
+        case '$':
+            lex.p++;
+            return here;
+        case '%': {
+            // Binary, or a sprite row where '#' is a set pixel and '.' a clear one
+            u32 bits = 0, count = 0;
+            for (lex.p++; lex.p < lex.end && strchr("01#.", *lex.p) && *lex.p; lex.p++, count++)
+                bits = bits << 1 | (*lex.p == '1' || *lex.p == '#');
+            if (!count || count > 32)
+                return fail("Invalid binary number", std::string_view(start, lex.p - start));
+            return bits;
+        }
+        case '#': {
+            lex.p++;
+            const std::string_view digits = lex.word();
+            if (!parse_number(digits, 10, &value))
+                return fail("Invalid decimal number", std::string_view(start, lex.p - start));
+            return value;
+        }
+        }
 
-            if (is_vx(operand + 3)) {
-                inst = 0x9000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else if (is_byte(operand + 3)) {
-                inst = 0x4000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 3) << 4) + hextodec(operand + 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "add")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        const std::string_view word = lex.word();
+        if (word.empty())
+            return fail("Expected a value", std::string_view(start, 1));
+        if (word[0] < '0' || word[0] > '9')
+            return symbol(word);
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8004 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else if (is_byte(operand + 3)) {
-                inst = 0x7000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 3) << 4) + hextodec(operand + 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "addi")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        // Numbers are hex, with or without 0x
+        const bool prefixed = word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X');
+        if (!parse_number(word.substr(prefixed ? 2 : 0), 16, &value))
+            return fail("Invalid number", word);
+        return value;
+    }
 
-            inst = 0xF01E + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "sub")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    // Operators of at least min_precedence, left to right
+    i32 binary(u32 min_precedence) {
+        i32 left = primary();
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8005 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "subn")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        for (;;) {
+            lex.skip_space();
+            if (lex.p == lex.end)
+                return left;
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8007 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "or")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+            const char op = *lex.p;
+            const bool shift = lex.p + 1 < lex.end && (op == '<' || op == '>') && lex.p[1] == op;
+            u32 precedence;
+            switch (op) {
+            case '|': precedence = 1; break;
+            case '^': precedence = 2; break;
+            case '&': precedence = 3; break;
+            case '<': case '>': precedence = shift ? 4 : 0; break;
+            case '+': case '-': precedence = 5; break;
+            case '*': case '/': precedence = 6; break;
+            default: precedence = 0; break;
             }
+            if (!precedence || precedence < min_precedence)
+                return left;
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8001 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "and")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+            const char *at = lex.p;
+            lex.p += shift ? 2 : 1;
+            const i32 right = binary(precedence + 1);
+            const u32 a = left, b = right;
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8002 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "xor")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+            switch (op) {
+            case '|': left = a | b; break;
+            case '^': left = a ^ b; break;
+            case '&': left = a & b; break;
+            case '<': left = b < 32 ? a << b : 0; break;
+            case '>': left = b < 32 ? left >> b : (left < 0 ? -1 : 0); break;
+            case '+': left = a + b; break;
+            case '-': left = a - b; break;
+            case '*': left = a * b; break;
+            case '/':
+                if (!right)
+                    return deferred ? 0 : fail("Division by zero", std::string_view(at, 1));
+                left = right == -1 ? (i32) (0u - a) : left / right;
+                break;
             }
+        }
+    }
+};
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8003 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "shr")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+bool asm_evaluate(std::string_view expr, const std::unordered_map<std::string_view, i32> &symtab, u32 here,
+                  i32 *value, std::string *error) {
+    lexer_t lex = {expr.data(), expr.data() + expr.size()};
+    evaluator_t evaluator = {lex, symtab, here, true, false, NULL, std::string_view(), NULL};
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8006 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "shl")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
+    *value = evaluator.binary(1);
+    if (!evaluator.problem && !lex.done())
+        evaluator.fail("Unexpected", std::string_view(lex.p, lex.end - lex.p));
+    if (evaluator.problem)
+        *error = std::string(evaluator.problem) + ": " + std::string(evaluator.token);
+    return !evaluator.problem;
+}
+
+void asm_symbols(std::string_view expr, std::vector<std::string_view> *names) {
+    lexer_t lex = {expr.data(), expr.data() + expr.size()};
+
+    while (!lex.done()) {
+        if (*lex.p == '%') {
+            for (lex.p++; lex.p < lex.end && *lex.p && strchr("01#.", *lex.p); lex.p++);
+        } else if (*lex.p == '#' || (*lex.p >= '0' && *lex.p <= '9')) {
+            lex.p += *lex.p == '#';
+            lex.word();
+        } else if (is_word(*lex.p)) {
+            names->push_back(lex.word());
+        } else {
+            lex.p++;
+        }
+    }
+}
+
+static const struct { const char *name; i32 min, max; } fields[] = {
+    {"a 12 bit address", 0, 0xFFF},
+    {"a byte", -0x80, 0xFF},
+    {"a nibble", 0, 0xF},
+    {"a byte", -0x80, 0xFF},
+    {"a word", -0x8000, 0xFFFF},
+};
+
+bool asm_encode(asm_field_t field, i32 value, u16 *bits) {
+    if (value < fields[field].min || value > fields[field].max)
+        return false;
+    *bits = value & (field == ASM_FIELD_WORD ? 0xFFFF : fields[field].max);
+    return true;
+}
+
+const char *asm_field_name(asm_field_t field) {
+    return fields[field].name;
+}
+
+// Record an error for the caller, always false so it can be returned
+bool Assembler::error(const char *format, ...) {
+    char message[256];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof message, format, args);
+    va_end(args);
+
+    if (!line_no) {
+        result->errors.push_back(message);
+        return false;
+    }
+
+    std::string where = (file ? sources[file].path + " line " : "line ") + std::to_string(line_no);
+    if (!macro_name.empty())
+        where += " (" + std::string(macro_name) + " line " + std::to_string(macro_line) + ")";
+    result->errors.push_back(where + ": " + message);
+    return false;
+}
+
+bool Assembler::define(std::string_view name, i32 value) {
+    if (!symtab.emplace(name, value).second)
+        return error("Duplicate label used: %.*s", (int) name.size(), name.data());
+    return true;
+}
+
+// Label at the current address, the peephole pass won't merge an instruction into the one before it.
+// In an object a label the code above can't run into starts a new section.
+bool Assembler::define_label(std::string_view name) {
+    if (optimize)
+        label_offsets.push_back(result->size);
+    if (object && name[0] != '.' && !falls_through && section_starts.back() != result->size)
+        section_starts.push_back(result->size);
+    if (object)
+        label_sections[name] = section_starts.size() - 1;
+    return define(name, starting_addr + result->size);
+}
+
+// Past the capacity only the size keeps counting, it is reported once at the end
+void Assembler::emit_byte(u8 byte) {
+    if (result->size < capacity)
+        buffer[result->size] = byte;
+    result->size++;
+}
+
+void Assembler::emit(u16 inst) {
+    emit_byte(inst >> 8);
+    emit_byte(inst & 0xFF);
+}
+
+static bool is_skip(u16 opcode) {
+    switch (opcode >> 12) {
+    case 0x3: case 0x4: return true;
+    case 0x5: case 0x9: return (opcode & 0xF) == 0;
+    case 0xE: return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+    default: return false;
+    }
+}
+
+// jp, jpr, ret and exit never run into the next instruction, unless they can be skipped
+static bool is_unconditional(u16 opcode, u16 previous) {
+    return (opcode >> 12 == 0x1 || opcode >> 12 == 0xB || opcode == 0x00EE || opcode == 0x00FD) && !is_skip(previous);
+}
+
+void Assembler::fill(u32 count) {
+    while (count--)
+        emit_byte(0);
+}
+
+// Expression at lex, *deferred is set instead of failing when final is false and a
+// symbol it uses isn't defined yet
+bool Assembler::evaluate(lexer_t &lex, u32 here, bool final, i32 *value, bool *deferred,
+                         std::vector<std::string_view> *used) {
+    evaluator_t evaluator = {lex, symtab, here, final, false, NULL, std::string_view(), used};
+
+    *value = evaluator.binary(1);
+    *deferred = evaluator.deferred;
+
+    if (evaluator.problem)
+        return error("%s: %.*s", evaluator.problem, (int) evaluator.token.size(), evaluator.token.data());
+    return true;
+}
+
+// An object's addresses aren't known until it's linked, only equ values are
+bool Assembler::uses_label(const std::vector<std::string_view> &used) const {
+    for (std::string_view name : used) {
+        if (!equs.count(name))
+            return true;
+    }
+    return false;
+}
+
+// Value that must be known where it's used, like an org address
+bool Assembler::constant(lexer_t &lex, i32 *value) {
+    std::vector<std::string_view> used;
+    bool deferred;
+
+    if (!evaluate(lex, here, true, value, &deferred, object ? &used : NULL))
+        return false;
+    if (object && uses_label(used))
+        return error("Labels have no address until the object is linked");
+    return true;
+}
+
+// Range check and place a value in its field
+bool Assembler::encode(asm_field_t field, i32 value, std::string_view expr, u16 *bits) {
+    if (!asm_encode(field, value, bits))
+        return error("%.*s doesn't fit in %s (%s%X)", (int) expr.size(), expr.data(), asm_field_name(field),
+                     value < 0 ? "-" : "", value < 0 ? 0u - (u32) value : (u32) value);
+    return true;
+}
+
+// Expression operand whose value goes into bits now, or is patched in at offset once
+// every symbol it uses is defined
+bool Assembler::operand(lexer_t &lex, asm_field_t field, u32 offset, u16 *bits) {
+    lex.skip_space();
+    const char *start = lex.p;
+    std::vector<std::string_view> used;
+    i32 value;
+    bool deferred;
+
+    if (!evaluate(lex, here, false, &value, &deferred, object ? &used : NULL))
+        return false;
+
+    std::string_view expr(start, lex.p - start);
+    while (!expr.empty() && (expr.back() == ' ' || expr.back() == '\t' || expr.back() == '\r'))
+        expr.remove_suffix(1);
+
+    operand_text = expr;
+    if (expr != "$" && expr.find('$') != std::string_view::npos)
+        relative = true;
+
+    // In an object everything that depends on an address is left to the linker
+    *bits = 0;
+    if (deferred || (object && (uses_label(used) || expr.find('$') != std::string_view::npos))) {
+        fixups.push_back({offset, file, line_no, here, field, expr, false});
+        return true;
+    }
+    return encode(field, value, expr, bits);
+}
+
+// db and dw, a comma separated list of expressions
+bool Assembler::data(lexer_t &lex, asm_field_t field) {
+    do {
+        u16 bits;
+        if (!operand(lex, field, result->size, &bits))
+            return false;
+        if (field == ASM_FIELD_WORD)
+            emit(bits);
+        else
+            emit_byte(bits);
+    } while (lex.accept(','));
+    falls_through = false;
+    last_inst = 0;
+
+    return lex.done() || error("Invalid operand(s) for %s", field == ASM_FIELD_WORD ? "dw" : "db");
+}
+
+bool Assembler::assemble_line(const char *p, const char *end) {
+    lexer_t lex = {p, end};
+    std::string_view label;
+    bool colon = false;
+    here = starting_addr + result->size;
+
+    // A label starts in the first column and ends with ':', an equ name may leave it out
+    if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != ';') {
+        label = lex.word();
+        colon = lex.accept(':');
+        if (label.empty())
+            return error("Invalid label");
+    }
+
+    const std::string_view name = lex.done() ? std::string_view() : lex.word();
+    const asm_mnemonic_t *mnemonic = name.empty() ? NULL : find_mnemonic(name);
+    const auto macro = mnemonic || name.empty() ? macros.end() : macros.find(name);
+    if (!label.empty() && !colon && !(mnemonic && (mnemonic->form == ASM_EQU || mnemonic->form == ASM_MACRO)))
+        return error("Expected ':' after label %.*s", (int) label.size(), label.data());
+    if (!name.empty() && !mnemonic && macro == macros.end())
+        return error("Invalid opcode: %.*s", (int) name.size(), name.data());
+    if (!lex.done() && name.empty())
+        return error("Invalid opcode: %.*s", (int) (end - lex.p), lex.p);
+
+    if (mnemonic && mnemonic->form == ASM_MACRO)
+        return define_macro(label, lex);
+    if (mnemonic && mnemonic->form == ASM_ENDM)
+        return error("endm without macro or rept");
+
+    if (mnemonic && mnemonic->form == ASM_EQU) {
+        i32 value;
+        if (label.empty())
+            return error("equ needs a name in the first column");
+        if (!constant(lex, &value))
+            return false;
+        if (!lex.done())
+            return error("Invalid operand(s) for equ");
+        equs.insert(label);
+        return define(label, value);
+    }
+
+    // org and align move the label to where they lead
+    if (mnemonic && (mnemonic->form == ASM_ORG || mnemonic->form == ASM_ALIGN)) {
+        i32 value;
+        if (object)
+            return error("%.*s needs an address, an object has none until it is linked", (int) name.size(), name.data());
+        if (!constant(lex, &value))
+            return false;
+        if (!lex.done())
+            return error("Invalid operand(s) for %.*s", (int) name.size(), name.data());
+
+        if (mnemonic->form == ASM_ORG) {
+            if (value < (i32) here || value > (i32) (starting_addr + capacity))
+                return error("org %X is outside %X-%X", value, here, starting_addr + capacity);
+            fill(value - here);
+        } else {
+            if (value <= 0 || value > 0x10000)
+                return error("Invalid alignment %X", value);
+            fill((value - here % value) % value);
+        }
+        return label.empty() || define_label(label);
+    }
+
+    if (!label.empty() && !define_label(label))
+        return false;
+
+    if (macro != macros.end())
+        return invoke(macro->second, name, lex);
+    if (!mnemonic)
+        return true;    // Blank, comment or label only line
+
+    if (mnemonic->form == ASM_INCLUDE)
+        return include(lex);
+    if (mnemonic->form == ASM_REPT)
+        return start_rept(lex);
+
+    if (mnemonic->form == ASM_DB || mnemonic->form == ASM_DW)
+        return data(lex, mnemonic->form == ASM_DB ? ASM_FIELD_BYTE : ASM_FIELD_WORD);
+
+    const u32 offset = result->size;
+    const size_t line_fixups = fixups.size();
+    u16 inst = mnemonic->opcode;
+    u16 bits = 0;       // Value operand, already in place
+    asm_field_t field = ASM_FIELD_NNN;
+    operand_text = std::string_view();  // Stays empty if the instruction has no value operand
+    u8 x = 0, y = 0;
+    bool valid = true;
+
+    switch (mnemonic->form) {
+    case ASM_X:
+        valid = parse_vx(lex.word(), &x);
+        break;
+    case ASM_XY:
+        valid = parse_vx(lex.word(), &x) && lex.accept(',') && parse_vx(lex.word(), &y);
+        break;
+    case ASM_XY_XNN: {
+        valid = parse_vx(lex.word(), &x) && lex.accept(',');
+        if (!valid)
+            break;
+
+        // A register, or else a byte expression
+        lexer_t peek = lex;
+        if (parse_vx(peek.word(), &y) && peek.done()) {
+            lex = peek;
+        } else {
+            inst = mnemonic->opcode_nn;
+            field = ASM_FIELD_NN;
+            if (!operand(lex, field, offset, &bits))
                 return false;
-            }
+        }
+        break;
+    }
+    case ASM_XNN:
+        valid = parse_vx(lex.word(), &x) && lex.accept(',');
+        field = ASM_FIELD_NN;
+        if (valid && !operand(lex, field, offset, &bits))
+            return false;
+        break;
+    case ASM_XYN:
+        valid = parse_vx(lex.word(), &x) && lex.accept(',') && parse_vx(lex.word(), &y) && lex.accept(',');
+        field = ASM_FIELD_N;
+        if (valid && !operand(lex, field, offset, &bits))
+            return false;
+        break;
+    case ASM_V0_ADDR:
+        valid = parse_vx(lex.word(), &x) && x == 0 && lex.accept(',');
+        [[fallthrough]];
+    case ASM_ADDR:
+        if (valid && !operand(lex, ASM_FIELD_NNN, offset, &bits))
+            return false;
+        break;
+    default:
+        break;
+    }
 
-            if (is_vx(operand + 3)) {
-                inst = 0x800E + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
+    if (!valid || !lex.done())
+        return error("Invalid operand(s) for %.*s", (int) name.size(), name.data());
+
+    if (optimize) {
+        const u32 index = inst_no++;
+        const edit_t *edit = index < edits.size() ? &edits[index] : NULL;
+
+        if (edit && edit->drop) {
+            fixups.resize(line_fixups);
+            return true;
+        }
+        if (edit && edit->opcode)
+            inst = edit->opcode;
+        if (edit && !edit->operand.empty()) {
+            lexer_t replacement = {edit->operand.data(), edit->operand.data() + edit->operand.size()};
+            fixups.resize(line_fixups);
+            if (!operand(replacement, field, offset, &bits))
                 return false;
+        }
+        emitted.push_back({index, offset, std::string(operand_text)});
+    }
+
+    inst |= x << 8 | y << 4 | bits;
+    falls_through = !is_unconditional(inst, last_inst);
+    last_inst = inst;
+    result->insts++;
+    emit(inst);
+    return true;
+}
+
+// Map a whole file read only, NULL with errno set if it can't be
+static const char *map_file(const char *path, u32 *size) {
+    const i32 fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        const i32 saved = errno;
+        if (fd >= 0)
+            close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    // An empty file can't be mapped, it's an empty source
+    *size = st.st_size;
+    const char *data = *size ? (const char *) mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    const i32 saved = errno;
+    close(fd);
+    errno = saved;
+    return data == MAP_FAILED ? NULL : data;
+}
+
+static void unmap_file(const char *data, u32 size) {
+    if (size)
+        munmap((void *) data, size);
+}
+
+// Octo sources go by their extension
+static bool is_octo(const char *path) {
+    const size_t len = strlen(path);
+    return len > 3 && !strcmp(path + len - 3, ".8o");
+}
+
+// include "file", relative to the file it's in. Every file is mapped once however often it's included.
+bool Assembler::include(lexer_t &lex) {
+    if (!lex.accept('"'))
+        return error("include needs a quoted file name");
+    const char *close = (const char *) memchr(lex.p, '"', lex.end - lex.p);
+    if (!close)
+        return error("Missing '\"' after the file name");
+
+    std::string path(lex.p, close - lex.p);
+    lex.p = close + 1;
+    if (!lex.done())
+        return error("Invalid operand(s) for include");
+
+    const std::string &parent = sources[file].path;
+    const size_t slash = parent.rfind('/');
+    if (path[0] != '/' && slash != std::string::npos)
+        path = parent.substr(0, slash + 1) + path;
+
+    if (depth >= ASM_MAX_DEPTH)
+        return error("Includes nested more than %u deep at %s", ASM_MAX_DEPTH, path.c_str());
+
+    u32 index = 0;
+    while (index < sources.size() && sources[index].path != path)
+        index++;
+    if (index == sources.size()) {
+        u32 size;
+        const char *data = map_file(path.c_str(), &size);
+        if (!data)
+            return error("Could not open %s: %s", path.c_str(), strerror(errno));
+        sources.push_back({path, data, size, false});
+    }
+
+    // Its errors carry its own name and lines, the include line itself went fine
+    depth++;
+    assemble_source(index);
+    depth--;
+    return true;
+}
+
+// name macro a, b starts recording the body, the lines up to endm
+bool Assembler::define_macro(std::string_view name, lexer_t &lex) {
+    macro_t macro = {};
+
+    if (name.empty())
+        return error("macro needs a name in the first column");
+    if (find_mnemonic(name))
+        return error("%.*s is an instruction", (int) name.size(), name.data());
+    if (macros.count(name))
+        return error("Duplicate macro: %.*s", (int) name.size(), name.data());
+
+    if (!lex.done()) {
+        do {
+            const std::string_view param = lex.word();
+            if (param.empty() || std::find(macro.params.begin(), macro.params.end(), param) != macro.params.end())
+                return error("Invalid parameters for macro %.*s", (int) name.size(), name.data());
+            macro.params.push_back(param);
+        } while (lex.accept(','));
+    }
+    if (!lex.done())
+        return error("Invalid parameters for macro %.*s", (int) name.size(), name.data());
+
+    recording = &(macros[name] = std::move(macro));
+    nesting = 0;
+    return true;
+}
+
+// rept count, or rept count, i to have i count up from 0 in the body
+bool Assembler::start_rept(lexer_t &lex) {
+    i32 count;
+
+    rept = macro_t();
+    if (!constant(lex, &count))
+        return false;
+    if (count < 0 || count > ASM_REPT_MAX)
+        return error("Invalid rept count %X", count);
+    if (lex.accept(',')) {
+        const std::string_view counter = lex.word();
+        if (counter.empty())
+            return error("Invalid operand(s) for rept");
+        rept.params.push_back(counter);
+    }
+    if (!lex.done())
+        return error("Invalid operand(s) for rept");
+
+    rept.line_no = source_lines ? line_no + 1 : 0;
+    rept_count = count;
+    recording = &rept;
+    nesting = 0;
+    return true;
+}
+
+// Body line of the macro or rept being recorded, its endm expands a rept
+void Assembler::record(const char *p, const char *end) {
+    lexer_t lex = {p, end};
+    if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != ';') {
+        lex.word();
+        lex.accept(':');
+    }
+
+    const std::string_view word = lex.word();
+    if (word == "macro" || word == "rept") {
+        nesting++;
+    } else if (word == "endm" && nesting) {
+        nesting--;
+    } else if (word == "endm") {
+        const bool repeat = recording == &rept;
+        recording = NULL;
+        if (repeat) {
+            // The body may hold another rept, which reuses the member
+            const macro_t body = std::move(rept);
+            const u32 count = rept_count;
+            for (u32 i = 0; i < count; i++) {
+                if (!expand(body, "rept", body.params.empty() ? std::vector<std::string>() :
+                                                                std::vector<std::string>{"#" + std::to_string(i)}))
+                    break;
             }
-        } else if (!strcmp(opcode, "rnd")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+        }
+        return;
+    }
+
+    recording->body.push_back(std::string_view(p, end - p));
+}
+
+// name a, b: operands are split at the commas outside parentheses
+bool Assembler::invoke(const macro_t &macro, std::string_view name, lexer_t &lex) {
+    std::vector<std::string> args;
+
+    if (!lex.done()) {
+        i32 parens = 0;
+        const char *start = lex.p;
+        for (; lex.p < lex.end && *lex.p != ';'; lex.p++) {
+            parens += *lex.p == '(';
+            parens -= *lex.p == ')';
+            if (*lex.p == ',' && !parens) {
+                args.emplace_back(start, lex.p - start);
+                start = lex.p + 1;
             }
+        }
+        args.emplace_back(start, lex.p - start);
+    }
 
-            if (is_byte(operand + 3)) {
-                inst = 0xC000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 3) << 4) + hextodec(operand + 4);
+    for (std::string &arg : args) {
+        arg.erase(0, arg.find_first_not_of(" \t\r"));
+        arg.erase(arg.find_last_not_of(" \t\r") + 1);
+        if (arg.empty())
+            return error("Empty operand for %.*s", (int) name.size(), name.data());
+    }
+    if (args.size() != macro.params.size())
+        return error("%.*s takes %u operand(s)", (int) name.size(), name.data(), (u32) macro.params.size());
+
+    expand(macro, name, args);
+    return true;    // Errors in the expansion are its own
+}
+
+// Copy the body with the parameters replaced and assemble it, \@ becomes a number unique
+// to this expansion for labels inside it
+bool Assembler::expand(const macro_t &macro, std::string_view name, const std::vector<std::string> &args) {
+    if (depth >= ASM_MAX_DEPTH)
+        return error("Macros nested more than %u deep in %.*s", ASM_MAX_DEPTH, (int) name.size(), name.data());
+
+    std::string &text = expansions.emplace_back();
+    const std::string unique = std::to_string(expansion_count++);
+    for (std::string_view line : macro.body) {
+        for (size_t i = 0; i < line.size(); ) {
+            if (line[i] == '\\' && i + 1 < line.size() && line[i + 1] == '@') {
+                text += unique;
+                i += 2;
+            } else if (is_word(line[i])) {
+                size_t j = i;
+                while (j < line.size() && is_word(line[j]))
+                    j++;
+                const std::string_view word = line.substr(i, j - i);
+                const auto param = std::find(macro.params.begin(), macro.params.end(), word);
+                if (param != macro.params.end())
+                    text += args[param - macro.params.begin()];
+                else
+                    text += word;
+                i = j;
             } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
-        } else if (!strcmp(opcode, "skp")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+                text += line[i++];
             }
+        }
+        text += '\n';
+    }
 
-            inst = 0xE09E + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "sknp")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    // A rept in the source keeps the lines of its body, errors need no macro context then
+    const std::string_view outer_name = macro_name;
+    const u32 outer_line = macro_line, outer_line_no = line_no;
+    macro_name = macro.line_no ? std::string_view() : name;
+    depth++;
+    expansion++;
+    assemble_text(text.data(), text.data() + text.size(), true, macro.line_no);
+    expansion--;
+    depth--;
+    macro_name = outer_name;
+    macro_line = outer_line;
+    line_no = outer_line_no;
+    return true;
+}
 
-            inst = 0xE0A1 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "drw")) {
-            if (strlen(operand) != 7 || !is_vx(operand) || operand[2] != ',' ||
-                    !is_vx(operand + 3) || operand[5] != ',' || !is_nibble(operand + 6)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+// Lines of a source, or of an expansion which keeps the line it was invoked on
+// unless its lines start at first_line in the source
+void Assembler::assemble_text(const char *p, const char *end, bool expanded, u32 first_line) {
+    const bool outer_source_lines = source_lines;
+    source_lines = !expanded || first_line;
 
-            inst = 0xD000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4) + hextodec(operand + 6);
-        } else if (!strcmp(opcode, "ld")) {
-            if (strlen(operand) != 5 || !is_vx(operand) || operand[2] != ',') {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    for (u32 line = 1; p < end; line++) {
+        const char *eol = (const char *) memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (first_line)
+            line_no = first_line + line - 1;
+        else if (expanded)
+            macro_line = line;
+        else
+            line_no = line;
 
-            if (is_vx(operand + 3)) {
-                inst = 0x8000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 4) << 4);
-            } else if (is_byte(operand + 3)) {
-                inst = 0x6000 + (hextodec(operand + 1) << 8) + (hextodec(operand + 3) << 4) + hextodec(operand + 4);
-            } else {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+        const size_t entry = listed.size();
+        const size_t mapped = result->map.lines.size();
+        const u32 offset = result->size;
+        if (listing)
+            listed.push_back({offset, 0, file, line_no, expansion, std::string_view(p, eol - p)});
+
+        if (recording) {
+            record(p, eol);
+        } else {
+            // A line that failed half way leaves no fixups behind
+            const size_t pending = fixups.size();
+            if (!assemble_line(p, eol))
+                fixups.resize(pending);
+        }
+
+        if (listing)
+            listed[entry].size = result->size - offset;
+        // Expansions go to the line they are used on, includes have lines of their own
+        if (source_lines && result->size > offset && result->map.lines.size() == mapped)
+            result->map.lines.push_back({(u16) (starting_addr + offset), (u16) (result->size - offset), (u16) file, 0, line_no});
+        p = eol + 1;
+    }
+
+    // A body has to end where it started
+    if (recording) {
+        error("Missing endm");
+        recording = NULL;
+    }
+    source_lines = outer_source_lines;
+}
+
+void Assembler::assemble_source(u32 index) {
+    const u32 parent = file, parent_line = line_no;
+    const std::string_view parent_macro = macro_name;
+
+    file = index;
+    macro_name = std::string_view();
+    if (sources[index].octo)
+        assemble_octo(index);
+    else
+        assemble_text(sources[index].data, sources[index].data + sources[index].size, false, 0);
+
+    file = parent;
+    line_no = parent_line;
+    macro_name = parent_macro;
+}
+
+// One pass over the whole source with the current edits
+bool Assembler::pass() {
+    result->size = 0;
+    result->insts = 0;
+    result->errors.clear();
+    symtab.clear();
+    fixups.clear();
+    emitted.clear();
+    label_offsets.clear();
+    inst_no = 0;
+    relative = false;
+    equs.clear();
+    section_starts.assign(1, 0);
+    label_sections.clear();
+    macros.clear();
+    expansions.clear();
+    listed.clear();
+    result->map.lines.clear();
+    recording = NULL;
+    expansion = 0;
+    expansion_count = 0;
+    macro_name = std::string_view();
+    falls_through = false;
+    last_inst = 0;
+    file = 0;
+    depth = 0;
+    line_no = 0;
+
+    assemble_source(0);
+
+    if (result->size > capacity)
+        error("Program is %u bytes, only %u fit in memory", result->size, capacity);
+
+    // Patch the operands that used symbols before they were defined. An object keeps
+    // the ones that need an address or an external symbol for the linker.
+    size_t relocs = 0;
+    for (const fixup_t &fixup : fixups) {
+        lexer_t lex = {fixup.expr.data(), fixup.expr.data() + fixup.expr.size()};
+        std::vector<std::string_view> used;
+        i32 value;
+        bool deferred;
+        u16 bits;
+
+        file = fixup.file;
+        line_no = fixup.line_no;
+        if (fixup.name) {
+            const auto it = symtab.find(fixup.expr);
+            if (it == symtab.end()) {
+                error("Undefined symbol: %.*s", (int) fixup.expr.size(), fixup.expr.data());
+                continue;
             }
-        } else if (!strcmp(opcode, "ldi")) {
-            auto it = symtab.find(operand);
-            if (it != symtab.end()) {
-                inst = 0xA000 + it->second;
-            } else {
-                SDL_Log("line %d: Undefined label used: %s\n", line_no, operand);
-                return false;
+            value = it->second;
+        } else if (!evaluate(lex, fixup.here, !object, &value, &deferred, object ? &used : NULL)) {
+            continue;
+        }
+        if (object && (deferred || uses_label(used) || fixup.expr.find('$') != std::string_view::npos)) {
+            fixups[relocs++] = fixup;
+            continue;
+        }
+        if (!encode(fixup.field, value, fixup.expr, &bits))
+            continue;
+
+        if (fixup.field == ASM_FIELD_BYTE) {
+            if (fixup.offset < capacity)
+                buffer[fixup.offset] = bits;
+        } else if (fixup.offset + 2 <= capacity) {
+            buffer[fixup.offset] |= bits >> 8;
+            buffer[fixup.offset + 1] |= bits & 0xFF;
+        }
+    }
+    if (object)
+        fixups.resize(relocs);
+    file = 0;
+    line_no = 0;
+
+    return result->errors.empty();
+}
+
+// Look at what the last pass emitted and record rewrites for the next one, false if
+// there is nothing left to do. An instruction after a skip is never removed, neither is
+// one something jumps or points to when it would be merged into the instruction before it.
+bool Assembler::peephole() {
+    const u32 size = std::min(result->size, capacity);
+    auto opcode = [&](u32 offset) { return (u16) (buffer[offset] << 8 | buffer[offset + 1]); };
+
+    // Offsets labels, jumps, calls and ldi point to, and the instruction at every offset
+    std::vector<bool> target(size + 2);
+    std::vector<i32> inst_at(size + 2, -1);
+    for (u32 offset : label_offsets)
+        target[std::min(offset, size)] = true;
+    for (u32 i = 0; i < emitted.size(); i++) {
+        const u16 op = opcode(emitted[i].offset);
+        const u32 nnn = (op & 0xFFF) - starting_addr;
+        inst_at[emitted[i].offset] = i;
+        if ((op >> 12 == 0x1 || op >> 12 == 0x2 || op >> 12 == 0xA || op >> 12 == 0xB) && nnn < size)
+            target[nnn] = true;
+    }
+
+    std::vector<bool> touched(emitted.size());
+    bool changed = false;
+
+    for (u32 i = 0; i < emitted.size(); i++) {
+        const emitted_t &inst = emitted[i];
+        const u16 op = opcode(inst.offset);
+        const u32 next = inst.offset + 2;
+        const i32 j = next < size ? inst_at[next] : -1;
+        const u16 next_op = j >= 0 ? opcode(next) : 0;
+        const bool after_skip = inst.offset >= 2 && is_skip(opcode(inst.offset - 2));
+        edit_t &edit = edits[inst.index];
+
+        if (touched[i])
+            continue;
+
+        // Jumps and calls to a jp go straight to where that one leads
+        if (op >> 12 == 0x1 || op >> 12 == 0x2) {
+            std::string operand;
+            u32 addr = op & 0xFFF;
+            for (u32 hops = 0; hops < 16 && addr - starting_addr < size; hops++) {
+                const i32 k = inst_at[addr - starting_addr];
+                const u16 target_op = k >= 0 ? opcode(emitted[k].offset) : 0;
+                if (target_op >> 12 != 0x1 || (target_op & 0xFFF) == addr ||
+                        emitted[k].operand.find('$') != std::string::npos)
+                    break;
+                operand = emitted[k].operand;
+                addr = target_op & 0xFFF;
             }
-        } else if (!strcmp(opcode, "ldd")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+            if (!operand.empty() && addr != (op & 0xFFF)) {
+                edit.operand = operand;
+                touched[i] = changed = true;
             }
+        }
 
-            inst = 0xF015 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "lds")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        // The rest removes code, which $ arithmetic elsewhere wouldn't follow
+        if (relative || after_skip || touched[i])
+            continue;
 
-            inst = 0xF018 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "std")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+        if (((op & 0xF00F) == 0x8000 && (op >> 8 & 0xF) == (op >> 4 & 0xF)) ||     // ld vx,vx
+                ((op & 0xF000) == 0x7000 && (op & 0xFF) == 0) ||                    // add vx,0
+                ((op & 0xF000) == 0x1000 && (op & 0xFFF) == starting_addr + next)) { // jp to the next instruction
+            edit.drop = true;
+            touched[i] = changed = true;
+        } else if (j >= 0 && !target[next] && !touched[j] &&
+                   (op & 0xF000) == 0x7000 && (next_op & 0xFF00) == (op & 0xFF00) &&
+                   inst.operand.find('$') == std::string::npos && emitted[j].operand.find('$') == std::string::npos) {
+            // add vx,a then add vx,b is add vx,a+b, 7XNN leaves VF alone
+            edit.operand = "((" + inst.operand + ")+(" + emitted[j].operand + "))&0xFF";
+            edits[emitted[j].index].drop = true;
+            touched[i] = touched[j] = changed = true;
+        } else if (j >= 0 && !target[next] && !touched[j] && (op & 0xF000) == 0x2000 && next_op == 0x00EE) {
+            // call x then ret is jp x, the callee returns for us
+            edit.opcode = 0x1000;
+            edits[emitted[j].index].drop = true;
+            touched[i] = touched[j] = changed = true;
+        }
+    }
 
-            inst = 0xF007 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "wait")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    return changed;
+}
 
-            inst = 0xF00A + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "sprite")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+// Sections run from one start to the next, symbols and relocations are relative to theirs
+void Assembler::make_object() {
+    const u32 size = std::min(result->size, capacity);
+    auto section_of = [&](u32 offset) {
+        return (u32) (std::upper_bound(section_starts.begin(), section_starts.end(), offset) - section_starts.begin() - 1);
+    };
 
-            inst = 0xF029 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "bcd")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    object->code.assign(buffer, buffer + size);
+    object->sections.clear();
+    for (u32 i = 0; i < section_starts.size(); i++) {
+        const u32 end = i + 1 < section_starts.size() ? section_starts[i + 1] : size;
+        object->sections.push_back({section_starts[i], end - section_starts[i]});
+    }
 
-            inst = 0xF033 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "read")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
-            }
+    object->symbols.clear();
+    for (const auto &[name, value] : symtab) {
+        if (equs.count(name)) {
+            object->symbols.push_back({std::string(name), -1, value});
+        } else {
+            const u32 section = label_sections[name];
+            object->symbols.push_back({std::string(name), (i32) section, (i32) (value - section_starts[section])});
+        }
+    }
 
-            inst = 0xF065 + (hextodec(operand + 1) << 8);
-        } else if (!strcmp(opcode, "write")) {
-            if (strlen(operand) != 2 || !is_vx(operand)) {
-                SDL_Log("line %d: Invalid operand(s)\n", line_no);
-                return false;
+    object->files = result->map.files;
+    object->lines = result->map.lines;
+
+    object->relocs.clear();
+    for (const fixup_t &fixup : fixups) {
+        const u32 section = section_of(fixup.offset);
+        object->relocs.push_back({section, fixup.offset - section_starts[section], fixup.here - section_starts[section],
+                                  fixup.field, std::string(fixup.expr)});
+    }
+}
+
+// Line number, address, bytes and text of every line of the last pass. Expanded lines
+// are marked with a '+' for every level of macros they are in.
+void Assembler::make_listing() {
+    std::string &out = result->listing;
+    u32 last_file = 0;
+    char column[64];
+
+    for (size_t i = 0; i < listed.size(); i++) {
+        const listed_t &line = listed[i];
+        const u32 end = std::min(line.offset + line.size, capacity);
+        // An invocation's bytes are listed with the lines it expanded to
+        const u32 size = i + 1 < listed.size() && listed[i + 1].expansion > line.expansion ? 0 : end - std::min(line.offset, end);
+
+        if (line.file != last_file) {
+            out += "; " + (sources[line.file].path.empty() ? std::string("source") : sources[line.file].path) + "\n";
+            last_file = line.file;
+        }
+
+        if (line.expansion)
+            snprintf(column, sizeof column, "%5s%-3.*s %04X  ", "", (int) std::min(line.expansion, 3u), "+++", starting_addr + line.offset);
+        else
+            snprintf(column, sizeof column, "%5u    %04X  ", line.line_no, starting_addr + line.offset);
+        out += column;
+
+        // Four bytes a row, long data and fills are cut short
+        for (u32 row = 0; row == 0 || (row * 4 < size && row < 4); row++) {
+            if (row)
+                out += "\n               ";
+            std::string bytes;
+            for (u32 j = row * 4; j < size && j < row * 4 + 4; j++) {
+                snprintf(column, sizeof column, "%02X", buffer[line.offset + j]);
+                bytes += column;
+                if (j & 1)
+                    bytes += ' ';
             }
+            if (row == 3 && size > 16)
+                bytes = "... " + std::to_string(size) + " bytes";
+            if (!row)
+                bytes.resize(std::max<size_t>(bytes.size(), 12), ' ');
+            else if (!bytes.empty() && bytes.back() == ' ')
+                bytes.pop_back();
+            out += bytes;
+            if (!row) {
+                std::string_view text = line.text;
+                if (!text.empty() && text.back() == '\r')
+                    text.remove_suffix(1);
+                out += text;
+            }
+        }
+        out += '\n';
+    }
+}
 
-            inst = 0xF055 + (hextodec(operand + 1) << 8);
-        } else {
-            SDL_Log("line %d: Invalid opcode(s)\n", line_no);
-            return false;
+// Assemble sources[0] and what it includes, which stay mapped until this returns
+bool Assembler::build(const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result) {
+    this->result = result;
+    this->buffer = buffer;
+    this->capacity = capacity;
+    this->starting_addr = starting_addr;
+    result->symtab.clear();
+    edits.clear();
+
+    bool success = pass();
+    result->unoptimized_size = result->size;
+    result->unoptimized_insts = result->insts;
+
+    if (success && optimize) {
+        // Every pass can open up more, e.g. a dropped ld makes a jp point to the next instruction
+        edits.resize(inst_no);
+        for (u32 round = 0; round < ASM_PEEPHOLE_ROUNDS && peephole(); round++) {
+            if (!(success = pass()))
+                break;
         }
 
-        u16 rev = ((inst & 0x00FF) << 8) + ((inst & 0xFF00) >> 8);
-        fwrite(&rev, 1, 2, output);
-        line_no++;
+        // The program only got shorter, clear what is left of the first pass
+        if (success)
+            memset(buffer + result->size, 0, std::min(result->unoptimized_size, capacity) - result->size);
+    }
+
+    result->symtab.reserve(symtab.size());
+    for (const auto &[name, value] : symtab)
+        result->symtab.emplace(name, value);
+
+    std::vector<source_symbol_t> labels;
+    for (const auto &[name, value] : symtab) {
+        if (!equs.count(name))
+            labels.push_back({(u16) value, 0, std::string(name)});
     }
+    result->map.files.clear();
+    for (const source_t &source : sources)
+        result->map.files.push_back(source.path);
+    result->map.set_symbols(std::move(labels), starting_addr + result->size);
 
-    if (source) fclose(source);
-    if (output) fclose(output);
+    if (success && object)
+        make_object();
+    result->listing.clear();
+    if (listing)
+        make_listing();
+
+    // Names, fixups and macros point into the sources, nothing may use them from here on
+    symtab.clear();
+    label_sections.clear();
+    fixups.clear();
+    macros.clear();
+    expansions.clear();
+    listed.clear();
+    for (u32 i = 1; i < sources.size(); i++)
+        unmap_file(sources[i].data, sources[i].size);
+    sources.clear();
+
+    return success;
+}
+
+bool Assembler::assemble(const char *source, u32 size, const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result) {
+    object = NULL;
+    sources.assign(1, {"", source, size, false});
+    return build(starting_addr, buffer, capacity, result);
+}
 
-    return true;    // Success
-}
\ No newline at end of file
+bool Assembler::assemble(const char *file_path, const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result) {
+    this->result = result;
+    line_no = 0;
+    file = 0;
+    result->size = 0;
+    result->errors.clear();
+    result->symtab.clear();
+    result->map.clear();
+
+    u32 size;
+    const char *source = map_file(file_path, &size);
+    if (!source)
+        return error("Could not open %s: %s", file_path, strerror(errno));
+
+    object = NULL;
+    sources.assign(1, {file_path, source, size, is_octo(file_path)});
+    const bool success = build(starting_addr, buffer, capacity, result);
+
+    unmap_file(source, size);
+    return success;
+}
+
+bool Assembler::compile(const char *file_path, asm_object_t *object, assembly_t *result) {
+    this->result = result;
+    line_no = 0;
+    file = 0;
+    result->size = 0;
+    result->errors.clear();
+    result->symtab.clear();
+    result->map.clear();
+
+    if (is_octo(file_path))
+        return error("Octo sources can only be assembled into a program");
+
+    u32 size;
+    const char *source = map_file(file_path, &size);
+    if (!source)
+        return error("Could not open %s: %s", file_path, strerror(errno));
+
+    // Code is placed at 0 and moved by the linker, which also has the last word on its size
+    std::vector<u8> code(0x10000);
+    const bool optimized = optimize;
+    optimize = false;
+    this->object = object;
+    sources.assign(1, {file_path, source, size, false});
+    const bool success = build(0, code.data(), code.size(), result);
+    this->object = NULL;
+    optimize = optimized;
+
+    unmap_file(source, size);
+    return success;
+}
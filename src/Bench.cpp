@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "../include/Chip8.h"
+
+#define BENCH_INSTS 2000000     // Instructions timed per opcode benchmark run
+#define BENCH_FRAMES 20000      // Frames timed per frame loop benchmark run
+#define BENCH_RUNS 5            // Best of N runs is reported
+
+// Synthetic ROM, loaded at 0x200
+struct bench_rom_t {
+    std::string name;
+    std::vector<u8> code;
+    extension_t extension;
+};
+
+// Assemble a list of opcodes into a ROM image
+static std::vector<u8> rom_image(const std::vector<u16> &opcodes) {
+    std::vector<u8> code;
+    for (u16 opcode : opcodes) {
+        code.push_back(opcode >> 8);
+        code.push_back(opcode & 0xFF);
+    }
+    return code;
+}
+
+// Setup opcodes, then `body` repeated to fill the loop, then a jump back to the loop
+static bench_rom_t opcode_rom(const std::string &name, const std::vector<u16> &setup,
+                              const std::vector<u16> &body, extension_t extension = CHIP8) {
+    std::vector<u16> opcodes = setup;
+    const Address loop = 0x200 + 2 * setup.size();
+
+    for (u32 i = 0; i < 240 / body.size(); i++)
+        opcodes.insert(opcodes.end(), body.begin(), body.end());
+    opcodes.push_back(0x1000 | loop);
+
+    return {name, rom_image(opcodes), extension};
+}
+
+// Per opcode family benchmarks
+static std::vector<bench_rom_t> opcode_roms() {
+    // Registers used as operands, I points at scratch memory after the code
+    const std::vector<u16> regs = {0x6012, 0x6134, 0x6256, 0x6378, 0x6405, 0x6503, 0xA800};
+
+    return {
+        opcode_rom("ld_vx_nn", regs, {0x6A42}),
+        opcode_rom("add_vx_nn", regs, {0x7A01}),
+        opcode_rom("alu_8xy0", regs, {0x8010}),
+        opcode_rom("alu_8xy1", regs, {0x8011}),
+        opcode_rom("alu_8xy2", regs, {0x8012}),
+        opcode_rom("alu_8xy3", regs, {0x8013}),
+        opcode_rom("alu_8xy4", regs, {0x8014}),
+        opcode_rom("alu_8xy5", regs, {0x8015}),
+        opcode_rom("alu_8xy6", regs, {0x8016}),
+        opcode_rom("alu_8xy7", regs, {0x8017}),
+        opcode_rom("alu_8xye", regs, {0x801E}),
+        // Skips over a harmless ld, taken and not taken
+        opcode_rom("skip_3xnn_taken", regs, {0x3012, 0x6A00}),
+        opcode_rom("skip_3xnn_not_taken", regs, {0x3000, 0x6A00}),
+        opcode_rom("skip_4xnn", regs, {0x4000, 0x6A00}),
+        opcode_rom("skip_5xy0", regs, {0x5010, 0x6A00}),
+        opcode_rom("skip_9xy0", regs, {0x9010, 0x6A00}),
+        opcode_rom("skip_ex9e", regs, {0xE49E, 0x6A00}),
+        opcode_rom("skip_exa1", regs, {0xE4A1, 0x6A00}),
+        // Sprites from the font at varying heights, and across the right edge
+        opcode_rom("drw_n1", {0x600A, 0x610A, 0xA000}, {0xD011}),
+        opcode_rom("drw_n5", {0x600A, 0x610A, 0xA000}, {0xD015}),
+        opcode_rom("drw_n15", {0x600A, 0x610A, 0xA000}, {0xD01F}),
+        opcode_rom("drw_n15_clip", {0x603C, 0x611A, 0xA000}, {0xD01F}),
+        opcode_rom("drw_n15_wrap", {0x603C, 0x611A, 0xA000}, {0xD01F}, XOCHIP),
+        opcode_rom("drw_16x16_hires", {0x00FF, 0x603C, 0x611A, 0xA000}, {0xD010}, SUPERCHIP8),
+        opcode_rom("bcd_fx33", regs, {0xF033}),
+        // Restore I so load/store stays on the scratch area whatever the quirks
+        opcode_rom("store_fx55", regs, {0xFF55, 0xA800}),
+        opcode_rom("load_fx65", regs, {0xFF65, 0xA800}),
+        // CALL straight into a RET placed after the loop
+        {"call_ret", rom_image({0x2206, 0x2206, 0x1200, 0x00EE}), CHIP8},
+    };
+}
+
+// Small programs shaped like games, timed a whole frame at a time
+static std::vector<bench_rom_t> frame_roms() {
+    return {
+        // Bounce a sprite: erase, move, draw, wait for the delay timer
+        {"frame_sprite_move", rom_image({
+            0x6000, 0x6100, 0xA000,
+            0xD015, 0x7001, 0x7101, 0xD015,     // 0x206: erase and redraw
+            0x6201, 0xF215,                     // delay timer
+            0x1206,
+        }), CHIP8},
+        // Score counter: BCD, then draw three digits
+        {"frame_score", rom_image({
+            0x6300, 0xA400,
+            0x7301, 0xF333, 0xF265,             // 0x204
+            0x00E0,
+            0x6400, 0x6500,
+            0xF029, 0xD455, 0x7405,
+            0xF129, 0xD455, 0x7405,
+            0xF229, 0xD455,
+            0xA400, 0x1204,
+        }), CHIP8},
+        // Copy 10 byte blocks around memory through the registers
+        {"frame_memcpy", rom_image({
+            0x6A00,
+            0xA000, 0xFA1E, 0xF965,             // 0x202
+            0xA800, 0xFA1E, 0xF955,
+            0x7A10, 0x1202,
+        }), CHIP8},
+        // Scroll a hi-res screen every frame
+        {"frame_schip_scroll", rom_image({
+            0x00FF, 0x6000, 0x6100, 0xA000,
+            0xD010, 0x00C1, 0x00FB, 0x7008,     // 0x208
+            0x1208,
+        }), SUPERCHIP8},
+    };
+}
+
+// Write the ROM where init_chip8 can load it
+static bool load_rom(Chip8 *chip8, config_t *config, const char *dir, const bench_rom_t &rom) {
+    const std::string path = std::string(dir) + "/bench_" + rom.name + ".ch8";
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file) {
+        fprintf(stderr, "Could not write %s\n", path.c_str());
+        return false;
+    }
+    fwrite(rom.code.data(), 1, rom.code.size(), file);
+    fclose(file);
+
+    config->current_extension = rom.extension;
+    return chip8->init_chip8(config, path.c_str());
+}
+
+// Nanoseconds per instruction, best of BENCH_RUNS
+static f64 bench_insts(Chip8 *chip8, const config_t &config) {
+    f64 best = 1e30;
+
+    for (u32 run = 0; run < BENCH_RUNS; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (u32 i = 0; i < BENCH_INSTS; i++)
+            chip8->emulate_inst(config);
+        const auto end = std::chrono::steady_clock::now();
+
+        best = std::min(best, std::chrono::duration<f64, std::nano>(end - start).count() / BENCH_INSTS);
+    }
+
+    return best;
+}
+
+// Nanoseconds per emulator frame (instruction burst + timers), best of BENCH_RUNS
+static f64 bench_frames(Chip8 *chip8, const config_t &config) {
+    const u32 insts_per_frame = config.insts_per_second / config.refresh_rate;
+    f64 best = 1e30;
+
+    for (u32 run = 0; run < BENCH_RUNS; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (u32 frame = 0; frame < BENCH_FRAMES; frame++) {
+            chip8->vblank = true;
+            for (u32 i = 0; i < insts_per_frame; i++)
+                chip8->emulate_inst(config);
+            if (chip8->delay_timer > 0)
+                chip8->delay_timer--;
+            if (chip8->sound_timer > 0)
+                chip8->sound_timer--;
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        best = std::min(best, std::chrono::duration<f64, std::nano>(end - start).count() / BENCH_FRAMES);
+    }
+
+    return best;
+}
+
+// Read name,value rows of a previous run
+static std::map<std::string, f64> read_csv(const char *path) {
+    std::map<std::string, f64> results;
+    FILE *file = fopen(path, "r");
+    char line[256], name[128];
+    f64 value;
+
+    if (!file)
+        return results;
+    while (fgets(line, sizeof line, file))
+        if (sscanf(line, "%127[^,],%lf", name, &value) == 2)
+            results[name] = value;
+    fclose(file);
+
+    return results;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = "build";
+    const char *csv_path = NULL;
+    const char *baseline_path = NULL;
+    f64 threshold = 10.0;   // Allowed slowdown vs. baseline in percent
+
+    for (i32 i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--dir") && i + 1 < argc)
+            dir = argv[++i];
+        else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+            csv_path = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--dir <build dir>] [--csv <out.csv>] [--baseline <baseline.csv>] [--threshold <percent>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    static Chip8 chip8;     // Too big for the stack
+    config_t config = {
+        .window_width = 64,
+        .window_height = 32,
+        .insts_per_second = 700,
+        .current_extension = CHIP8,
+        .quirks = QUIRKS_AUTO,
+        .refresh_rate = 60,
+    };
+    std::vector<std::pair<std::string, f64>> results;
+
+    srand(0);
+
+    for (const bench_rom_t &rom : opcode_roms()) {
+        if (!load_rom(&chip8, &config, dir, rom))
+            exit(EXIT_FAILURE);
+        results.push_back({"ns_per_inst/" + rom.name, bench_insts(&chip8, config)});
+    }
+
+    for (const bench_rom_t &rom : frame_roms()) {
+        if (!load_rom(&chip8, &config, dir, rom))
+            exit(EXIT_FAILURE);
+        results.push_back({"ns_per_frame/" + rom.name, bench_frames(&chip8, config)});
+    }
+
+    chip8.free_chip8();
+
+    // CSV to stdout and the results file
+    FILE *csv = csv_path ? fopen(csv_path, "w") : NULL;
+    if (csv_path && !csv) {
+        fprintf(stderr, "Could not write %s\n", csv_path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("benchmark,ns\n");
+    if (csv)
+        fprintf(csv, "benchmark,ns\n");
+    for (const auto &[name, ns] : results) {
+        printf("%s,%0.3f\n", name.c_str(), ns);
+        if (csv)
+            fprintf(csv, "%s,%0.3f\n", name.c_str(), ns);
+    }
+    if (csv)
+        fclose(csv);
+
+    if (!baseline_path)
+        exit(EXIT_SUCCESS);
+
+    // Compare against the stored baseline
+    const std::map<std::string, f64> baseline = read_csv(baseline_path);
+    if (baseline.empty()) {
+        // Nothing to compare against is a failure, not a pass
+        fprintf(stderr, "No baseline at %s, run make bench-baseline to store these results as one\n", baseline_path);
+        exit(EXIT_FAILURE);
+    }
+
+    u32 regressions = 0;
+    for (const auto &[name, ns] : results) {
+        auto it = baseline.find(name);
+        if (it == baseline.end() || it->second <= 0)
+            continue;
+
+        const f64 change = 100.0 * (ns - it->second) / it->second;
+        if (change > threshold) {
+            printf("REGRESSION %s: %0.3f -> %0.3f ns (%+0.1f%%)\n", name.c_str(), it->second, ns, change);
+            regressions++;
+        }
+    }
+
+    printf("%u regression(s) over %0.1f%% against %s\n", regressions, threshold, baseline_path);
+    exit(regressions ? EXIT_FAILURE : EXIT_SUCCESS);
+}
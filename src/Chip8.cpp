@@ -1,10 +1,18 @@
 #include <iostream>
 #include <algorithm>
+#include <string>
 #include "../include/Chip8.h"
 #include "../include/Assembler.h"
+#include "../include/Debug.h"
+#include "../include/Profiler.h"
+#include "../include/Latency.h"
+#include "../include/Metrics.h"
+#include "../include/Heatmap.h"
+#include "../include/GdbStub.h"
+#include "../include/TraceDb.h"
 
 // Initialize CHIP8 machine
-bool Chip8::init_chip8(const config_t *config, const char *file_path) {
+bool Chip8::init_chip8(const config_t *config, const char *file_path, const u8 *image, u32 image_size) {
     const Address entry_point = 0x200; // Chip-8 Roms will be loaded to 0x200
 
     const u8 font[] = {
@@ -26,66 +34,171 @@ bool Chip8::init_chip8(const config_t *config, const char *file_path) {
         0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
     };
 
+    // SUPER-CHIP 8x10 font (A-F as in Octo)
+    const u8 big_font[] = {
+        0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,   // 0
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,   // 1
+        0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,   // 2
+        0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,   // 3
+        0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,   // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,   // 5
+        0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,   // 6
+        0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,   // 7
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,   // 8
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,   // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,   // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,   // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,   // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,   // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,   // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0,   // F
+    };
+
+    // Keep the XO-CHIP memory block across resets, it is cleared below
+    u8 *xo_ram = (ram && ram != core_ram) ? ram : NULL;
+
     // Initialize entire Chip-8 machine
     memset(this, 0, sizeof(Chip8));
 
+    if (config->current_extension == XOCHIP) {
+        if (!xo_ram && !(xo_ram = (u8 *) malloc(XO_RAM_SIZE + RAM_PADDING))) {
+            SDL_Log("Could not allocate XO-CHIP memory\n");
+            return false;
+        }
+        memset(xo_ram, 0, XO_RAM_SIZE + RAM_PADDING);
+        ram = xo_ram;
+        ram_size = XO_RAM_SIZE;
+    } else {
+        free(xo_ram);
+        ram = core_ram;
+        ram_size = RAM_SIZE;
+    }
+
     // Load font 
-    memcpy(&ram, font, sizeof(font));
+    memcpy(ram, font, sizeof(font));
+    memcpy(&ram[BIG_FONT_ADDR], big_font, sizeof(big_font));
 
-    u32 file_path_len = strlen(file_path) + 1;
-    char rom_name[std::max((u32) 8, file_path_len)];
+    const u32 file_path_len = strlen(file_path) + 1;
 
-    if (strncmp(file_path + file_path_len - 5, ".ch8", 4)) {
-        // Assemble the program
+    if (image) {
+        // Program the caller already has, e.g. reassembled by the watch mode
+        memcpy(&ram[entry_point], image, std::min<u32>(image_size, ram_size - entry_point));
+    } else if (strncmp(file_path + file_path_len - 5, ".ch8", 4)) {
+        // Assemble the program straight into memory
         Assembler assembler;
-        if (!assembler.assemble(file_path, entry_point)) {
+        assembly_t program;
+        assembler.optimize = config->optimize;
+        if (!assembler.assemble(file_path, entry_point, &ram[entry_point], ram_size - entry_point, &program)) {
+            for (const std::string &error : program.errors)
+                SDL_Log("%s: %s\n", file_path, error.c_str());
             SDL_Log("Couldn't assemble the program %s\n", file_path);
             return false;
         }
 
-        // Assembler assembles the program to out.ch8
-        strncpy(rom_name, "build/out.ch8", 14);
+        if (config->optimize)
+            SDL_Log("%s: optimized from %u to %u bytes, %u to %u instructions\n", file_path,
+                    program.unoptimized_size, program.size, program.unoptimized_insts, program.insts);
+        source_map = std::move(program.map);
     } else {
-        strncpy(rom_name, file_path, file_path_len);
-    }
+        // A ROM built by chip8-as has its source map next to it
+        const std::string map_path = std::string(file_path, file_path_len - 5) + ".map";
+        if (!source_map.load(map_path.c_str()))
+            source_map.clear();
 
-    // Open ROM file
-    FILE *rom = fopen(rom_name, "rb");
+        // Open ROM file
+        FILE *rom = fopen(file_path, "rb");
 
-    if (!rom) {
-        SDL_Log("Rom file %s is invalid or does not exist\n", rom_name);
-        return false;
-    }
+        if (!rom) {
+            SDL_Log("Rom file %s is invalid or does not exist\n", file_path);
+            return false;
+        }
 
-    // Get/check rom size
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof ram - entry_point;
-    rewind(rom);
+        // Get/check rom size
+        fseek(rom, 0, SEEK_END);
+        const size_t rom_size = ftell(rom);
+        const size_t max_size = ram_size - entry_point;
+        rewind(rom);
 
-    if (rom_size > max_size) {
-        SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n",
-                rom_name, (long long unsigned) rom_size, (long long unsigned) max_size);
-        return false;
-    }
+        if (rom_size > max_size) {
+            SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n",
+                    file_path, (long long unsigned) rom_size, (long long unsigned) max_size);
+            fclose(rom);
+            return false;
+        }
 
-    // Load ROM
-    if (fread(&ram[entry_point], rom_size, 1, rom) != 1) {
-        SDL_Log("Could not read Rom file %s into CHIP8 memory\n", rom_name);
-        return false;
-    }
+        // Load ROM
+        if (fread(&ram[entry_point], rom_size, 1, rom) != 1) {
+            SDL_Log("Could not read Rom file %s into CHIP8 memory\n", file_path);
+            fclose(rom);
+            return false;
+        }
 
-    fclose(rom);
+        fclose(rom);
+    }
     
     // Set Chip-8 machine defaults
-    this->rom_name = rom_name;
+    this->rom_name = file_path;
     PC = entry_point;    // Start program counter at ROM entry point
     SP = 15;             // Empty stack
-    memset(&pixel_color, config->bg_color, sizeof pixel_color); // Init pixels to bg color
+    planes = 0x1;        // Draw to plane 0 only
+    rng = rand() | 1;    // Seeded by the emulator, xorshift needs a non-zero state
+    fx0a_key = 0xFF;     // FX0A isn't waiting on a key
+    std::fill_n(pixel_color, DISPLAY_WIDTH * DISPLAY_HEIGHT, config->bg_color); // Init pixels to bg color
+    dirty_rows = ~0ULL;
+    rehash();
+
+    // Pick the interpreter specialized for this ROM's quirks and debug options
+    select_interpreter(config);
+
+    // Restore RPL user flags saved by a previous run of this ROM
+    if (config->current_extension != CHIP8)
+        load_rpl();
 
     return true;    // Success
 }
 
+// Interpreter instantiation for a quirk profile
+template <typename Debug>
+static void (Chip8::*quirks_interpreter(const config_t *config))(const config_t &) {
+    quirks_t quirks = config->quirks;
+
+    if (quirks == QUIRKS_AUTO) {
+        switch (config->current_extension) {
+            case CHIP8:      quirks = QUIRKS_STANDARD; break;
+            case SUPERCHIP8: quirks = QUIRKS_SCHIP; break;
+            case XOCHIP:     quirks = QUIRKS_XOCHIP; break;
+        }
+    }
+
+    switch (quirks) {
+        case QUIRKS_VIP:    return &Chip8::execute<quirks_vip, Debug>;
+        case QUIRKS_SCHIP:  return &Chip8::execute<quirks_schip, Debug>;
+        case QUIRKS_XOCHIP: return &Chip8::execute<quirks_xochip, Debug>;
+        default:            return &Chip8::execute<quirks_standard, Debug>;
+    }
+}
+
+// Select the interpreter once, the debug one only if any of its logs or the profiler are enabled
+void Chip8::select_interpreter(const config_t *config) {
+    const bool debug = config->register_changes || config->memory_access || config->stack_operations ||
+                       config->profiler || config->latency_metrics || config->heatmap ||
+                       (config->trace_db && tracedb.active()) || gdb_stub.watching();
+
+    if (debug)
+        interpreter = quirks_interpreter<debug_on>(config);
+    else if (config->instruction_execution)
+        interpreter = quirks_interpreter<debug_insts>(config);
+    else
+        interpreter = quirks_interpreter<debug_off>(config);
+}
+
+// Release XO-CHIP memory
+void Chip8::free_chip8() {
+    if (ram != core_ram)
+        free(ram);
+    ram = core_ram;
+}
+
 void Chip8::push(u16 data) {
     if (SP == 0)
         return;
@@ -98,17 +211,224 @@ u16 Chip8::pop() {
     return stack[SP++];
 }
 
-void Chip8::emulate_inst(const config_t &config) {
+void Chip8::rehash() {
+    ram_hash = display_hash = 0;
+    memset(chunk_hash, 0, sizeof chunk_hash);
+    memset(row_hash, 0, sizeof row_hash);
+    memset(stale_chunks, 0xFF, sizeof stale_chunks);
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+}
+
+// Fold in the stale chunks and rows, then a few words of registers
+u64 Chip8::state_hash() {
+    const u32 chunks = (ram_size + RAM_PADDING) / HASH_CHUNK;
+    for (u32 w = 0; w < (HASH_CHUNKS + 63) / 64; w++) {
+        for (u64 bits = stale_chunks[w]; bits; bits &= bits - 1) {
+            const u32 chunk = w * 64 + __builtin_ctzll(bits);
+            if (chunk >= chunks)
+                break;
+            u64 hash = 0;
+            for (u32 addr = chunk * HASH_CHUNK; addr < (chunk + 1) * HASH_CHUNK; addr++)
+                if (ram[addr])
+                    hash ^= hash_mix((u64) addr << 8 | ram[addr]);
+            ram_hash ^= chunk_hash[chunk] ^ hash;
+            chunk_hash[chunk] = hash;
+        }
+        stale_chunks[w] = 0;
+    }
+
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+        for (u64 bits = stale_rows[p]; bits; bits &= bits - 1) {
+            const u8 y = __builtin_ctzll(bits);
+            const u128 row = display[p][y];
+            const u64 hash = row ? hash_mix(hash_mix((1ULL << 32 | p << 8 | y) ^ (u64) (row >> 64)) ^ (u64) row) : 0;
+            display_hash ^= row_hash[p][y] ^ hash;
+            row_hash[p][y] = hash;
+        }
+        stale_rows[p] = 0;
+    }
+
+    u64 words[4], regs[4] = {};
+    memcpy(words, V, sizeof V);
+    memcpy(&words[2], stack, sizeof(u64));
+    memcpy(&words[3], &stack[4], sizeof(u64));
+    regs[0] = (u64) PC << 48 | (u64) I << 32 | (u64) SP << 16 | delay_timer << 8 | sound_timer;
+    regs[1] = (u64) hires << 8 | planes;
+    memcpy(&regs[2], &stack[8], 2 * sizeof(u64));
+
+    u64 hash = ram_hash ^ display_hash;
+    for (u8 i = 0; i < 4; i++) {
+        hash = hash_mix(hash ^ words[i]);
+        hash = hash_mix(hash ^ regs[i]);
+    }
+    return hash;
+}
+
+// Clear the selected planes (every plane outside of XO-CHIP is plane 0)
+void Chip8::clear_planes() {
+    for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        if (planes & (1 << p))
+            memset(display[p], 0, sizeof(display[p]));
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+    draw = true;
+    dirty_rows = ~0ULL;
+}
+
+// Scroll display up by n rows of the current resolution (XO-CHIP)
+void Chip8::scroll_up(u8 n) {
+    const u8 height = display_height();
+    if (n > height)
+        n = height;
+
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        memmove(&display[p][0], &display[p][n], (height - n) * sizeof(u128));
+        memset(&display[p][height - n], 0, n * sizeof(u128));
+    }
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+    draw = true;
+    dirty_rows = ~0ULL;
+}
+
+// Scroll display down by n rows of the current resolution
+void Chip8::scroll_down(u8 n) {
+    const u8 height = display_height();
+    if (n > height)
+        n = height;
+
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        memmove(&display[p][n], &display[p][0], (height - n) * sizeof(u128));
+        memset(&display[p][0], 0, n * sizeof(u128));
+    }
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+    draw = true;
+    dirty_rows = ~0ULL;
+}
+
+// Scroll display right by n pixels, pixels shifted off the edge are lost
+void Chip8::scroll_right(u8 n) {
+    // Lo-res lives in the upper 64 bits, don't let it spill into the lower half
+    const u128 mask = hires ? ~(u128) 0 : ~(u128) 0 << (DISPLAY_WIDTH / 2);
+
+    for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        if (planes & (1 << p))
+            for (u8 y = 0; y < display_height(); y++)
+                display[p][y] = (display[p][y] >> n) & mask;
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+    draw = true;
+    dirty_rows = ~0ULL;
+}
+
+// Scroll display left by n pixels
+void Chip8::scroll_left(u8 n) {
+    for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        if (planes & (1 << p))
+            for (u8 y = 0; y < display_height(); y++)
+                display[p][y] <<= n;
+    memset(stale_rows, 0xFF, sizeof stale_rows);
+    draw = true;
+    dirty_rows = ~0ULL;
+}
+
+// RPL flags are stored next to the ROM as <rom>.rpl
+void Chip8::load_rpl() {
+    std::string path = std::string(rom_name) + ".rpl";
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+        return;
+    if (fread(rpl, sizeof rpl, 1, file) != 1)
+        memset(rpl, 0, sizeof rpl);
+    fclose(file);
+}
+
+void Chip8::save_rpl() {
+    std::string path = std::string(rom_name) + ".rpl";
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file) {
+        SDL_Log("Could not save RPL flags to %s\n", path.c_str());
+        return;
+    }
+    fwrite(rpl, sizeof rpl, 1, file);
+    fclose(file);
+}
+
+// Skip the next instruction, XO-CHIP F000 NNNN is 4 bytes long
+void Chip8::skip(const config_t &config) {
+    if (config.current_extension == XOCHIP && ram[PC] == 0xF0 && ram[PC + 1] == 0x00)
+        PC += 2;
+    PC += 2;
+}
+
+// Position a left-aligned sprite row at X on a display row of the given width,
+// the result is in display row layout (leftmost pixel in the MSB)
+template <bool clip>
+static inline u128 place_sprite_row(u128 row, u8 x, u8 width) {
+    // Work in the low `width` bits so wrapping is a rotate within the screen
+    row >>= DISPLAY_WIDTH - width;
+
+    if (clip || x == 0)
+        row >>= x;
+    else
+        row = (row >> x) | (row << (width - x));
+
+    return row << (DISPLAY_WIDTH - width);
+}
+
+template <typename Quirks, typename Debug>
+void Chip8::execute(const config_t &config) {
     // Fetch, Decode and Execute a Chip-8 instruction
 
-    // TODO:
-    // chip8 variant changes for the following (read guide & queso):
-    // 8XY1, 8XY2, 8XY3, 8XY6, 8XYE, BNNN, FX55, FX65
+    // Debug state, all of it is compiled out of the debug_off interpreter
+    const Address inst_pc = PC;
+    const Address prev_I = I;
+    u8 prev_V[16];
+    if constexpr (Debug::enabled)
+        if (config.register_changes || (config.trace_db && tracedb.active()))
+            memcpy(prev_V, V, sizeof V);
+
+    // Queue a debug record for this instruction
+    auto debug = [&](u8 event, u16 arg, u8 reg = 0) {
+        debug_push({
+            .pc = inst_pc,
+            .opcode = inst.opcode,
+            .arg = arg,
+            .event = event,
+            .reg = reg,
+        });
+    };
+
+    // Memory accesses of len bytes for the heatmap, trace database and GDB watchpoints
+    auto mem_read = [&](u32 addr, u32 len) {
+        if (config.heatmap && heatmap.active())
+            heatmap.read(addr, len);
+        if (gdb_stub.watching())
+            gdb_stub.access(addr, len, false);
+    };
+    auto mem_write = [&](u32 addr, u32 len) {
+        if (config.heatmap && heatmap.active())
+            heatmap.write(addr, len);
+        if (config.trace_db && tracedb.active())
+            tracedb.write(addr, len);
+        if (gdb_stub.watching())
+            gdb_stub.access(addr, len, true);
+    };
 
     // Fetch
     inst.opcode = (ram[PC] << 8) + ram[PC + 1];
-    if (config.memory_access)
-        printf("Memory read at %04X\n", PC);
+    insts++;
+    if constexpr (Debug::enabled) {
+        if (config.memory_access)
+            debug(DEBUG_MEM_READ, PC);
+        if (config.heatmap && heatmap.active())
+            heatmap.exec(PC, 2);
+        if (config.trace_db && tracedb.active())
+            tracedb.inst(*this);
+    }
     PC += 2;
 
     // Decode
@@ -119,8 +439,20 @@ void Chip8::emulate_inst(const config_t &config) {
     inst.X = (inst.opcode & 0x0F00) >> 8;
     inst.Y = (inst.opcode & 0x00F0) >> 4;
 
-    if (config.instruction_execution)
-        debug_inst();
+    if constexpr (Debug::enabled || Debug::insts) {
+        if (Debug::insts || config.instruction_execution) {
+            // Only the value its log line shows, I unless it's a timer or F000 NNNN
+            const u16 op = inst.opcode & 0xF0FF;
+            debug(DEBUG_INST, inst.category != 0xF ? prev_I :
+                              inst.opcode == 0xF000 ? (ram[PC] << 8) + ram[PC + 1] :
+                              op == 0xF018 ? sound_timer :
+                              op == 0xF007 || op == 0xF015 ? delay_timer : prev_I);
+        }
+    }
+    if constexpr (Debug::enabled) {
+        if (config.profiler)
+            profiler.inst(inst_pc, inst.opcode);
+    }
 
     // Execute
     switch (inst.category) {
@@ -128,15 +460,58 @@ void Chip8::emulate_inst(const config_t &config) {
             switch (inst.NNN) {
                 // 00E0 - CLS
                 case 0x0E0:
-                    memset(display, false, sizeof(display));
-                    draw = true;
+                    clear_planes();
                     break;
                 
                 // 00EE - RET
                 case 0x0EE:
                     PC = pop();
-                    if (config.stack_operations)
-                        printf("Stack pop\n");
+                    if constexpr (Debug::enabled) {
+                        if (config.stack_operations)
+                            debug(DEBUG_STACK_POP, PC);
+                        if (config.profiler)
+                            profiler.ret();
+                    }
+                    break;
+
+                // 00FB - SCR (SUPER-CHIP)
+                case 0x0FB:
+                    if (config.current_extension != CHIP8)
+                        scroll_right(4);
+                    break;
+
+                // 00FC - SCL (SUPER-CHIP)
+                case 0x0FC:
+                    if (config.current_extension != CHIP8)
+                        scroll_left(4);
+                    break;
+
+                // 00FD - EXIT (SUPER-CHIP), halt on this instruction
+                case 0x0FD:
+                    if (config.current_extension != CHIP8)
+                        PC -= 2;
+                    break;
+
+                // 00FE - LOW (SUPER-CHIP)
+                // 00FF - HIGH (SUPER-CHIP)
+                case 0x0FE:
+                case 0x0FF:
+                    if (config.current_extension == CHIP8)
+                        break;
+                    hires = inst.NNN == 0x0FF;
+                    memset(display, 0, sizeof(display));
+                    memset(stale_rows, 0xFF, sizeof stale_rows);
+                    draw = true;
+                    dirty_rows = ~0ULL;
+                    break;
+
+                default:
+                    // 00CN - SCD nibble (SUPER-CHIP)
+                    if ((inst.NNN & 0xFF0) == 0x0C0 && config.current_extension != CHIP8)
+                        scroll_down(inst.N);
+                    // 00DN - SCU nibble (XO-CHIP)
+                    else if ((inst.NNN & 0xFF0) == 0x0D0 && config.current_extension == XOCHIP)
+                        scroll_up(inst.N);
                     break;
             }
             break;
@@ -149,29 +524,66 @@ void Chip8::emulate_inst(const config_t &config) {
         // 2NNN - CALL addr
         case 0x2:
             push(PC);
-            if (config.stack_operations)
-                printf("Stack push: %04X\n", PC);
+            if constexpr (Debug::enabled) {
+                if (config.stack_operations)
+                    debug(DEBUG_STACK_PUSH, PC);
+                if (config.profiler)
+                    profiler.call(inst.NNN);
+            }
             PC = inst.NNN;
             break;
 
         // 3XNN - SE Vx, byte
         case 0x3:
             if (V[inst.X] == inst.NN)
-                PC += 2;
+                skip(config);
             break;
         
         // 4XNN - SNE Vx, byte
         case 0x4:
             if (V[inst.X] != inst.NN)
-                PC += 2;
+                skip(config);
             break;
         
-        // 5XY0 - SE Vx, Vy
         case 0x5:
-            if (inst.N != 0x0)
-                return;
-            if (V[inst.X] == V[inst.Y])
-                PC += 2;
+            switch (inst.N) {
+                // 5XY0 - SE Vx, Vy
+                case 0x0:
+                    if (V[inst.X] == V[inst.Y])
+                        skip(config);
+                    break;
+
+                // 5XY2 - LD [I], Vx-Vy (XO-CHIP), I is left unchanged
+                case 0x2: {
+                    if (config.current_extension != XOCHIP)
+                        break;
+                    const i8 step = inst.X <= inst.Y ? 1 : -1;
+                    for (u8 i = 0, r = inst.X; i <= abs(inst.Y - inst.X); i++, r += step)
+                        ram[I + i] = V[r];
+                    touch(I, abs(inst.Y - inst.X) + 1);
+                    if constexpr (Debug::enabled) {
+                        if (config.memory_access)
+                            debug(DEBUG_MEM_WRITE, I);
+                        mem_write(I, abs(inst.Y - inst.X) + 1);
+                    }
+                }
+                    break;
+
+                // 5XY3 - LD Vx-Vy, [I] (XO-CHIP), I is left unchanged
+                case 0x3: {
+                    if (config.current_extension != XOCHIP)
+                        break;
+                    const i8 step = inst.X <= inst.Y ? 1 : -1;
+                    for (u8 i = 0, r = inst.X; i <= abs(inst.Y - inst.X); i++, r += step)
+                        V[r] = ram[I + i];
+                    if constexpr (Debug::enabled) {
+                        if (config.memory_access)
+                            debug(DEBUG_MEM_READ, I);
+                        mem_read(I, abs(inst.Y - inst.X) + 1);
+                    }
+                }
+                    break;
+            }
             break;
 
         // 6XNN - LD Vx, byte
@@ -194,46 +606,64 @@ void Chip8::emulate_inst(const config_t &config) {
                 // 8XY1 - OR Vx, Vy
                 case 0x1:
                     V[inst.X] |= V[inst.Y];
+                    if constexpr (Quirks::vf_reset)
+                        V[0xF] = 0;
                     break;
 
                 // 8XY2 - AND Vx, Vy
                 case 0x2:
                     V[inst.X] &= V[inst.Y];
+                    if constexpr (Quirks::vf_reset)
+                        V[0xF] = 0;
                     break;
 
                 // 8XY3 - XOR Vx, Vy
                 case 0x3:
                     V[inst.X] ^= V[inst.Y];
+                    if constexpr (Quirks::vf_reset)
+                        V[0xF] = 0;
                     break;
 
+                // VF is written after the result so it wins when X is F
+
                 // 8XY4 - ADD Vx, Vy
-                case 0x4:
-                    V[0xF] = V[inst.X] + V[inst.Y] > 255;
+                case 0x4: {
+                    const bool carry = V[inst.X] + V[inst.Y] > 255;
                     V[inst.X] += V[inst.Y];
+                    V[0xF] = carry;
+                }
                     break;
 
                 // 8XY5 - SUB Vx, Vy
-                case 0x5:
-                    V[inst.X] = abs(V[inst.X] - V[inst.Y]);
-                    V[0xF] = V[inst.X] >= V[inst.Y];
+                case 0x5: {
+                    const bool no_borrow = V[inst.X] >= V[inst.Y];
+                    V[inst.X] -= V[inst.Y];
+                    V[0xF] = no_borrow;
+                }
                     break;
 
                 // 8XY6 - SHR Vx {, Vy}
-                case 0x6:
-                    V[0xF] = V[inst.X] & 0x01;
-                    V[inst.X] >>= 1;
+                case 0x6: {
+                    const u8 value = Quirks::shift_vy ? V[inst.Y] : V[inst.X];
+                    V[inst.X] = value >> 1;
+                    V[0xF] = value & 0x01;
+                }
                     break;
 
                 // 8XY7 - SUBN Vx, Vy
-                case 0x7:
-                    V[inst.X] = abs(V[inst.Y] - V[inst.X]);
-                    V[0xF] = V[inst.Y] >= V[inst.X];
+                case 0x7: {
+                    const bool no_borrow = V[inst.Y] >= V[inst.X];
+                    V[inst.X] = V[inst.Y] - V[inst.X];
+                    V[0xF] = no_borrow;
+                }
                     break;
 
                 // 8XYE - SHL Vx {, Vy}  
-                case 0xE:
-                    V[0xF] = (V[inst.X] & 0x80) >> 7;
-                    V[inst.X] <<= 1;
+                case 0xE: {
+                    const u8 value = Quirks::shift_vy ? V[inst.Y] : V[inst.X];
+                    V[inst.X] = value << 1;
+                    V[0xF] = (value & 0x80) >> 7;
+                }
                     break;
             }
             break;
@@ -243,7 +673,7 @@ void Chip8::emulate_inst(const config_t &config) {
             if (inst.N != 0x0)
                 return;
             if (V[inst.X] != V[inst.Y])
-                PC += 2;
+                skip(config);
             break;
 
         // ANNN- LD I, addr
@@ -252,44 +682,79 @@ void Chip8::emulate_inst(const config_t &config) {
             break;
         
         // BNNN- JP V0, addr
+        // BXNN- JP Vx, addr (jump_vx quirk)
         case 0xB:
-            PC = V[0x0] + inst.NNN;
+            PC = V[Quirks::jump_vx ? inst.X : 0x0] + inst.NNN;
             break;
 
         // CXNN - RND Vx, byte
         case 0xC:
-            V[inst.X] = (rand() % 256) & inst.NN;
+            V[inst.X] = random() & inst.NN;
             break;
 
         // DXYN - DRW Vx, Vy, nibble
+        // DXY0 - DRW Vx, Vy, 0 draws a 16x16 sprite (SUPER-CHIP)
         case 0xD: {
-            u8 xc = V[inst.X] % config.window_width;
-            u8 yc = V[inst.Y] % config.window_height;
-            const u8 org_xc = xc;
-
-            V[0xF] = 0;
-
-            for (u8 i = 0; i < inst.N; i++) {
-                const u8 sprite_data = ram[I + i];
-                if (config.memory_access)
-                    printf("Memory read at %04X\n", I + i);
-                xc = org_xc;
-                
-                for (i8 j = 7; j >= 0; j--) {
-                    bool *pixel = &display[yc * 64 + xc];
-                    const bool sprite_bit = sprite_data & (1 << j);
-
-                    if (sprite_bit && *pixel)
-                        V[0xF] = 1;
-                    
-                    *pixel ^= sprite_bit;
+            if constexpr (Quirks::display_wait) {
+                // Spin on this instruction until the next frame starts
+                if (!vblank) {
+                    PC -= 2;
+                    break;
+                }
+                vblank = false;
+            }
 
-                    if (++xc >= 64) break;
+            const u8 width = display_width();
+            const u8 height = display_height();
+            const u8 xc = V[inst.X] % width;
+            const u8 yc = V[inst.Y] % height;
+            const bool big = inst.N == 0 && config.current_extension != CHIP8;
+            const u8 rows = big ? 16 : inst.N;
+            const u8 visible = Quirks::clip_sprites ? std::min<u8>(rows, height - yc) : rows;
+            u16 addr = I;   // XO-CHIP planes take consecutive sprites
+            u8 collisions = 0;
+
+            for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+                if (!(planes & (1 << p)))
+                    continue;
+
+                for (u8 i = 0; i < visible; i++) {
+                    // Left-align the sprite row in a 128-bit word, then move it to X
+                    u128 sprite_row;
+                    if (big) {
+                        sprite_row = (u128) ((ram[addr + 2 * i] << 8) | ram[addr + 2 * i + 1]) << (DISPLAY_WIDTH - 16);
+                        if constexpr (Debug::enabled) {
+                            if (config.memory_access)
+                                debug(DEBUG_MEM_READ, addr + 2 * i);
+                            mem_read(addr + 2 * i, 2);
+                        }
+                    } else {
+                        sprite_row = (u128) ram[addr + i] << (DISPLAY_WIDTH - 8);
+                        if constexpr (Debug::enabled) {
+                            if (config.memory_access)
+                                debug(DEBUG_MEM_READ, addr + i);
+                            mem_read(addr + i, 1);
+                        }
+                    }
+                    sprite_row = place_sprite_row<Quirks::clip_sprites>(sprite_row, xc, width);
+
+                    const u8 y = Quirks::clip_sprites ? yc + i : (yc + i) % height;
+                    const u128 pixels = display[p][y];
+                    if (pixels & sprite_row)
+                        collisions++;
+                    set_row(p, y, pixels ^ sprite_row);
+                    dirty_rows |= 1ULL << y;
                 }
 
-                if (++yc >= 32) break;
+                addr += big ? 2 * rows : rows;
             }
 
+            // SUPER-CHIP counts colliding rows and rows clipped at the bottom in hi-res
+            if (hires && config.current_extension == SUPERCHIP8)
+                V[0xF] = collisions + rows - visible;
+            else
+                V[0xF] = collisions != 0;
+
             draw = true;
         }
             break;
@@ -298,53 +763,79 @@ void Chip8::emulate_inst(const config_t &config) {
             switch (inst.NN) {
                 // EX9E - SKP Vx
                 case 0x9E:
+                    if constexpr (Debug::enabled)
+                        if (config.latency_metrics)
+                            latency.key_read(V[inst.X]);
                     if (keypad[V[inst.X]])
-                        PC += 2;
+                        skip(config);
                     break;
 
                 // EXA1 - SKNP Vx
                 case 0xA1:
+                    if constexpr (Debug::enabled)
+                        if (config.latency_metrics)
+                            latency.key_read(V[inst.X]);
                     if (!keypad[V[inst.X]])
-                        PC += 2;
+                        skip(config);
                     break;
             }
             break;
 
         case 0xF:
             switch (inst.NN) {
+                // F000 NNNN - LD I, long addr (XO-CHIP)
+                case 0x00:
+                    if (inst.X != 0x0 || config.current_extension != XOCHIP)
+                        break;
+                    I = (ram[PC] << 8) + ram[PC + 1];
+                    if constexpr (Debug::enabled)
+                        if (config.heatmap && heatmap.active())
+                            heatmap.exec(PC, 2);
+                    PC += 2;
+                    break;
+
+                // FN01 - PLANE n (XO-CHIP)
+                case 0x01:
+                    if (config.current_extension == XOCHIP)
+                        planes = inst.X;
+                    break;
+
                 // FX07 - LD Vx, DT
                 case 0x07:
                     V[inst.X] = delay_timer;
                     break;
                 
                 // FX0A - LD Vx, K
-                case 0x0A: {
+                case 0x0A:
                     // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
-                    static bool any_key_pressed = false;
-                    static u8 key = 0xFF;
-
-                    for (u8 i = 0; key == 0xFF && i < sizeof keypad; i++) {
+                    for (u8 i = 0; fx0a_key == 0xFF && i < sizeof keypad; i++) {
                         if (keypad[i]) {
-                            key = i;                    // Save pressed key to check until it is released
-                            any_key_pressed = true;
+                            fx0a_key = i;               // Save pressed key to check until it is released
+                            fx0a_pressed = true;
                             break;
                         }
                     }
+                    if constexpr (Debug::enabled)
+                        if (config.latency_metrics && fx0a_key != 0xFF)
+                            latency.key_read(fx0a_key);
 
                     // If no key has been pressed yet, keep getting the current opcode & running this instruction
-                    if (!any_key_pressed) {
+                    if (!fx0a_pressed) {
                         PC -= 2; 
+                        if (metrics.active())
+                            metrics.fx0a_waiting();
                     } else {
                         // A key has been pressed, also wait until it is released to set the key in VX
-                        if (keypad[key]) {              // "Busy loop" CHIP8 emulation until key is released
+                        if (keypad[fx0a_key]) {         // "Busy loop" CHIP8 emulation until key is released
                             PC -= 2;
                         } else {
-                            V[inst.X] = key;            // VX = key 
-                            key = 0xFF;                 // Reset key to not found 
-                            any_key_pressed = false;    // Reset to nothing pressed yet
+                            V[inst.X] = fx0a_key;       // VX = key 
+                            fx0a_key = 0xFF;            // Reset key to not found 
+                            fx0a_pressed = false;       // Reset to nothing pressed yet
+                            if (metrics.active())
+                                metrics.fx0a_done();
                         }
                     }
-                }
                     break;
 
                 // FX15 - LD DT, Vx
@@ -359,271 +850,95 @@ void Chip8::emulate_inst(const config_t &config) {
 
                 // FX1E - LD I, Vx
                 case 0x1E:
-                    V[0xF] = I + V[inst.X] > 0xFFF; // replicating amiga interpreter (for Spaceflight 2091!)
-                    I = (I + V[inst.X]) & 0x0FFF;
+                    V[0xF] = I + V[inst.X] > ram_size - 1; // replicating amiga interpreter (for Spaceflight 2091!)
+                    I = (I + V[inst.X]) & (ram_size - 1);
                     break;
                 
                 // FX29 - LD F, Vx
                 case 0x29:
                     I = V[inst.X] * 5;
                     break;
+
+                // FX30 - LD HF, Vx (SUPER-CHIP)
+                case 0x30:
+                    if (config.current_extension != CHIP8)
+                        I = BIG_FONT_ADDR + (V[inst.X] & 0xF) * 10;
+                    break;
                 
                 // FX33 - LD B, Vx
                 case 0x33:
                     ram[I] = V[inst.X] / 100;
                     ram[I + 1] = (V[inst.X] % 100) / 10;
                     ram[I + 2] = V[inst.X] % 10;
-                    if (config.memory_access)
-                        printf("Memory write at %04X\n", I);
+                    touch(I, 3);
+                    if constexpr (Debug::enabled) {
+                        if (config.memory_access)
+                            debug(DEBUG_MEM_WRITE, I);
+                        mem_write(I, 3);
+                    }
                     break;
                 
                 // FX55 - LD [I], Vx
                 case 0x55:
                     for (u8 i = 0; i <= inst.X; i++)
                         ram[I + i] = V[i];
-                    if (config.memory_access)
-                        printf("Memory write at %04X\n", I);
-                    I += inst.X + 1;
+                    touch(I, inst.X + 1);
+                    if constexpr (Debug::enabled) {
+                        if (config.memory_access)
+                            debug(DEBUG_MEM_WRITE, I);
+                        mem_write(I, inst.X + 1);
+                    }
+                    if constexpr (Quirks::load_store_inc_i)
+                        I += inst.X + 1;
                     break;
                 
                 // FX65 - LD Vx, [I]
                 case 0x65:
                     for (u32 i = 0; i <= inst.X; i++)
                         V[i] = ram[I + i];
-                    if (config.memory_access)
-                        printf("Memory write at %04X\n", I);
-                    I += inst.X + 1;
-                    break;
-            }
-            break;
-    }
-
-    if (config.register_changes)
-        debug_reg();
-}
-
-void Chip8::debug_inst() {
-    bool invalid_opcode = false;
-    const char *light_red = "\033[1;31m";
-    const char *light_green = "\033[1;32m";
-    const char *light_blue = "\033[1;34m";
-    const char *light_yellow = "\033[1;33m";
-    const char *reset_color = "\033[0m";
-
-    printf("[%s0x%03X%s]: %s%04X%s -> %s", light_yellow, PC - 2, reset_color, light_blue, inst.opcode, reset_color, light_green);
-
-    switch (inst.category) {
-        case 0x0:
-            switch (inst.NNN) {
-                // 00E0 - CLS
-                case 0x0E0:
-                    printf("cls");
-                    break;
-                
-                // 00EE - RET
-                case 0x0EE:
-                    printf("ret");
-                    break;
-
-                default:
-                    invalid_opcode = true;
-            }
-            break;
-
-        // 1NNN - JP addr
-        case 0x1:
-            printf("jp %03x", inst.NNN);
-            break;
-
-        // 2NNN - CALL addr
-        case 0x2:
-            printf("call %03x", inst.NNN);
-            break;
-
-        // 3XNN - SE Vx, byte
-        case 0x3:
-            printf("se v%01x, %02x", inst.X, inst.NN);
-            break;
-        
-        // 4XNN - SNE Vx, byte
-        case 0x4:
-            printf("sne v%01x, %02x", inst.X, inst.NN);
-            break;
-        
-        // 5XY0 - SE Vx, Vy
-        case 0x5:
-            printf("se v%01x, v%01x", inst.X, inst.Y);
-            break;
-
-        // 6XNN - LD Vx, byte
-        case 0x6:
-            printf("ld v%01x, %02x", inst.X, inst.NN);
-            break;
-        
-        // 7XNN - ADD Vx, byte
-        case 0x7:
-            printf("add v%01x, %02x", inst.X, inst.NN);
-            break;
-        
-        case 0x8:
-            switch (inst.N) {
-                // 8XY0 - LD Vx, Vy
-                case 0x0:
-                    printf("ld v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY1 - OR Vx, Vy
-                case 0x1:
-                    printf("or v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY2 - AND Vx, Vy
-                case 0x2:
-                    printf("and v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY3 - XOR Vx, Vy
-                case 0x3:
-                    printf("xor v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY4 - ADD Vx, Vy
-                case 0x4:
-                    printf("add v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY5 - SUB Vx, Vy
-                case 0x5:
-                    printf("sub v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XY6 - SHR Vx {, Vy}
-                case 0x6:
-                    
-                    break;
-
-                // 8XY7 - SUBN Vx, Vy
-                case 0x7:
-                    printf("subn v%01x, v%01x", inst.X, inst.Y);
-                    break;
-
-                // 8XYE - SHL Vx {, Vy}
-                case 0xE:
-                    
-                    break;
-                
-                default:
-                    invalid_opcode = true;
-            }
-            break;
-
-        // 9XY0 - SNE Vx, Vy
-        case 0x9:
-            printf("sne V%01x, V%01x", inst.X, inst.Y);
-            break;
-
-        // ANNN- LD I, addr
-        case 0xA:
-            printf("ld %03x, %03x", I, inst.NNN);
-            break;
-        
-        // BNNN- JP V0, addr
-        case 0xB:
-            printf("jp v0, %03x", inst.NNN);
-            break;
-
-        // CXNN - RND Vx, byte
-        case 0xC:
-            printf("rnd %01x, %02x", inst.X, inst.NN);
-            break;
-
-        // DXYN - DRW Vx, Vy, nibble
-        case 0xD:
-            printf("drw V%01x, V%01x, %01x", inst.X, inst.Y, inst.N);
-            break;
-        
-        case 0xE:
-            switch (inst.NN) {
-                // EX9E - SKP Vx
-                case 0x9E:
-                    printf("skp v%01x", inst.X );
-                    break;
-
-                // EXA1 - SKNP Vx
-                case 0xA1:
-                    printf("sknp v%01x", inst.X);
-                    break;
-                
-                default:
-                    invalid_opcode = true;
-            }
-            break;
-
-        case 0xF:
-            switch (inst.NN) {
-                // FX07 - LD Vx, DT
-                case 0x07:
-                    printf("ld v%01x, %02x", inst.X, delay_timer);
-                    break;
-                
-                // FX0A - LD Vx, K
-                case 0x0A:
-                    printf("ld v%01x, k", inst.X);
-                    break;
-
-                // FX15 - LD DT, Vx
-                case 0x15:
-                    printf("ld %02x, v%01x", delay_timer, inst.X);
-                    break;
-                
-                // FX18 - LD ST, Vx
-                case 0x18:
-                    printf("ld %02x, v%01x", sound_timer, inst.X);
+                    if constexpr (Debug::enabled) {
+                        if (config.memory_access)
+                            debug(DEBUG_MEM_READ, I);
+                        mem_read(I, inst.X + 1);
+                    }
+                    if constexpr (Quirks::load_store_inc_i)
+                        I += inst.X + 1;
+                    break;
+
+                // FX75 - LD R, Vx (SUPER-CHIP)
+                case 0x75: {
+                    if (config.current_extension == CHIP8)
+                        break;
+                    const u8 flags = config.current_extension == XOCHIP ? 16 : 8;
+                    for (u8 i = 0; i <= inst.X && i < flags; i++)
+                        rpl[i] = V[i];
+                    save_rpl();
+                }
                     break;
 
-                // FX1E - LD I, Vx
-                case 0x1E:
-                    printf("ld %03x, v%01x", I, inst.X);
-                    break;
-                
-                // FX29 - LD F, Vx
-                case 0x29:
-                    printf("ld f, v%01x", inst.X);
-                    break;
-                
-                // FX33 - LD B, Vx
-                case 0x33:
-                    printf("ld b, v%01x", inst.X);
-                    break;
-                
-                // FX55 - LD [I], Vx
-                case 0x55:
-                    printf("ld [%03x], v%01x", I, inst.X);
-                    break;
-                
-                // FX65 - LD Vx, [I]
-                case 0x65:
-                    printf("ld v%01x, [%03x]", inst.X, I);
+                // FX85 - LD Vx, R (SUPER-CHIP)
+                case 0x85: {
+                    if (config.current_extension == CHIP8)
+                        break;
+                    const u8 flags = config.current_extension == XOCHIP ? 16 : 8;
+                    for (u8 i = 0; i <= inst.X && i < flags; i++)
+                        V[i] = rpl[i];
+                }
                     break;
-                
-                default:
-                    invalid_opcode = true;
             }
             break;
-            
-        default:
-            invalid_opcode = true;
     }
 
-    if (invalid_opcode)
-        printf("%sInvalid opcode", light_red);
-    printf("%s\n", reset_color);
+    if constexpr (Debug::enabled) {
+        if (config.register_changes) {
+            // Log only what this instruction changed
+            for (u8 i = 0; i < 16; i++)
+                if (V[i] != prev_V[i])
+                    debug(DEBUG_REG, V[i], i);
+            if (I != prev_I)
+                debug(DEBUG_REG, I, 0x10);
+        }
+        if (config.trace_db && tracedb.active())
+            tracedb.retire(*this, prev_V, prev_I);
+    }
 }
-
-void Chip8::debug_reg() {
-    printf("PC = %04X SP = %04X I = %04X\n", PC, SP, I);
-    printf("V = ");
-    for (u8 i = 0; i < 16; i++)
-        printf("%02X ", V[i]);
-    printf("\n");
-}
\ No newline at end of file
@@ -0,0 +1,408 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../include/Debug.h"
+#include "../include/SourceMap.h"
+#include "../include/Trace.h"
+
+__thread debug_buffer_t debug_buffer;
+
+// Print an instruction with its mnemonic
+static void print_inst(const debug_record_t &record) {
+    // Decode the instruction again from the record
+    const struct {
+        u16 opcode;
+        u8 category;
+        u16 NNN;
+        u8 NN;
+        u8 N;
+        u8 X;
+        u8 Y;
+    } inst = {
+        .opcode = record.opcode,
+        .category = (u8) (record.opcode >> 12),
+        .NNN = (u16) (record.opcode & 0x0FFF),
+        .NN = (u8) (record.opcode & 0x00FF),
+        .N = (u8) (record.opcode & 0x000F),
+        .X = (u8) ((record.opcode & 0x0F00) >> 8),
+        .Y = (u8) ((record.opcode & 0x00F0) >> 4),
+    };
+    const u16 I = record.arg;
+
+    bool invalid_opcode = false;
+    const char *light_red = "\033[1;31m";
+    const char *light_green = "\033[1;32m";
+    const char *light_blue = "\033[1;34m";
+    const char *light_yellow = "\033[1;33m";
+    const char *reset_color = "\033[0m";
+
+    printf("[%s0x%03X%s]: %s%04X%s -> %s", light_yellow, record.pc, reset_color, light_blue, inst.opcode, reset_color, light_green);
+
+    switch (inst.category) {
+        case 0x0:
+            switch (inst.NNN) {
+                // 00E0 - CLS
+                case 0x0E0:
+                    printf("cls");
+                    break;
+                
+                // 00EE - RET
+                case 0x0EE:
+                    printf("ret");
+                    break;
+
+                // 00FB - SCR
+                case 0x0FB:
+                    printf("scr");
+                    break;
+
+                // 00FC - SCL
+                case 0x0FC:
+                    printf("scl");
+                    break;
+
+                // 00FD - EXIT
+                case 0x0FD:
+                    printf("exit");
+                    break;
+
+                // 00FE - LOW
+                case 0x0FE:
+                    printf("low");
+                    break;
+
+                // 00FF - HIGH
+                case 0x0FF:
+                    printf("high");
+                    break;
+
+                default:
+                    // 00CN - SCD nibble
+                    if ((inst.NNN & 0xFF0) == 0x0C0)
+                        printf("scd %01x", inst.N);
+                    // 00DN - SCU nibble
+                    else if ((inst.NNN & 0xFF0) == 0x0D0)
+                        printf("scu %01x", inst.N);
+                    else
+                        invalid_opcode = true;
+            }
+            break;
+
+        // 1NNN - JP addr
+        case 0x1:
+            printf("jp %03x", inst.NNN);
+            break;
+
+        // 2NNN - CALL addr
+        case 0x2:
+            printf("call %03x", inst.NNN);
+            break;
+
+        // 3XNN - SE Vx, byte
+        case 0x3:
+            printf("se v%01x, %02x", inst.X, inst.NN);
+            break;
+        
+        // 4XNN - SNE Vx, byte
+        case 0x4:
+            printf("sne v%01x, %02x", inst.X, inst.NN);
+            break;
+        
+        case 0x5:
+            switch (inst.N) {
+                // 5XY0 - SE Vx, Vy
+                case 0x0:
+                    printf("se v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 5XY2 - LD [I], Vx-Vy
+                case 0x2:
+                    printf("ld [%04x], v%01x-v%01x", I, inst.X, inst.Y);
+                    break;
+
+                // 5XY3 - LD Vx-Vy, [I]
+                case 0x3:
+                    printf("ld v%01x-v%01x, [%04x]", inst.X, inst.Y, I);
+                    break;
+
+                default:
+                    invalid_opcode = true;
+            }
+            break;
+
+        // 6XNN - LD Vx, byte
+        case 0x6:
+            printf("ld v%01x, %02x", inst.X, inst.NN);
+            break;
+        
+        // 7XNN - ADD Vx, byte
+        case 0x7:
+            printf("add v%01x, %02x", inst.X, inst.NN);
+            break;
+        
+        case 0x8:
+            switch (inst.N) {
+                // 8XY0 - LD Vx, Vy
+                case 0x0:
+                    printf("ld v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY1 - OR Vx, Vy
+                case 0x1:
+                    printf("or v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY2 - AND Vx, Vy
+                case 0x2:
+                    printf("and v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY3 - XOR Vx, Vy
+                case 0x3:
+                    printf("xor v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY4 - ADD Vx, Vy
+                case 0x4:
+                    printf("add v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY5 - SUB Vx, Vy
+                case 0x5:
+                    printf("sub v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY6 - SHR Vx {, Vy}
+                case 0x6:
+                    printf("shr v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XY7 - SUBN Vx, Vy
+                case 0x7:
+                    printf("subn v%01x, v%01x", inst.X, inst.Y);
+                    break;
+
+                // 8XYE - SHL Vx {, Vy}
+                case 0xE:
+                    printf("shl v%01x, v%01x", inst.X, inst.Y);
+                    break;
+                
+                default:
+                    invalid_opcode = true;
+            }
+            break;
+
+        // 9XY0 - SNE Vx, Vy
+        case 0x9:
+            printf("sne V%01x, V%01x", inst.X, inst.Y);
+            break;
+
+        // ANNN- LD I, addr
+        case 0xA:
+            printf("ld %03x, %03x", I, inst.NNN);
+            break;
+        
+        // BNNN- JP V0, addr
+        case 0xB:
+            printf("jp v0, %03x", inst.NNN);
+            break;
+
+        // CXNN - RND Vx, byte
+        case 0xC:
+            printf("rnd %01x, %02x", inst.X, inst.NN);
+            break;
+
+        // DXYN - DRW Vx, Vy, nibble
+        case 0xD:
+            printf("drw V%01x, V%01x, %01x", inst.X, inst.Y, inst.N);
+            break;
+        
+        case 0xE:
+            switch (inst.NN) {
+                // EX9E - SKP Vx
+                case 0x9E:
+                    printf("skp v%01x", inst.X );
+                    break;
+
+                // EXA1 - SKNP Vx
+                case 0xA1:
+                    printf("sknp v%01x", inst.X);
+                    break;
+                
+                default:
+                    invalid_opcode = true;
+            }
+            break;
+
+        case 0xF:
+            switch (inst.NN) {
+                // F000 NNNN - LD I, long addr
+                case 0x00:
+                    printf("ld i, %04x", record.arg);
+                    break;
+
+                // FN01 - PLANE n
+                case 0x01:
+                    printf("plane %01x", inst.X);
+                    break;
+
+                // FX07 - LD Vx, DT
+                case 0x07:
+                    printf("ld v%01x, %02x", inst.X, record.arg);
+                    break;
+                
+                // FX0A - LD Vx, K
+                case 0x0A:
+                    printf("ld v%01x, k", inst.X);
+                    break;
+
+                // FX15 - LD DT, Vx
+                case 0x15:
+                    if (record.reg)
+                        printf("ld dt, v%01x", inst.X);
+                    else
+                        printf("ld %02x, v%01x", record.arg, inst.X);
+                    break;
+                
+                // FX18 - LD ST, Vx
+                case 0x18:
+                    if (record.reg)
+                        printf("ld st, v%01x", inst.X);
+                    else
+                        printf("ld %02x, v%01x", record.arg, inst.X);
+                    break;
+
+                // FX1E - LD I, Vx
+                case 0x1E:
+                    printf("ld %03x, v%01x", I, inst.X);
+                    break;
+                
+                // FX29 - LD F, Vx
+                case 0x29:
+                    printf("ld f, v%01x", inst.X);
+                    break;
+
+                // FX30 - LD HF, Vx
+                case 0x30:
+                    printf("ld hf, v%01x", inst.X);
+                    break;
+                
+                // FX33 - LD B, Vx
+                case 0x33:
+                    printf("ld b, v%01x", inst.X);
+                    break;
+                
+                // FX55 - LD [I], Vx
+                case 0x55:
+                    printf("ld [%03x], v%01x", I, inst.X);
+                    break;
+                
+                // FX65 - LD Vx, [I]
+                case 0x65:
+                    printf("ld v%01x, [%03x]", inst.X, I);
+                    break;
+
+                // FX75 - LD R, Vx
+                case 0x75:
+                    printf("ld r, v%01x", inst.X);
+                    break;
+
+                // FX85 - LD Vx, R
+                case 0x85:
+                    printf("ld v%01x, r", inst.X);
+                    break;
+                
+                default:
+                    invalid_opcode = true;
+            }
+            break;
+            
+        default:
+            invalid_opcode = true;
+    }
+
+    if (invalid_opcode)
+        printf("%sInvalid opcode", light_red);
+
+    // Label and source line of an assembled program
+    if (!source_map.empty()) {
+        const std::string where = source_map.describe(record.pc);
+        if (!where.empty())
+            printf("%s  ; %s", reset_color, where.c_str());
+    }
+    printf("%s\n", reset_color);
+}
+
+void debug_print(const debug_record_t &record) {
+    switch (record.event) {
+        case DEBUG_INST:
+            print_inst(record);
+            break;
+
+        case DEBUG_MEM_READ:
+            printf("Memory read at %04X\n", record.arg);
+            break;
+
+        case DEBUG_MEM_WRITE:
+            printf("Memory write at %04X\n", record.arg);
+            break;
+
+        case DEBUG_STACK_PUSH:
+            printf("Stack push: %04X\n", record.arg);
+            break;
+
+        case DEBUG_STACK_POP:
+            printf("Stack pop\n");
+            break;
+
+        case DEBUG_REG:
+            if (record.reg == 0x10)
+                printf("I = %04X\n", record.arg);
+            else
+                printf("V%01X = %02X\n", record.reg, record.arg);
+            break;
+    }
+}
+
+bool parse_opcode_filter(const char *pattern, opcode_filter_t *filter) {
+    if (strlen(pattern) != 4)
+        return false;
+
+    filter->mask = filter->value = 0;
+    for (u8 i = 0; i < 4; i++) {
+        const char c = pattern[i];
+        const u8 shift = 12 - 4 * i;
+
+        if (c == 'X' || c == 'Y' || c == 'N' || c == 'x' || c == 'y' || c == 'n')
+            continue;
+
+        char digit[2] = {c, '\0'};
+        char *end;
+        const u16 nibble = strtoul(digit, &end, 16);
+        if (*end != '\0')
+            return false;
+
+        filter->mask |= 0xF << shift;
+        filter->value |= nibble << shift;
+    }
+
+    return true;
+}
+
+void debug_flush() {
+    if (trace_sink.active()) {
+        // Binary trace file, formatted offline by chip8-trace. The records are already
+        // in the ring unless they were queued before it opened
+        if (trace_sink.holds(debug_buffer.records))
+            trace_sink.commit(debug_buffer.count);
+        else
+            trace_sink.push(debug_buffer.records, debug_buffer.count);
+        debug_buffer.records = trace_sink.reserve(&debug_buffer.capacity);
+    } else {
+        for (u32 i = 0; i < debug_buffer.count; i++)
+            debug_print(debug_buffer.records[i]);
+        debug_buffer.records = debug_buffer.storage;
+        debug_buffer.capacity = DEBUG_BUFFER_SIZE;
+    }
+    debug_buffer.count = 0;
+}
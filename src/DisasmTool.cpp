@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../include/Chip8.h"
+#include "../include/Disassembler.h"
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] <rom.ch8>\n"
+            "  -o <file>          source in the assembler syntax, stdout by default\n"
+            "  --dot <file>       control flow graph for Graphviz\n"
+            "  --json <file>      control flow graph, data ranges and labels as JSON\n"
+            "  --xo               XO-CHIP program, F000 NNNN is one instruction\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+static FILE *open_output(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not write %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+int main(int argc, char *argv[]) {
+    const char *input = NULL;
+    const char *output = NULL;
+    const char *dot = NULL;
+    const char *json = NULL;
+    Disassembler disassembler;
+
+    for (i32 i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "--dot") && i + 1 < argc) {
+            dot = argv[++i];
+        } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            json = argv[++i];
+        } else if (!strcmp(argv[i], "--xo")) {
+            disassembler.xo = true;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else if (!input) {
+            input = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!input)
+        usage(argv[0]);
+
+    FILE *file = fopen(input, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", input);
+        exit(EXIT_FAILURE);
+    }
+    const u32 capacity = (disassembler.xo ? XO_RAM_SIZE : RAM_SIZE) - 0x200;
+    std::vector<u8> rom(capacity + 1);
+    const u32 size = fread(rom.data(), 1, rom.size(), file);
+    fclose(file);
+    if (size > capacity) {
+        fprintf(stderr, "%s is too big, %u bytes fit from 0x200\n", input, capacity);
+        exit(EXIT_FAILURE);
+    }
+
+    disassembler.analyze(rom.data(), size);
+
+    const std::string source = disassembler.source();
+    FILE *out = output ? open_output(output) : stdout;
+    fwrite(source.data(), 1, source.size(), out);
+    if (output)
+        fclose(out);
+
+    if (dot) {
+        out = open_output(dot);
+        disassembler.write_dot(out);
+        fclose(out);
+    }
+    if (json) {
+        out = open_output(json);
+        disassembler.write_json(out);
+        fclose(out);
+    }
+
+    if (output)
+        printf("%s: %u instructions in %zu blocks, %u bytes of data\n", output, disassembler.insts,
+               disassembler.blocks.size(), disassembler.data_size);
+    exit(EXIT_SUCCESS);
+}
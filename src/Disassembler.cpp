@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include "../include/Disassembler.h"
+
+static const char *flow_names[] = {"next", "call", "jump", "indirect", "skip", "return", "exit", "stop"};
+
+static std::string format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static std::string format(const char *fmt, ...) {
+    char buffer[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof buffer, fmt, args);
+    va_end(args);
+    return buffer;
+}
+
+disasm_inst_t Disassembler::decode(u32 addr) const {
+    disasm_inst_t inst = {0, 2, DISASM_INVALID, -1};
+    if (!in_program(addr) || !in_program(addr + 1))
+        return inst;
+
+    const u32 offset = addr - start;
+    const u16 opcode = (rom[offset] << 8) | rom[offset + 1];
+    const u16 NNN = opcode & 0x0FFF;
+    const u8 NN = opcode & 0x00FF;
+    const u8 N = opcode & 0x000F;
+    bool valid = true;
+    inst.opcode = opcode;
+    inst.flow = DISASM_NEXT;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00EE)
+                inst.flow = DISASM_RETURN;
+            else if (opcode == 0x00FD)
+                inst.flow = DISASM_EXIT;
+            else
+                valid = opcode == 0x00E0 || (opcode >= 0x00FB && opcode <= 0x00FF) ||
+                        (NNN & 0xFF0) == 0x0C0 || (NNN & 0xFF0) == 0x0D0;
+            break;
+
+        case 0x1:
+            inst.flow = DISASM_JUMP;
+            inst.target = NNN;
+            break;
+
+        case 0x2:
+            inst.flow = DISASM_CALL;
+            inst.target = NNN;
+            break;
+
+        case 0x3:
+        case 0x4:
+        case 0x9:
+            inst.flow = DISASM_SKIP;
+            valid = (opcode >> 12) != 0x9 || N == 0x0;
+            break;
+
+        case 0x5:
+            if (N == 0x0)
+                inst.flow = DISASM_SKIP;
+            else
+                valid = N == 0x2 || N == 0x3;
+            break;
+
+        case 0x8:
+            valid = N <= 0x7 || N == 0xE;
+            break;
+
+        case 0xA:
+            inst.target = NNN;
+            break;
+
+        case 0xB:
+            inst.flow = DISASM_INDIRECT;
+            inst.target = NNN;
+            break;
+
+        case 0xE:
+            inst.flow = DISASM_SKIP;
+            valid = NN == 0x9E || NN == 0xA1;
+            break;
+
+        case 0xF:
+            switch (NN) {
+                case 0x00:
+                    // F000 NNNN, the address is the next word
+                    valid = xo && opcode == 0xF000 && in_program(addr + 3);
+                    if (valid) {
+                        inst.size = 4;
+                        inst.target = (rom[offset + 2] << 8) | rom[offset + 3];
+                    }
+                    break;
+                case 0x01: case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E: case 0x29:
+                case 0x30: case 0x33: case 0x55: case 0x65: case 0x75: case 0x85:
+                    break;
+                default:
+                    valid = false;
+            }
+            break;
+    }
+
+    if (!valid) {
+        inst.flow = DISASM_INVALID;
+        inst.target = -1;
+    }
+    return inst;
+}
+
+void Disassembler::analyze(const u8 *program, u32 size, Address start) {
+    this->start = start;
+    rom.assign(program, program + size);
+    kind.assign(size, DISASM_DATA);
+    blocks.clear();
+    labels.clear();
+    insts = 0;
+
+    // Decode from every target until the path leaves or runs into code already decoded
+    std::vector<bool> leader(size, false);
+    std::vector<u32> work = {start};
+    auto add_target = [&](u32 addr) {
+        if (!in_program(addr))
+            return;
+        leader[addr - start] = true;
+        work.push_back(addr);
+    };
+    if (size)
+        leader[0] = true;
+
+    while (!work.empty()) {
+        u32 pc = work.back();
+        work.pop_back();
+
+        while (in_program(pc) && kind[pc - start] == DISASM_DATA) {
+            const disasm_inst_t inst = decode(pc);
+            if (inst.flow == DISASM_INVALID)
+                break;
+
+            // A path that runs into the middle of another instruction stops there
+            bool overlaps = false;
+            for (u32 i = 1; i < inst.size; i++)
+                overlaps |= kind[pc - start + i] != DISASM_DATA;
+            if (overlaps)
+                break;
+
+            kind[pc - start] = DISASM_CODE;
+            for (u32 i = 1; i < inst.size; i++)
+                kind[pc - start + i] = DISASM_OPERAND;
+            insts++;
+
+            const u32 next = pc + inst.size;
+            if (inst.flow == DISASM_JUMP || inst.flow == DISASM_INDIRECT) {
+                add_target(inst.target);
+                break;
+            }
+            if (inst.flow == DISASM_SKIP) {
+                add_target(next);
+                add_target(next + decode(next).size);
+                break;
+            }
+            if (inst.flow == DISASM_RETURN || inst.flow == DISASM_EXIT)
+                break;
+            if (inst.flow == DISASM_CALL)
+                add_target(inst.target);
+
+            // Joining code decoded from another target splits the block there
+            if (in_program(next) && kind[next - start] == DISASM_CODE)
+                leader[next - start] = true;
+            pc = next;
+        }
+    }
+
+    // Basic blocks
+    disasm_block_t *block = NULL;
+    for (u32 pc = start; pc < start + size;) {
+        if (kind[pc - start] != DISASM_CODE) {
+            block = NULL;
+            pc++;
+            continue;
+        }
+        if (!block || leader[pc - start]) {
+            blocks.push_back({(Address) pc, (Address) pc, 0, DISASM_INVALID, {}, {}});
+            block = &blocks.back();
+        }
+
+        const disasm_inst_t inst = decode(pc);
+        const u32 next = pc + inst.size;
+        block->end = next;
+        block->insts++;
+        block->exit = inst.flow;
+        if (inst.flow == DISASM_CALL)
+            block->calls.push_back(inst.target);
+
+        switch (inst.flow) {
+            case DISASM_JUMP:
+            case DISASM_INDIRECT:
+                block->successors.push_back(inst.target);
+                block = NULL;
+                break;
+            case DISASM_SKIP:
+                block->successors.push_back(next);
+                block->successors.push_back(next + decode(next).size);
+                block = NULL;
+                break;
+            case DISASM_RETURN:
+            case DISASM_EXIT:
+                block = NULL;
+                break;
+            default:
+                // Ends where the next block starts, or where the path stopped
+                if (!in_program(next) || kind[next - start] != DISASM_CODE) {
+                    block->exit = DISASM_INVALID;
+                    block = NULL;
+                } else if (leader[next - start]) {
+                    block->exit = DISASM_NEXT;
+                    block->successors.push_back(next);
+                }
+        }
+        pc = next;
+    }
+
+    data_size = std::count(kind.begin(), kind.end(), DISASM_DATA);
+
+    // Labels, a target inside an instruction is named after the instruction
+    for (u32 pc = start; pc < start + size; pc++) {
+        if (kind[pc - start] != DISASM_CODE)
+            continue;
+        const disasm_inst_t inst = decode(pc);
+        if (inst.target < 0 || !in_program(inst.target))
+            continue;
+
+        u32 addr = inst.target;
+        while (kind[addr - start] == DISASM_OPERAND)
+            addr--;
+        const char *prefix = inst.flow == DISASM_CALL ? "sub" :
+                             inst.flow != DISASM_NEXT || kind[addr - start] == DISASM_CODE ? "L" : "data";
+        auto it = labels.find(addr);
+        if (it == labels.end())
+            labels.emplace(addr, format("%s_%03x", prefix, addr));
+        else if (inst.flow == DISASM_CALL)
+            it->second = format("sub_%03x", addr);
+    }
+}
+
+const disasm_block_t *Disassembler::block_at(Address addr) const {
+    auto it = std::lower_bound(blocks.begin(), blocks.end(), addr,
+                               [](const disasm_block_t &block, Address addr) { return block.start < addr; });
+    return it != blocks.end() && it->start == addr ? &*it : NULL;
+}
+
+// Operand for an address, label+offset inside an instruction
+std::string Disassembler::reference(u32 addr) const {
+    if (!in_program(addr))
+        return format(addr > 0xFFF ? "0x%04x" : "0x%03x", addr);
+
+    u32 label = addr;
+    while (kind[label - start] == DISASM_OPERAND)
+        label--;
+    auto it = labels.find(label);
+    if (it == labels.end())
+        return format("0x%03x", addr);
+    return label == addr ? it->second : format("%s+%u", it->second.c_str(), addr - label);
+}
+
+// Instruction in the Assembler syntax, the ones it has no mnemonic for are dw with a comment
+std::string Disassembler::text(u32 addr) const {
+    const disasm_inst_t inst = decode(addr);
+    const u16 opcode = inst.opcode;
+    const u8 X = (opcode >> 8) & 0xF, Y = (opcode >> 4) & 0xF, N = opcode & 0xF, NN = opcode & 0xFF;
+    auto word = [&](const char *comment) { return format("dw 0x%04x  ; %s", opcode, comment); };
+
+    switch (opcode >> 12) {
+        case 0x0:
+            switch (opcode) {
+                case 0x00E0: return "cls";
+                case 0x00EE: return "ret";
+                case 0x00FB: return word("scr");
+                case 0x00FC: return word("scl");
+                case 0x00FD: return word("exit");
+                case 0x00FE: return word("low");
+                case 0x00FF: return word("high");
+            }
+            return word(format("%s %x", (opcode & 0xFFF0) == 0x00C0 ? "scd" : "scu", N).c_str());
+        case 0x1: return "jp " + reference(inst.target);
+        case 0x2: return "call " + reference(inst.target);
+        case 0x3: return format("se v%x, 0x%02x", X, NN);
+        case 0x4: return format("sne v%x, 0x%02x", X, NN);
+        case 0x5:
+            if (N == 0x0)
+                return format("se v%x, v%x", X, Y);
+            return word(format(N == 0x2 ? "save v%x - v%x" : "load v%x - v%x", X, Y).c_str());
+        case 0x6: return format("ld v%x, 0x%02x", X, NN);
+        case 0x7: return format("add v%x, 0x%02x", X, NN);
+        case 0x8: {
+            static const char *ops[] = {"ld", "or", "and", "xor", "add", "sub", "shr", "subn"};
+            return format("%s v%x, v%x", N == 0xE ? "shl" : ops[N], X, Y);
+        }
+        case 0x9: return format("sne v%x, v%x", X, Y);
+        case 0xA: return "ldi " + reference(inst.target);
+        case 0xB: return "jpr v0, " + reference(inst.target);
+        case 0xC: return format("rnd v%x, 0x%02x", X, NN);
+        case 0xD: return format("drw v%x, v%x, 0x%x", X, Y, N);
+        case 0xE: return format("%s v%x", NN == 0x9E ? "skp" : "sknp", X);
+    }
+
+    switch (NN) {
+        case 0x00: return "dw 0xf000, " + reference(inst.target) + "  ; ldi long";
+        case 0x01: return word(format("plane %x", X).c_str());
+        case 0x07: return format("std v%x", X);
+        case 0x0A: return format("wait v%x", X);
+        case 0x15: return format("ldd v%x", X);
+        case 0x18: return format("lds v%x", X);
+        case 0x1E: return format("addi v%x", X);
+        case 0x29: return format("sprite v%x", X);
+        case 0x30: return word(format("bigsprite v%x", X).c_str());
+        case 0x33: return format("bcd v%x", X);
+        case 0x55: return format("write v%x", X);
+        case 0x65: return format("read v%x", X);
+        case 0x75: return word(format("saveflags v%x", X).c_str());
+        default: return word(format("loadflags v%x", X).c_str());
+    }
+}
+
+std::string Disassembler::source() const {
+    std::string out = format("; %u instructions in %zu blocks, %u bytes of data\n", insts, blocks.size(), data_size);
+    const u32 end = start + rom.size();
+
+    for (u32 pc = start; pc < end;) {
+        auto label = labels.find(pc);
+        if (label != labels.end())
+            out += (out.compare(out.size() - 2, 2, "\n\n") ? "\n" : "") + label->second + ":\n";
+
+        if (kind[pc - start] == DISASM_CODE) {
+            const disasm_inst_t inst = decode(pc);
+            out += "        " + text(pc) + "\n";
+            if (inst.flow == DISASM_JUMP || inst.flow == DISASM_INDIRECT || inst.flow == DISASM_RETURN ||
+                inst.flow == DISASM_EXIT)
+                out += "\n";
+            pc += inst.size;
+            continue;
+        }
+
+        // Up to 8 bytes of data, a line ends at a label or code
+        out += "        db ";
+        u32 i = 0;
+        do {
+            out += format(i ? ", 0x%02x" : "0x%02x", rom[pc - start]);
+            pc++;
+            i++;
+        } while (i < 8 && pc < end && kind[pc - start] == DISASM_DATA && !labels.count(pc));
+        out += "\n";
+    }
+    return out;
+}
+
+void Disassembler::write_dot(FILE *out) const {
+    fprintf(out, "digraph cfg {\n");
+    fprintf(out, "    node [shape=box, fontname=\"monospace\"];\n");
+
+    std::vector<Address> outside;
+    for (const disasm_block_t &block : blocks) {
+        auto label = labels.find(block.start);
+        fprintf(out, "    b%03x [label=\"%s\\l", block.start,
+                label != labels.end() ? (label->second + ":").c_str() : format("%03x:", block.start).c_str());
+        for (u32 pc = block.start; pc < block.end; pc += decode(pc).size)
+            fprintf(out, "%03x  %s\\l", pc, text(pc).c_str());
+        fprintf(out, "\"%s];\n", block.exit == DISASM_INVALID ? ", color=red" : "");
+
+        for (u32 i = 0; i < block.successors.size(); i++) {
+            const Address target = block.successors[i];
+            const char *style = block.exit == DISASM_SKIP && i ? " [label=\"skip\"]" :
+                                block.exit == DISASM_INDIRECT ? " [style=dashed, label=\"v0\"]" : "";
+            fprintf(out, "    b%03x -> b%03x%s;\n", block.start, target, style);
+            if (!block_at(target))
+                outside.push_back(target);
+        }
+        for (Address target : block.calls) {
+            fprintf(out, "    b%03x -> b%03x [style=dotted, label=\"call\"];\n", block.start, target);
+            if (!block_at(target))
+                outside.push_back(target);
+        }
+    }
+
+    // Targets outside the program or that aren't code
+    std::sort(outside.begin(), outside.end());
+    outside.erase(std::unique(outside.begin(), outside.end()), outside.end());
+    for (Address target : outside)
+        fprintf(out, "    b%03x [label=\"%03x\", style=dashed];\n", target, target);
+    fprintf(out, "}\n");
+}
+
+void Disassembler::write_json(FILE *out) const {
+    fprintf(out, "{\n  \"start\": %u, \"size\": %zu, \"instructions\": %u, \"xo\": %s,\n", start, rom.size(),
+            insts, xo ? "true" : "false");
+
+    fprintf(out, "  \"blocks\": [");
+    for (u32 i = 0; i < blocks.size(); i++) {
+        const disasm_block_t &block = blocks[i];
+        auto label = labels.find(block.start);
+        fprintf(out, "%s\n    {\"start\": %u, \"end\": %u, \"instructions\": %u, \"exit\": \"%s\"", i ? "," : "",
+                block.start, block.end, block.insts, flow_names[block.exit]);
+        if (label != labels.end())
+            fprintf(out, ", \"label\": \"%s\"", label->second.c_str());
+
+        fprintf(out, ", \"successors\": [");
+        for (u32 j = 0; j < block.successors.size(); j++)
+            fprintf(out, "%s%u", j ? ", " : "", block.successors[j]);
+        fprintf(out, "], \"calls\": [");
+        for (u32 j = 0; j < block.calls.size(); j++)
+            fprintf(out, "%s%u", j ? ", " : "", block.calls[j]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ],\n");
+
+    // Runs of data
+    fprintf(out, "  \"data\": [");
+    bool first = true;
+    for (u32 i = 0; i < kind.size();) {
+        if (kind[i] != DISASM_DATA) {
+            i++;
+            continue;
+        }
+        u32 j = i;
+        while (j < kind.size() && kind[j] == DISASM_DATA)
+            j++;
+        fprintf(out, "%s{\"start\": %u, \"end\": %u}", first ? "" : ", ", start + i, start + j);
+        first = false;
+        i = j;
+    }
+    fprintf(out, "],\n");
+
+    fprintf(out, "  \"labels\": {");
+    first = true;
+    for (const auto &label : labels) {
+        fprintf(out, "%s\"%s\": %u", first ? "" : ", ", label.second.c_str(), label.first);
+        first = false;
+    }
+    fprintf(out, "}\n}\n");
+}
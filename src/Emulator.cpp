@@ -3,6 +3,17 @@
 #include <string>
 #include "../include/Chip8.h"
 #include "../include/Emulator.h"
+#include "../include/Debug.h"
+#include "../include/Trace.h"
+#include "../include/Profiler.h"
+#include "../include/Latency.h"
+#include "../include/Metrics.h"
+#include "../include/Hud.h"
+#include "../include/Heatmap.h"
+#include "../include/GdbStub.h"
+#include "../include/Reverse.h"
+#include "../include/TraceDb.h"
+#include "../include/Watch.h"
 #include "../include/INIReader.h"
 
 // SDL Audio callback
@@ -23,6 +34,11 @@ void audio_callback(void *userdata, u8 *stream, i32 len) {
         audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ?
                         config->volume : 
                         -config->volume;
+
+    if (metrics.active())
+        metrics.audio_callback(len / 2, config->audio_sample_rate);
+    if (hud.visible)
+        hud.audio_callback(len / 2);
 }
 
 // Initialize SDL
@@ -48,6 +64,19 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         return false;
     }
 
+    // Allocated once for 128x64, lo-res frames only upload/copy the top-left 64x32
+    sdl->texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (!sdl->texture) {
+        SDL_Log("Could not create SDL texture %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Glyph atlas for the F1 HUD
+    if (!hud.init(sdl->renderer))
+        return false;
+
     // Init Audio stuff
     sdl->want = (SDL_AudioSpec) {
         .freq = 44100,              // 44100hz "CD" quality
@@ -90,13 +119,30 @@ void init_config(config_t *config) {
         .audio_sample_rate = 44100,     // CD quality, 44100hz
         .volume = 3000,                 // INT16_MAX would be max volume
         .current_extension = CHIP8,     // Set default quirks/extension to plain OG Chip-8
+        .quirks = QUIRKS_AUTO,          // Quirks follow the extension
         .refresh_rate = 60,             // Default refresh rate of CRT
+        .profile_file = "profile.folded",
+        .heatmap_file = "heatmap",
+        .trace_db_dir = "trace.db",
+        .checkpoint_interval = 10000,
+        .checkpoints = 64,
+    };
+
+    // XO-CHIP colors for pixels lit on more than plane 0, [0]/[1] follow the theme below
+    const u32 plane_colors[16] = {
+        0x000000FF, 0xFFFFFFFF, 0xFF6600FF, 0x662200FF,
+        0x00AAFFFF, 0x0055AAFF, 0xAA00FFFF, 0x5500AAFF,
+        0x00FF66FF, 0x00AA44FF, 0xFFFF66FF, 0xAAAA44FF,
+        0xFF66AAFF, 0xAA4466FF, 0xAAAAAAFF, 0x555555FF,
     };
+    memcpy(config->plane_colors, plane_colors, sizeof plane_colors);
 
     INIReader reader("config.ini");
 
     if (reader.ParseError() < 0) {
         SDL_Log("No config file found!\n");
+        config->plane_colors[0] = config->bg_color;
+        config->plane_colors[1] = config->fg_color;
         return;
     }
 
@@ -116,6 +162,9 @@ void init_config(config_t *config) {
         config->bg_color = 0xFFFFFFFF;
     }
 
+    config->plane_colors[0] = config->bg_color;
+    config->plane_colors[1] = config->fg_color;
+
     str = reader.Get("Display", "pixel_boundary", "false");
     if (str == "true")
         config->pixel_outlines = true;
@@ -167,9 +216,71 @@ void init_config(config_t *config) {
     if (str == "true")
         config->performance_metrics = true;
 
-    str = reader.Get("Extension", "vairant", "Standard");
+    str = reader.Get("Debug_logs", "trace_file", "");
+    snprintf(config->trace_file, sizeof config->trace_file, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "profiler", "false");
+    if (str == "true")
+        config->profiler = true;
+    str = reader.Get("Debug_logs", "profile_file", "profile.folded");
+    snprintf(config->profile_file, sizeof config->profile_file, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "latency_metrics", "false");
+    if (str == "true")
+        config->latency_metrics = true;
+    str = reader.Get("Debug_logs", "latency_file", "");
+    snprintf(config->latency_file, sizeof config->latency_file, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "metrics_shm", "");
+    snprintf(config->metrics_shm, sizeof config->metrics_shm, "%s", str.c_str());
+    str = reader.Get("Debug_logs", "metrics_file", "");
+    snprintf(config->metrics_file, sizeof config->metrics_file, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "heatmap", "false");
+    if (str == "true")
+        config->heatmap = true;
+    str = reader.Get("Debug_logs", "heatmap_file", "heatmap");
+    snprintf(config->heatmap_file, sizeof config->heatmap_file, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "gdb", "");
+    snprintf(config->gdb, sizeof config->gdb, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "trace_db", "false");
+    if (str == "true")
+        config->trace_db = true;
+    str = reader.Get("Debug_logs", "trace_db_dir", "trace.db");
+    snprintf(config->trace_db_dir, sizeof config->trace_db_dir, "%s", str.c_str());
+
+    str = reader.Get("Debug_logs", "reverse", "false");
+    if (str == "true")
+        config->reverse = true;
+    str = reader.Get("Debug_logs", "checkpoint_interval", "10000");
+    config->checkpoint_interval = std::stoi(str);
+    str = reader.Get("Debug_logs", "checkpoints", "64");
+    config->checkpoints = std::stoi(str);
+
+    str = reader.Get("Extension", "variant", "Standard");
     if (str == "Super")
         config->current_extension = SUPERCHIP8;
+    else if (str == "XO")
+        config->current_extension = XOCHIP;
+
+    str = reader.Get("Extension", "quirks", "Auto");
+    if (str == "VIP")
+        config->quirks = QUIRKS_VIP;
+    else if (str == "Standard")
+        config->quirks = QUIRKS_STANDARD;
+    else if (str == "Super")
+        config->quirks = QUIRKS_SCHIP;
+    else if (str == "XO")
+        config->quirks = QUIRKS_XOCHIP;
+
+    str = reader.Get("Assembler", "optimize", "false");
+    if (str == "true")
+        config->optimize = true;
+    str = reader.Get("Assembler", "watch", "false");
+    if (str == "true")
+        config->watch = true;
 }
 
 // Clear screen / SDL Window to background color
@@ -185,59 +296,81 @@ void clear_screen(const sdl_t sdl, const config_t config) {
 
 // Update window with any changes
 void update_screen(const sdl_t sdl, const config_t config, Chip8 *chip8) {
-    SDL_Rect rect = {.x = 0, .y = 0, .w = (i32) config.scale_factor, .h = (i32) config.scale_factor};
-
-    // Grab bg color values to draw outlines
-    const u8 bg_r = (config.bg_color >> 24) & 0xFF;
-    const u8 bg_g = (config.bg_color >> 16) & 0xFF;
-    const u8 bg_b = (config.bg_color >>  8) & 0xFF;
-    const u8 bg_a = (config.bg_color >>  0) & 0xFF;
-
-    // Loop through display pixels, draw a rectangle per pixel to the SDL window
-    for (u32 i = 0; i < sizeof chip8->display; i++) {
-        // Translate 1D index i value to 2D X/Y coordinates
-        // X = i % window width
-        // Y = i / window width
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
-
-        if (chip8->display[i]) {
-            // Pixel is on, draw foreground color
-            if (chip8->pixel_color[i] != config.fg_color) {
-                chip8->pixel_color[i] = config.fg_color;
-            }
-
-            const u8 r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const u8 g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const u8 b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const u8 a = (chip8->pixel_color[i] >>  0) & 0xFF;
+    const u32 width = chip8->display_width();
+    const u32 height = chip8->display_height();
+    const SDL_Rect src = {.x = 0, .y = 0, .w = (i32) width, .h = (i32) height};
+
+    if (config.latency_metrics)
+        latency.render_started();
+
+    // Unpack rows changed since the last update into RGBA pixels and upload the span
+    // between the first and last of them, pixel_color is used as the texture upload
+    // buffer and keeps the other rows from earlier frames
+    const u64 dirty = chip8->dirty_rows & (height == 64 ? ~0ULL : (1ULL << height) - 1);
+    hud.dirty_rows = __builtin_popcountll(dirty);
+    if (dirty) {
+        const u32 first = __builtin_ctzll(dirty);
+        const u32 last = 63 - __builtin_clzll(dirty);
+        const SDL_Rect rows = {.x = 0, .y = (i32) first, .w = (i32) width, .h = (i32) (last - first + 1)};
+
+        for (u32 y = first; y <= last; y++) {
+            if (!(dirty >> y & 1))
+                continue;
+            u32 *pixels = &chip8->pixel_color[y * width];
+
+            for (u32 x = 0; x < width; x++)
+                pixels[x] = config.plane_colors[chip8->pixel(x, y)];
+        }
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
-        
-            if (config.pixel_outlines) {
-                // If user requested drawing pixel outlines, draw those here
-                SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+        SDL_UpdateTexture(sdl.texture, &rows, &chip8->pixel_color[first * width], width * sizeof(u32));
+    }
+    chip8->dirty_rows = 0;
+
+    SDL_RenderCopy(sdl.renderer, sdl.texture, &src, NULL);   // Stretch to the whole window
+
+    if (config.pixel_outlines) {
+        // If user requested drawing pixel outlines, draw those over every lit pixel
+        // Hi-res pixels are half the size of lo-res ones in the same window
+        const i32 size = (config.window_width * config.scale_factor) / width;
+        SDL_Rect rect = {.x = 0, .y = 0, .w = size, .h = size};
+
+        const u8 bg_r = (config.bg_color >> 24) & 0xFF;
+        const u8 bg_g = (config.bg_color >> 16) & 0xFF;
+        const u8 bg_b = (config.bg_color >>  8) & 0xFF;
+        const u8 bg_a = (config.bg_color >>  0) & 0xFF;
+        SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+
+        for (u32 y = 0; y < height; y++) {
+            for (u32 x = 0; x < width; x++) {
+                if (!chip8->pixel(x, y))
+                    continue;
+                rect.x = x * size;
+                rect.y = y * size;
                 SDL_RenderDrawRect(sdl.renderer, &rect);
             }
-
-        } else {
-            // Pixel is off, draw background color
-            if (chip8->pixel_color[i] != config.bg_color) {
-                chip8->pixel_color[i] = config.bg_color;
-            }
-
-            const u8 r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const u8 g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const u8 b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const u8 a = (chip8->pixel_color[i] >>  0) & 0xFF;
-
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
         }
     }
 
+    if (hud.visible)
+        hud.render(sdl.renderer, chip8, config);
+
     SDL_RenderPresent(sdl.renderer);
+    if (config.latency_metrics)
+        latency.presented();
+    if (metrics.active())
+        metrics.presented();
+}
+
+// Write the latency report to latency_file, or stdout if there is none
+void report_latency(const config_t &config) {
+    FILE *out = config.latency_file[0] != '\0' ? fopen(config.latency_file, "w") : stdout;
+    if (out) {
+        latency.report(out);
+        if (out != stdout)
+            fclose(out);
+    } else {
+        SDL_Log("Could not open latency file %s\n", config.latency_file);
+    }
 }
 
 // Handle user input
@@ -257,9 +390,14 @@ void handle_input(Chip8 *chip8, config_t *config, emu_state_t *state, sdl_t *sdl
                 *state = QUIT; // Will exit main emulator loop
                 break;
 
-            case SDL_KEYDOWN:
+            case SDL_KEYDOWN: {
                 if (config->input_keys)
                     printf ("[KeyDown] KeyCode: %d\n", event.key.keysym.sym);
+
+                // Keypad state before this event, to timestamp new presses (not key repeats)
+                bool prev_keypad[sizeof chip8->keypad];
+                memcpy(prev_keypad, chip8->keypad, sizeof prev_keypad);
+
                 switch (event.key.keysym.sym) {
                     case SDLK_ESCAPE:
                         // Escape key; Exit window & End program
@@ -277,20 +415,80 @@ void handle_input(Chip8 *chip8, config_t *config, emu_state_t *state, sdl_t *sdl
                         }
                         break;
 
-                    case SDLK_MINUS:
+                    case SDLK_MINUS: {
                         // '-': Reset Chip-8 machine for the current ROM
+                        std::vector<u8> before(XO_RAM_SIZE, 0);
+                        memcpy(before.data(), chip8->ram, chip8->ram_size);
                         chip8->init_chip8(config, file_path);
+                        if (tracedb.active())
+                            tracedb.patch(*chip8, before.data());
+                        if (reverse.active())
+                            reverse.reset(*chip8);
+                    }
                         break;
 
                     case SDLK_EQUALS:
                         // '=': Update new to new config
                         init_config(config);
+
+                        // The profiler hooks only run on what it allocated, start or stop it to match
+                        if (config->profiler && !profiler.active()) {
+                            if (!profiler.start(chip8->PC))
+                                config->profiler = false;
+                        } else if (!config->profiler && profiler.active()) {
+                            profiler.report(stdout);
+                            profiler.write_collapsed(config->profile_file);
+                            profiler.stop();
+                        }
+
+                        // Same for the heatmap, its counts are dumped when it's turned off
+                        if (config->heatmap && !heatmap.active()) {
+                            if (!heatmap.start())
+                                config->heatmap = false;
+                        } else if (!config->heatmap && heatmap.active()) {
+                            heatmap.dump(config->heatmap_file, chip8->ram_size);
+                            heatmap.report(stdout, chip8->ram_size);
+                            heatmap.stop();
+                        }
+
+                        // Latency has nothing to allocate, but it divides by the tick rate start() reads
+                        if (config->latency_metrics && !latency.active()) {
+                            latency.start();
+                        } else if (!config->latency_metrics && latency.active()) {
+                            report_latency(*config);
+                            latency.stop();
+                        }
+                        chip8->select_interpreter(config);
+                        chip8->dirty_rows = ~0ULL;     // Colors may have changed
+                        chip8->draw = true;
                         if (prev_scale_factor != config->scale_factor)
                             SDL_SetWindowSize(sdl->window,
                                     config->window_width * config->scale_factor,
                                     config->window_height * config->scale_factor);
                         break;
 
+                    case SDLK_F1:
+                        // F1: Toggle the performance HUD
+                        hud.visible = !hud.visible;
+                        chip8->draw = true;
+                        break;
+
+                    case SDLK_F2:
+                        // F2: Print the profile so far
+                        if (profiler.active()) {
+                            profiler.report(stdout);
+                            profiler.write_collapsed(config->profile_file);
+                        }
+                        break;
+
+                    case SDLK_F3:
+                        // F3: Dump the memory heatmap so far
+                        if (heatmap.active()) {
+                            heatmap.dump(config->heatmap_file, chip8->ram_size);
+                            heatmap.report(stdout, chip8->ram_size);
+                        }
+                        break;
+
                     case SDLK_o:
                         // 'o': Decrease Volume
                         if (config->volume > 0)
@@ -327,7 +525,13 @@ void handle_input(Chip8 *chip8, config_t *config, emu_state_t *state, sdl_t *sdl
                     default: break;
                         
                 }
+
+                if (config->latency_metrics)
+                    for (u8 key = 0; key < sizeof prev_keypad; key++)
+                        if (chip8->keypad[key] && !prev_keypad[key])
+                            latency.key_pressed(key);
                 break; 
+            }
 
             case SDL_KEYUP:
                 if (config->input_keys)
@@ -375,6 +579,8 @@ void update_timers(const sdl_t sdl, Chip8 *chip8, config_t config) {
     } else {
         SDL_PauseAudioDevice(sdl.dev, 1); // Pause sound
     }
+    if (metrics.active())
+        metrics.audio_state(chip8->sound_timer > 0);
 
     if (config.timers)
         printf("Sound: %02X Delay: %02X\n", chip8->sound_timer, chip8->delay_timer);
@@ -382,19 +588,54 @@ void update_timers(const sdl_t sdl, Chip8 *chip8, config_t config) {
 
 // Final cleanup
 void final_cleanup(const sdl_t sdl) {
+    hud.destroy();
+    SDL_DestroyTexture(sdl.texture);
     SDL_DestroyRenderer(sdl.renderer);
     SDL_DestroyWindow(sdl.window);
     SDL_CloseAudioDevice(sdl.dev);
     SDL_Quit(); // Shut down SDL subsystem
 }
 
+// Run without a window or audio, printing the state hash after every frame
+// Two runs of the same ROM, config and seed print the same lines until they diverge
+void run_headless(Chip8 *chip8, const config_t &config, u64 frames) {
+    for (u64 frame = 0; frame < frames; frame++) {
+        chip8->vblank = true;
+        if (tracedb.active())
+            tracedb.frame();
+        for (u32 i = 0; i < config.insts_per_second / config.refresh_rate; i++)
+            chip8->emulate_inst(config);
+        debug_flush();
+
+        if (chip8->delay_timer > 0)
+            chip8->delay_timer--;
+        if (chip8->sound_timer > 0)
+            chip8->sound_timer--;
+
+        printf("%llu %016llx\n", (long long unsigned) frame, (long long unsigned) chip8->state_hash());
+    }
+}
+
 int main(int argc, char *argv[]) {
     // Default usage message for args
     if (argc < 2) {
-       fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
+       fprintf(stderr, "Usage: %s <rom_name> [--headless <frames>] [--seed <n>]\n", argv[0]);
        exit(EXIT_FAILURE);
     }
 
+    u64 headless_frames = 0;
+    u32 seed = time(NULL);
+    for (i32 i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+            headless_frames = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Initialize emulator state
     emu_state_t state = RUNNING;
 
@@ -402,23 +643,90 @@ int main(int argc, char *argv[]) {
     config_t config = {0};
     init_config(&config);
 
+    // Seed random number generator, init_chip8 takes the machine's RNG seed from it
+    srand(seed);
+
+    // Initialize CHIP8 machine
+    Chip8 chip8 = {};
+    const char *file_path = argv[1];
+    if (!chip8.init_chip8(&config, file_path))
+        exit(EXIT_FAILURE);
+
+    if (headless_frames) {
+        // The hashes go to stdout, the profile and heatmap to stderr so runs still diff cleanly
+        if (config.profiler && !profiler.start(chip8.PC))
+            exit(EXIT_FAILURE);
+        if (config.heatmap && !heatmap.start())
+            exit(EXIT_FAILURE);
+        if (config.latency_metrics)
+            latency.start();
+        if (config.trace_db) {
+            if (!tracedb.open(config.trace_db_dir, chip8))
+                exit(EXIT_FAILURE);
+            chip8.select_interpreter(&config);
+        }
+        run_headless(&chip8, config, headless_frames);
+        if (config.profiler) {
+            profiler.report(stderr);
+            profiler.write_collapsed(config.profile_file);
+        }
+        tracedb.close();
+        if (heatmap.active()) {
+            heatmap.dump(config.heatmap_file, chip8.ram_size);
+            heatmap.report(stderr, chip8.ram_size);
+            heatmap.stop();
+        }
+        chip8.free_chip8();
+        exit(EXIT_SUCCESS);
+    }
+
     // Initialize SDL
     sdl_t sdl = {0};
     if (!init_sdl(&sdl, &config))
         exit(EXIT_FAILURE);
 
-    // Initialize CHIP8 machine
-    Chip8 chip8;
-    const char *file_path = argv[1];
-    if (!chip8.init_chip8(&config, file_path))
+    // Send debug logs to the binary trace file, if any
+    if (config.trace_file[0] != '\0' && !trace_sink.open(config.trace_file))
+        exit(EXIT_FAILURE);
+
+    if (config.latency_metrics)
+        latency.start();
+
+    // Count memory accesses for the whole session
+    if (config.heatmap && !heatmap.start())
+        exit(EXIT_FAILURE);
+
+    // Live counters for chip8-top and Prometheus
+    if ((config.metrics_shm[0] != '\0' || config.metrics_file[0] != '\0') &&
+        !metrics.open(config.metrics_shm, config.metrics_file))
+        exit(EXIT_FAILURE);
+
+    // Wait for debuggers in the background
+    if (config.gdb[0] != '\0' && !gdb_stub.open(config.gdb))
+        exit(EXIT_FAILURE);
+
+    // Record the whole session for chip8-tdb, init_chip8 picked the interpreter before it was open
+    if (config.trace_db) {
+        if (!tracedb.open(config.trace_db_dir, chip8))
+            exit(EXIT_FAILURE);
+        chip8.select_interpreter(&config);
+    }
+
+    // History for reverse step/continue
+    if (config.reverse && !reverse.start(config.checkpoint_interval, config.checkpoints))
+        exit(EXIT_FAILURE);
+
+    // Profile the whole session
+    if (config.profiler && !profiler.start(chip8.PC))
+        exit(EXIT_FAILURE);
+
+    // Pick up edits to the source without restarting
+    if (config.watch && !watch.start(chip8, config, file_path))
         exit(EXIT_FAILURE);
 
     // Initial screen clear to background color
     clear_screen(sdl, config);
 
-    // Seed random number generator for a chip-8 inst
-    srand(time(NULL));
-
     f64 next_update_time = 1000.0 / config.refresh_rate;
 
     // Main emulator loop
@@ -426,37 +734,98 @@ int main(int argc, char *argv[]) {
         // Handle user input
         handle_input(&chip8, &config, &state, &sdl, file_path);
 
+        // Saved sources are reloaded even while paused
+        if (watch.active())
+            watch.poll(&chip8, config);
+
         if (state == PAUSED) continue;
 
+        // Serve the debugger, stay on this instruction while it has the target halted
+        if (gdb_stub.active()) {
+            gdb_stub.poll(&chip8, config);
+            if (gdb_stub.halted()) {
+                SDL_Delay(1);
+                continue;
+            }
+        }
+
         // Get time before running instructions 
         const u64 start_frame_time = SDL_GetPerformanceCounter();
+        if (config.latency_metrics)
+            latency.frame_started();
         
         // Emulate CHIP8 Instructions for this emulator "frame" (60hz)
-        for (u32 i = 0; i < config.insts_per_second / config.refresh_rate; i++)
-            chip8.emulate_inst(config);
+        chip8.vblank = true;
+        if (reverse.active())
+            reverse.frame(chip8);
+        if (tracedb.active())
+            tracedb.frame();
+        if (gdb_stub.checking()) {
+            gdb_stub.run(&chip8, config, config.insts_per_second / config.refresh_rate);
+        } else {
+            for (u32 i = 0; i < config.insts_per_second / config.refresh_rate; i++)
+                chip8.emulate_inst(config);
+        }
 
         // Get time elapsed after running instructions
         const u64 end_frame_time = SDL_GetPerformanceCounter();
+        if (profiler.active())
+            profiler.pause();
+        if (config.latency_metrics)
+            latency.burst_ended();
+
+        // Print this frame's debug logs outside of the timed burst
+        debug_flush();
 
         const f64 time_elapsed = (f64) ((end_frame_time - start_frame_time) * 1000) / SDL_GetPerformanceFrequency();
 
+        if (metrics.active())
+            metrics.burst(config.insts_per_second / config.refresh_rate, end_frame_time - start_frame_time,
+                          time_elapsed > next_update_time);
+
         if (config.performance_metrics)
             printf("Time to execute %d instructions: %0.6fms\n", config.insts_per_second, time_elapsed);
 
         // Delay for next update
         SDL_Delay(next_update_time > time_elapsed ? next_update_time - time_elapsed : 0);
 
-        // Update window with changes every 60hz
-        if (chip8.draw) {
+        // Update window with changes every 60hz, every frame while the HUD is up
+        if (chip8.draw || hud.visible) {
           update_screen(sdl, config, &chip8);
           chip8.draw = false;
         }
         
         // Update delay & sound timers every 60hz
         update_timers(sdl, &chip8, config);
+
+        if (metrics.active())
+            metrics.publish();
+        hud.frame(config.insts_per_second / config.refresh_rate);
     }
 
     // Final cleanup
+    debug_flush();
+    trace_sink.close();
+    if (profiler.active()) {
+        profiler.report(stdout);
+        profiler.write_collapsed(config.profile_file);
+        profiler.stop();
+    }
+    if (latency.active()) {
+        report_latency(config);
+        latency.stop();
+    }
+    gdb_stub.close();
+    watch.stop();
+    reverse.stop();
+    tracedb.close();
+    metrics.close();
+    if (heatmap.active()) {
+        heatmap.dump(config.heatmap_file, chip8.ram_size);
+        heatmap.report(stdout, chip8.ram_size);
+        heatmap.stop();
+    }
+    chip8.free_chip8();
     final_cleanup(sdl); 
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,541 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../include/GdbStub.h"
+#include "../include/Chip8.h"
+#include "../include/Reverse.h"
+#include "../include/TraceDb.h"
+
+GdbStub gdb_stub;
+
+#define GDB_REGS 19     // V0-VF, I, PC, SP
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void append_hex(std::string &out, u8 byte) {
+    out += hex_digits[byte >> 4];
+    out += hex_digits[byte & 0xF];
+}
+
+static u8 hex_byte(const char *hex) {
+    char digits[3] = {hex[0], hex[1], '\0'};
+    return strtoul(digits, NULL, 16);
+}
+
+// Register layout of 'g' and 'p', see target_xml
+static u32 reg_size(u32 reg) {
+    return reg == 16 || reg == 17 ? 2 : 1;
+}
+
+static u16 get_reg(const Chip8 *chip8, u32 reg) {
+    if (reg < 16)
+        return chip8->V[reg];
+    if (reg == 16)
+        return chip8->I;
+    if (reg == 17)
+        return chip8->PC;
+    return chip8->SP;
+}
+
+static void set_reg(Chip8 *chip8, u32 reg, u16 value) {
+    if (reg < 16)
+        chip8->V[reg] = value;
+    else if (reg == 16)
+        chip8->I = value;
+    else if (reg == 17)
+        chip8->PC = value;
+    else
+        chip8->SP = value;
+}
+
+// Registers in target byte order (little endian)
+static void append_reg(std::string &out, const Chip8 *chip8, u32 reg) {
+    const u16 value = get_reg(chip8, reg);
+    for (u32 i = 0; i < reg_size(reg); i++)
+        append_hex(out, value >> (8 * i));
+}
+
+static u16 parse_reg(const char *hex, u32 reg) {
+    u16 value = 0;
+    for (u32 i = 0; i < reg_size(reg); i++)
+        value |= hex_byte(hex + 2 * i) << (8 * i);
+    return value;
+}
+
+// Register names for debuggers that read the target description
+static std::string target_xml() {
+    std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                      "<target version=\"1.0\"><feature name=\"org.chip8.core\">";
+    for (u32 reg = 0; reg < 16; reg++)
+        xml += "<reg name=\"v" + std::string(1, hex_digits[reg]) + "\" bitsize=\"8\" type=\"uint8\"/>";
+    xml += "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+           "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+           "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+           "</feature></target>";
+    return xml;
+}
+
+static bool set_nonblocking(i32 fd) {
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0;
+}
+
+bool GdbStub::open(const char *address) {
+    const bool tcp = strspn(address, "0123456789") == strlen(address);
+
+    if (tcp) {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);     // Local debuggers only
+
+        const i32 yes = 1;
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd >= 0)
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr *) &addr, sizeof addr) != 0) {
+            SDL_Log("Could not listen for GDB on port %s: %s\n", address, strerror(errno));
+            close();
+            return false;
+        }
+    } else {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof addr.sun_path, "%s", address);
+        unlink(address);
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr *) &addr, sizeof addr) != 0) {
+            SDL_Log("Could not listen for GDB on %s: %s\n", address, strerror(errno));
+            close();
+            return false;
+        }
+        unix_path = address;
+    }
+
+    if (listen(listen_fd, 1) != 0 || !set_nonblocking(listen_fd)) {
+        SDL_Log("Could not listen for GDB on %s: %s\n", address, strerror(errno));
+        close();
+        return false;
+    }
+
+    memset(breakpoints, 0, sizeof breakpoints);
+    memset(write_watch, 0, sizeof write_watch);
+    memset(read_watch, 0, sizeof read_watch);
+    breakpoint_count = watchpoint_count = 0;
+
+    return true;    // Success
+}
+
+void GdbStub::close() {
+    disconnect();
+    if (listen_fd >= 0)
+        ::close(listen_fd);
+    listen_fd = -1;
+    if (!unix_path.empty())
+        unlink(unix_path.c_str());
+    unix_path.clear();
+}
+
+// Debugger went away, let the emulator run freely again
+void GdbStub::disconnect() {
+    if (client_fd >= 0)
+        ::close(client_fd);
+    client_fd = -1;
+    in.clear();
+    if (watchpoint_count)
+        unwatched = true;
+    memset(breakpoints, 0, sizeof breakpoints);
+    memset(write_watch, 0, sizeof write_watch);
+    memset(read_watch, 0, sizeof read_watch);
+    breakpoint_count = watchpoint_count = 0;
+    stepping = resumed = false;
+    stop = GDB_RUNNING;
+}
+
+void GdbStub::send_packet(const std::string &data) {
+    u8 checksum = 0;
+    for (char c : data)
+        checksum += (u8) c;
+
+    std::string packet = "$" + data + "#";
+    append_hex(packet, checksum);
+
+    // The socket is non-blocking, retry until the whole reply is out
+    for (size_t sent = 0; sent < packet.size() && client_fd >= 0;) {
+        const ssize_t n = send(client_fd, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+        if (n > 0)
+            sent += n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            disconnect();
+    }
+}
+
+// Halt and tell the debugger why
+void GdbStub::stopped(gdb_stop_t reason) {
+    stop = reason;
+    stepping = false;
+
+    if (reason == GDB_INTERRUPT) {
+        send_packet("S02");
+        return;
+    }
+
+    std::string reply = "T05";
+    if (watch_hit >= 0) {
+        char watch[32];
+        snprintf(watch, sizeof watch, "%swatch:%x;", watch_kind == 'w' ? "" : "r", watch_hit);
+        reply += watch;
+        watch_hit = -1;
+    }
+    send_packet(reply);
+}
+
+void GdbStub::poll(Chip8 *chip8, const config_t &config) {
+    if (client_fd < 0) {
+        client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd >= 0) {
+            const i32 yes = 1;
+            set_nonblocking(client_fd);
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);   // Fails harmlessly on Unix sockets
+            stop = GDB_INTERRUPT;   // Debuggers expect a halted target on attach
+            SDL_Log("GDB attached\n");
+        }
+    }
+
+    char buffer[4096];
+    while (client_fd >= 0) {
+        const ssize_t n = recv(client_fd, buffer, sizeof buffer, 0);
+        if (n > 0) {
+            in.append(buffer, n);
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            SDL_Log("GDB detached\n");
+            disconnect();
+        } else {
+            break;
+        }
+    }
+
+    // Split into $<data>#<checksum> packets
+    while (!in.empty() && client_fd >= 0) {
+        if (in[0] == '\x03') {
+            // Ctrl-C
+            in.erase(0, 1);
+            if (stop == GDB_RUNNING)
+                stopped(GDB_INTERRUPT);
+            continue;
+        }
+        if (in[0] != '$') {
+            in.erase(0, 1);     // Acks and noise
+            continue;
+        }
+
+        const size_t hash = in.find('#');
+        if (hash == std::string::npos || hash + 2 >= in.size()) {
+            if (in.size() > GDB_BUFFER_SIZE)
+                in.clear();
+            break;      // Wait for the rest of the packet
+        }
+
+        const std::string packet = in.substr(1, hash - 1);
+        u8 checksum = 0;
+        for (char c : packet)
+            checksum += (u8) c;
+        const bool valid = checksum == hex_byte(&in[hash + 1]);
+        in.erase(0, hash + 3);
+
+        send(client_fd, valid ? "+" : "-", 1, MSG_NOSIGNAL);
+        if (valid)
+            handle_packet(packet, chip8, config);
+    }
+
+    // Detached, killed or dropped while watching, same as removing the last watchpoint
+    if (unwatched) {
+        unwatched = false;
+        chip8->select_interpreter(&config);
+    }
+}
+
+void GdbStub::handle_packet(const std::string &packet, Chip8 *chip8, const config_t &config) {
+    const char *args = packet.c_str() + 1;
+    const u32 mem_size = chip8->ram_size + RAM_PADDING;
+    std::string reply;
+
+    switch (packet[0]) {
+        case '?':
+            stopped(stop == GDB_RUNNING ? GDB_INTERRUPT : stop);
+            return;
+
+        case 'g':
+            for (u32 reg = 0; reg < GDB_REGS; reg++)
+                append_reg(reply, chip8, reg);
+            break;
+
+        case 'G':
+            reply = "OK";
+            for (u32 reg = 0; reg < GDB_REGS && *args; reg++) {
+                // A register cut off by the end of the packet, the ones before it are already set
+                if (strlen(args) < 2 * reg_size(reg)) {
+                    reply = "E01";
+                    break;
+                }
+                set_reg(chip8, reg, parse_reg(args, reg));
+                args += 2 * reg_size(reg);
+            }
+            if (reverse.active())
+                reverse.reset(*chip8);
+            break;
+
+        case 'p': {
+            const u32 reg = strtoul(args, NULL, 16);
+            if (reg < GDB_REGS)
+                append_reg(reply, chip8, reg);
+            else
+                reply = "E01";
+        }
+            break;
+
+        case 'P': {
+            char *value;
+            const u32 reg = strtoul(args, &value, 16);
+            if (reg < GDB_REGS && *value == '=') {
+                set_reg(chip8, reg, parse_reg(value + 1, reg));
+                if (reverse.active())
+                    reverse.reset(*chip8);
+                reply = "OK";
+            } else {
+                reply = "E01";
+            }
+        }
+            break;
+
+        case 'm': {
+            char *end;
+            const u32 addr = strtoul(args, &end, 16);
+            const u32 len = strtoul(end + 1, NULL, 16);
+            if (addr >= mem_size) {
+                reply = "E01";
+                break;
+            }
+            // Reads running past the end stop there, len is never added to addr so it can't wrap
+            const u32 count = len < mem_size - addr ? len : mem_size - addr;
+            for (u32 i = addr; i < addr + count && reply.size() < GDB_BUFFER_SIZE - 8; i++)
+                append_hex(reply, chip8->ram[i]);
+        }
+            break;
+
+        case 'M': {
+            char *end;
+            const u32 addr = strtoul(args, &end, 16);
+            const u32 len = strtoul(end + 1, &end, 16);
+            if (*end != ':' || addr >= mem_size || len > mem_size - addr || strlen(end + 1) < 2 * len) {
+                reply = "E01";
+                break;
+            }
+            for (u32 i = 0; i < len; i++)
+                chip8->ram[addr + i] = hex_byte(end + 1 + 2 * i);
+            if (len)
+                chip8->touch(addr, len);
+            if (tracedb.active())
+                tracedb.patch(*chip8, addr, len);
+            if (reverse.active())
+                reverse.reset(*chip8);
+            reply = "OK";
+        }
+            break;
+
+        case 'c':
+        case 's':
+            if (*args) {
+                chip8->PC = strtoul(args, NULL, 16);
+                if (reverse.active())
+                    reverse.reset(*chip8);
+            }
+            stepping = packet[0] == 's';
+            resumed = true;
+            stop = GDB_RUNNING;
+            return;     // Replied to when the target stops again
+
+        // bs/bc - Reverse step/continue
+        case 'b':
+            if (!reverse.active() || (packet != "bs" && packet != "bc"))
+                break;
+            if (packet == "bs")
+                reverse_step(chip8, config);
+            else
+                reverse_continue(chip8, config);
+            return;
+
+        case 'Z':
+        case 'z':
+            reply = set_point(packet, packet[0] == 'Z', chip8, config) ? "OK" : "E01";
+            break;
+
+        case 'D':
+            send_packet("OK");
+            SDL_Log("GDB detached\n");
+            disconnect();
+            return;
+
+        case 'k':
+            disconnect();
+            return;
+
+        case 'H':
+            reply = "OK";
+            break;
+
+        case 'q':
+            if (packet.rfind("qSupported", 0) == 0) {
+                char supported[64];
+                snprintf(supported, sizeof supported, "PacketSize=%x;qXfer:features:read+", GDB_BUFFER_SIZE);
+                reply = supported;
+                if (reverse.active())
+                    reply += ";ReverseStep+;ReverseContinue+";
+            } else if (packet == "qAttached") {
+                reply = "1";
+            } else if (packet == "qC") {
+                reply = "QC1";
+            } else if (packet == "qfThreadInfo") {
+                reply = "m1";
+            } else if (packet == "qsThreadInfo") {
+                reply = "l";
+            } else if (packet.rfind("qXfer:features:read:target.xml:", 0) == 0) {
+                const std::string xml = target_xml();
+                unsigned offset = 0, length = 0;
+                sscanf(packet.c_str() + strlen("qXfer:features:read:target.xml:"), "%x,%x", &offset, &length);
+                if (offset >= xml.size())
+                    reply = "l";
+                else
+                    reply = (offset + length >= xml.size() ? "l" : "m") + xml.substr(offset, length);
+            }
+            break;
+
+        default:
+            break;      // Empty reply, not supported
+    }
+
+    send_packet(reply);
+}
+
+// Z/z<type>,<addr>,<kind or length>
+bool GdbStub::set_point(const std::string &packet, bool insert, Chip8 *chip8, const config_t &config) {
+    unsigned type, addr, len;
+    if (sscanf(packet.c_str() + 1, "%u,%x,%x", &type, &addr, &len) != 3 || type > 4 || addr >= GDB_ADDRESSES)
+        return false;
+
+    const bool was_watching = watching();
+
+    if (type <= 1) {
+        // Software and hardware breakpoints are the same thing here
+        const u64 bit = 1ULL << (addr & 63);
+        if (insert && !(breakpoints[addr >> 6] & bit))
+            breakpoint_count++;
+        else if (!insert && (breakpoints[addr >> 6] & bit))
+            breakpoint_count--;
+        breakpoints[addr >> 6] = insert ? breakpoints[addr >> 6] | bit : breakpoints[addr >> 6] & ~bit;
+        return true;
+    }
+
+    // 2 write, 3 read, 4 access watchpoints over [addr, addr + len)
+    for (u32 a = addr; a - addr < len && a < GDB_ADDRESSES; a++) {
+        const u64 bit = 1ULL << (a & 63);
+        for (u64 *bitmap : {write_watch, read_watch}) {
+            if ((bitmap == write_watch && type == 3) || (bitmap == read_watch && type == 2))
+                continue;
+            if (insert && !(bitmap[a >> 6] & bit))
+                watchpoint_count++;
+            else if (!insert && (bitmap[a >> 6] & bit))
+                watchpoint_count--;
+            bitmap[a >> 6] = insert ? bitmap[a >> 6] | bit : bitmap[a >> 6] & ~bit;
+        }
+    }
+
+    // Watchpoints need the instrumented interpreter, switch back once they're gone
+    if (watching() != was_watching)
+        chip8->select_interpreter(&config);
+
+    return true;
+}
+
+void GdbStub::run(Chip8 *chip8, const config_t &config, u32 insts) {
+    for (u32 i = 0; i < insts; i++) {
+        if (breakpoint_count && !resumed && test(breakpoints, chip8->PC)) {
+            stopped(GDB_TRAP);
+            return;
+        }
+        resumed = false;
+
+        chip8->emulate_inst(config);
+
+        if (watch_hit >= 0 || stepping) {
+            stopped(GDB_TRAP);
+            return;
+        }
+    }
+}
+
+// Back one instruction, or report the start of history
+void GdbStub::reverse_step(Chip8 *chip8, const config_t &config) {
+    const u64 target = chip8->insts - 1;
+
+    if (chip8->insts == 0 || target < reverse.begin() || !reverse.seek(chip8, config, target)) {
+        stop = GDB_TRAP;
+        send_packet("T05replaylog:begin;");
+        return;
+    }
+    reverse.finish(chip8, config);
+    stopped(GDB_TRAP);
+}
+
+// Back to the last breakpoint or watchpoint hit before the current instruction
+// Replays one checkpoint interval at a time, newest first
+void GdbStub::reverse_continue(Chip8 *chip8, const config_t &config) {
+    u64 end = chip8->insts;
+    u64 from;
+
+    while (reverse.checkpoint_before(end, &from)) {
+        bool found = false;
+        u64 hit = 0;
+        i32 hit_watch = -1;
+        char hit_kind = 0;
+
+        reverse.rewind(chip8, config, from);
+        while (chip8->insts < end) {
+            if (breakpoint_count && test(breakpoints, chip8->PC)) {
+                hit = chip8->insts;
+                found = true;
+                hit_watch = -1;
+            }
+            watch_hit = -1;
+            reverse.step(chip8);
+            if (watch_hit >= 0 && chip8->insts < end) {
+                hit = chip8->insts;
+                found = true;
+                hit_watch = watch_hit;
+                hit_kind = watch_kind;
+            }
+        }
+
+        if (found) {
+            reverse.seek(chip8, config, hit);
+            reverse.finish(chip8, config);
+            watch_hit = hit_watch;
+            watch_kind = hit_kind;
+            stopped(GDB_TRAP);
+            return;
+        }
+        end = from;
+    }
+
+    // Nothing hit, stop at the oldest state we have
+    reverse.seek(chip8, config, reverse.begin());
+    reverse.finish(chip8, config);
+    watch_hit = -1;
+    stop = GDB_TRAP;
+    send_packet("T05replaylog:begin;");
+}
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "../include/Heatmap.h"
+
+Heatmap heatmap;
+
+bool Heatmap::start() {
+    stop();
+
+    reads = new (std::nothrow) u32[HEATMAP_SIZE]();
+    writes = new (std::nothrow) u32[HEATMAP_SIZE]();
+    execs = new (std::nothrow) u32[HEATMAP_SIZE]();
+    if (!reads || !writes || !execs) {
+        SDL_Log("Could not allocate heatmap counters\n");
+        stop();
+        return false;
+    }
+
+    return true;    // Success
+}
+
+void Heatmap::stop() {
+    delete[] reads;
+    delete[] writes;
+    delete[] execs;
+    reads = writes = execs = NULL;
+}
+
+// 64 bytes per image row for CHIP8 memory, 256 for XO-CHIP
+// Brightness is log scaled so rarely touched bytes still show up
+bool Heatmap::write_pgm(const char *path, const u32 *counts, u32 size) {
+    const u32 width = size > RAM_SIZE ? 256 : 64;
+    const u32 height = size / width;
+    u32 max = 0;
+
+    for (u32 i = 0; i < size; i++)
+        max = std::max(max, counts[i]);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        SDL_Log("Could not open heatmap file %s\n", path);
+        return false;
+    }
+
+    std::vector<u8> pixels(size);
+    const f64 scale = max ? 255.0 / log2(max + 1.0) : 0;
+    for (u32 i = 0; i < size; i++)
+        pixels[i] = (u8) (log2(counts[i] + 1.0) * scale + 0.5);
+
+    fprintf(file, "P5\n%u %u\n255\n", width, height);
+    fwrite(pixels.data(), 1, size, file);
+    fclose(file);
+
+    return true;    // Success
+}
+
+bool Heatmap::dump(const char *prefix, u32 ram_size) {
+    const std::string base = prefix;
+
+    return write_pgm((base + "_read.pgm").c_str(), reads, ram_size) &&
+           write_pgm((base + "_write.pgm").c_str(), writes, ram_size) &&
+           write_pgm((base + "_exec.pgm").c_str(), execs, ram_size);
+}
+
+void Heatmap::report(FILE *out, u32 ram_size) {
+    u32 smc_bytes = 0;
+
+    for (u32 addr = 0; addr < ram_size; addr++) {
+        if (!writes[addr] || !execs[addr])
+            continue;
+
+        // Merge consecutive self-modified bytes into one range
+        u32 end = addr, written = 0, executed = 0;
+        while (end < ram_size && writes[end] && execs[end]) {
+            written += writes[end];
+            executed += execs[end];
+            end++;
+        }
+
+        if (smc_bytes == 0)
+            fprintf(out, "==== Self-modifying code (written and executed) ====\n");
+        fprintf(out, "0x%04X-0x%04X: %u byte writes, %u byte fetches\n", addr, end - 1, written, executed);
+        smc_bytes += end - addr;
+        addr = end;
+    }
+
+    if (smc_bytes)
+        fprintf(out, "%u self-modified bytes\n", smc_bytes);
+    else
+        fprintf(out, "No self-modifying code\n");
+}
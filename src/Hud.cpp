@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstring>
+#include "../include/Hud.h"
+#include "../include/Chip8.h"
+
+Hud hud;
+
+#define HUD_GRAPH_HEIGHT 60         // Window pixels for HUD_GRAPH_MAX_US
+#define HUD_GRAPH_MAX_US 33333      // Two 60hz frames
+#define HUD_LINE_HEIGHT ((HUD_GLYPH_HEIGHT + 2) * HUD_SCALE)
+
+// 3x5 font, one octal digit per row, top row first
+static const char glyph_chars[] = " %-./0123456789:ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+static const u16 glyphs[] = {
+    000000, 051245, 000700, 000002, 011244,                     // ' ' % - . /
+    075557, 026227, 071747, 071717, 055711,                     // 0-4
+    074717, 074757, 071122, 075757, 075717,                     // 5-9
+    002020,                                                     // :
+    025755, 065656, 034443, 065556, 074647, 074644, 034553,     // A-G
+    055755, 072227, 011152, 055655, 044447, 057755, 065555,     // H-N
+    025552, 065644, 025563, 065655, 034216, 072222, 055557,     // O-U
+    055552, 055775, 055255, 055222, 071247,                     // V-Z
+};
+
+static_assert(sizeof glyph_chars - 1 == sizeof glyphs / sizeof glyphs[0], "one glyph per character");
+
+// Build the glyph atlas, white glyphs on transparent cells of (width + 1) pixels
+bool Hud::init(SDL_Renderer *renderer) {
+    const u32 count = sizeof glyphs / sizeof glyphs[0];
+    const u32 cell = HUD_GLYPH_WIDTH + 1;
+    u32 pixels[count * cell * HUD_GLYPH_HEIGHT] = {0};
+
+    for (u32 g = 0; g < count; g++)
+        for (u32 y = 0; y < HUD_GLYPH_HEIGHT; y++)
+            for (u32 x = 0; x < HUD_GLYPH_WIDTH; x++)
+                if (glyphs[g] >> (3 * (HUD_GLYPH_HEIGHT - 1 - y) + (HUD_GLYPH_WIDTH - 1 - x)) & 1)
+                    pixels[y * count * cell + g * cell + x] = 0xFFFFFFFF;
+
+    atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC,
+                              count * cell, HUD_GLYPH_HEIGHT);
+    if (!atlas) {
+        SDL_Log("Could not create HUD glyph atlas %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_UpdateTexture(atlas, NULL, pixels, count * cell * sizeof(u32));
+    SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+
+    memset(glyph_index, -1, sizeof glyph_index);
+    for (u32 g = 0; g < count; g++)
+        glyph_index[(u8) glyph_chars[g]] = g;
+
+    memset(frame_us, 0, sizeof frame_us);
+    frame_head = 0;
+    last_frame = second_tick = SDL_GetPerformanceCounter();
+    second_insts = ips = 0;
+    last_callback = 0;
+    callback_samples = 0;
+    dirty_rows = 0;
+
+    return true;    // Success
+}
+
+void Hud::destroy() {
+    if (atlas)
+        SDL_DestroyTexture(atlas);
+    atlas = NULL;
+}
+
+void Hud::frame(u32 insts) {
+    const u64 now = SDL_GetPerformanceCounter();
+    const u64 freq = SDL_GetPerformanceFrequency();
+
+    frame_us[frame_head] = (now - last_frame) * 1000000 / freq;
+    frame_head = (frame_head + 1) % HUD_FRAMES;
+    last_frame = now;
+
+    second_insts += insts;
+    if (now - second_tick >= freq) {
+        ips = second_insts * freq / (now - second_tick);
+        second_insts = 0;
+        second_tick = now;
+    }
+}
+
+// Called on the audio thread
+void Hud::audio_callback(u32 samples) {
+    last_callback.store(SDL_GetPerformanceCounter(), std::memory_order_relaxed);
+    callback_samples.store(samples, std::memory_order_relaxed);
+}
+
+void Hud::draw_text(SDL_Renderer *renderer, i32 x, i32 y, const char *text) {
+    SDL_Rect src = {.x = 0, .y = 0, .w = HUD_GLYPH_WIDTH, .h = HUD_GLYPH_HEIGHT};
+    SDL_Rect dst = {.x = x, .y = y, .w = HUD_GLYPH_WIDTH * HUD_SCALE, .h = HUD_GLYPH_HEIGHT * HUD_SCALE};
+
+    for (; *text; text++, dst.x += (HUD_GLYPH_WIDTH + 1) * HUD_SCALE) {
+        const i8 g = (u8) *text < 128 ? glyph_index[(u8) *text] : -1;
+        if (g <= 0)     // Space or missing glyph
+            continue;
+        src.x = g * (HUD_GLYPH_WIDTH + 1);
+        SDL_RenderCopy(renderer, atlas, &src, &dst);
+    }
+}
+
+void Hud::render(SDL_Renderer *renderer, const Chip8 *chip8, const config_t &config) {
+    if (!atlas)
+        return;
+
+    const i32 x = HUD_SCALE * 2;
+    const i32 width = HUD_FRAMES * 2;
+    char line[32];
+
+    // Dim the game behind the panel
+    const SDL_Rect panel = {.x = 0, .y = 0, .w = width + 2 * x, .h = 4 * HUD_LINE_HEIGHT + HUD_GRAPH_HEIGHT + 3 * x};
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xC0);
+    SDL_RenderFillRect(renderer, &panel);
+
+    const u32 last = frame_us[(frame_head + HUD_FRAMES - 1) % HUD_FRAMES];
+    snprintf(line, sizeof line, "FRAME %u.%uMS", last / 1000, last / 100 % 10);
+    draw_text(renderer, x, x, line);
+
+    snprintf(line, sizeof line, "IPS %llu/%u", (long long unsigned) ips, config.insts_per_second);
+    draw_text(renderer, x, x + HUD_LINE_HEIGHT, line);
+
+    // Share of the audio buffer not yet played, estimated from the last callback
+    const u64 callback = last_callback.load(std::memory_order_relaxed);
+    const u32 samples = callback_samples.load(std::memory_order_relaxed);
+    if (chip8->sound_timer > 0 && callback && samples) {
+        const u64 period = SDL_GetPerformanceFrequency() * samples / config.audio_sample_rate;
+        const u64 elapsed = SDL_GetPerformanceCounter() - callback;
+        snprintf(line, sizeof line, "AUDIO %u%%", elapsed < period ? (u32) (100 - 100 * elapsed / period) : 0);
+    } else {
+        snprintf(line, sizeof line, "AUDIO OFF");
+    }
+    draw_text(renderer, x, x + 2 * HUD_LINE_HEIGHT, line);
+
+    snprintf(line, sizeof line, "ROWS %u/%u", dirty_rows, chip8->display_height());
+    draw_text(renderer, x, x + 3 * HUD_LINE_HEIGHT, line);
+
+    // Frame time graph, oldest frame on the left, 60hz frame time at half height
+    const i32 bottom = panel.h - x;
+    for (u32 i = 0; i < HUD_FRAMES; i++) {
+        const u32 us = std::min<u32>(frame_us[(frame_head + i) % HUD_FRAMES], HUD_GRAPH_MAX_US);
+        graph[i] = {.x = x + 2 * (i32) i, .y = bottom - (i32) (us * HUD_GRAPH_HEIGHT / HUD_GRAPH_MAX_US)};
+    }
+    SDL_SetRenderDrawColor(renderer, 0x40, 0x40, 0x40, 0xFF);
+    SDL_RenderDrawLine(renderer, x, bottom - HUD_GRAPH_HEIGHT / 2, x + width, bottom - HUD_GRAPH_HEIGHT / 2);
+    SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF);
+    SDL_RenderDrawLines(renderer, graph, HUD_FRAMES);
+}
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstring>
+#include <SDL2/SDL.h>
+#include "../include/Latency.h"
+
+LatencyStats latency;
+
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each, above that every power
+// of 2 is split into HISTOGRAM_SUB_BUCKETS linear buckets
+u32 Histogram::bucket(u64 value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    const u32 msb = 63 - __builtin_clzll(value);
+    const u32 shift = msb - 5;      // log2(HISTOGRAM_SUB_BUCKETS)
+    const u32 index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Upper bound of the values in a bucket
+u64 Histogram::bucket_value(u32 bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    const u32 shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    const u64 base = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ((base + 1) << shift) - 1;
+}
+
+void Histogram::add(u64 ns) {
+    buckets[bucket(ns)]++;
+    count++;
+    if (ns > max)
+        max = ns;
+}
+
+u64 Histogram::percentile(f64 p) const {
+    const u64 target = (u64) (p / 100.0 * count + 0.5);
+    u64 seen = 0;
+
+    for (u32 i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= target && seen > 0)
+            return std::min(bucket_value(i), max);
+    }
+
+    return max;
+}
+
+void LatencyStats::start() {
+    memset(this, 0, sizeof(LatencyStats));
+    ticks_per_us = SDL_GetPerformanceFrequency() / 1000000;
+    if (ticks_per_us == 0)
+        ticks_per_us = 1;
+}
+
+void LatencyStats::stop() {
+    ticks_per_us = 0;
+}
+
+// SDL key down event received for a CHIP8 key
+void LatencyStats::key_pressed(u8 key) {
+    key_down[key] = SDL_GetPerformanceCounter();
+}
+
+// First instruction that read a pending key press
+void LatencyStats::observe(u8 key) {
+    input_to_observe.add(ns(key_down[key], SDL_GetPerformanceCounter()));
+    key_observed[key] = key_down[key];
+    key_down[key] = 0;
+}
+
+void LatencyStats::frame_started() {
+    frame_start_time = SDL_GetPerformanceCounter();
+}
+
+void LatencyStats::burst_ended() {
+    burst_end_time = SDL_GetPerformanceCounter();
+    burst.add(ns(frame_start_time, burst_end_time));
+}
+
+void LatencyStats::render_started() {
+    render_start_time = SDL_GetPerformanceCounter();
+    wait.add(ns(burst_end_time, render_start_time));
+}
+
+void LatencyStats::presented() {
+    const u64 now = SDL_GetPerformanceCounter();
+
+    render.add(ns(render_start_time, now));
+    if (last_present_time)
+        frame.add(ns(last_present_time, now));
+    last_present_time = now;
+
+    // Key presses the program has seen are on screen now
+    for (u8 key = 0; key < 16; key++) {
+        if (key_observed[key]) {
+            input_to_photon.add(ns(key_observed[key], now));
+            key_observed[key] = 0;
+        }
+    }
+}
+
+void LatencyStats::report(FILE *out) const {
+    const struct {
+        const char *name;
+        const Histogram &histogram;
+    } rows[] = {
+        {"input_to_observe", input_to_observe},
+        {"input_to_photon", input_to_photon},
+        {"burst", burst},
+        {"wait", wait},
+        {"render", render},
+        {"frame", frame},
+    };
+
+    fprintf(out, "%-18s %10s %10s %10s %10s %10s\n", "latency(us)", "samples", "p50", "p95", "p99", "max");
+    for (const auto &row : rows) {
+        fprintf(out, "%-18s %10llu %10.1f %10.1f %10.1f %10.1f\n", row.name,
+                (long long unsigned) row.histogram.samples(),
+                row.histogram.percentile(50) / 1e3, row.histogram.percentile(95) / 1e3,
+                row.histogram.percentile(99) / 1e3, row.histogram.maximum() / 1e3);
+    }
+}
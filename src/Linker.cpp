@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include "../include/Linker.h"
+
+static void put_u32(std::vector<u8> &out, u32 value) {
+    const u8 *bytes = (const u8 *) &value;
+    out.insert(out.end(), bytes, bytes + sizeof value);
+}
+
+static void put_string(std::vector<u8> &out, const std::string &s) {
+    put_u32(out, s.size());
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+bool save_object(const char *path, const asm_object_t &object) {
+    object_header_t header = {
+        .magic = OBJECT_MAGIC,
+        .version = OBJECT_VERSION,
+        .code_size = (u32) object.code.size(),
+        .sections = (u32) object.sections.size(),
+        .symbols = (u32) object.symbols.size(),
+        .relocs = (u32) object.relocs.size(),
+        .files = (u32) object.files.size(),
+        .lines = (u32) object.lines.size(),
+    };
+    std::vector<u8> out((const u8 *) &header, (const u8 *) (&header + 1));
+
+    out.insert(out.end(), object.code.begin(), object.code.end());
+    for (const asm_section_t &section : object.sections) {
+        put_u32(out, section.offset);
+        put_u32(out, section.size);
+    }
+    for (const asm_symbol_t &symbol : object.symbols) {
+        put_u32(out, symbol.section);
+        put_u32(out, symbol.value);
+        put_string(out, symbol.name);
+    }
+    for (const asm_reloc_t &reloc : object.relocs) {
+        put_u32(out, reloc.section);
+        put_u32(out, reloc.offset);
+        put_u32(out, reloc.here);
+        put_u32(out, reloc.field);
+        put_string(out, reloc.expr);
+    }
+    for (const std::string &name : object.files)
+        put_string(out, name);
+    out.insert(out.end(), (const u8 *) object.lines.data(), (const u8 *) (object.lines.data() + object.lines.size()));
+
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(out.data(), 1, out.size(), file) != out.size()) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        if (file)
+            fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    return true;    // Success
+}
+
+// Bounds checked reader over a loaded object file
+struct object_reader_t {
+    const u8 *p, *end;
+    bool ok;
+
+    u32 read_u32() {
+        u32 value = 0;
+        if (end - p < (long) sizeof value) {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, p, sizeof value);
+        p += sizeof value;
+        return value;
+    }
+
+    std::string read_string() {
+        const u32 size = read_u32();
+        if ((u32) (end - p) < size) {
+            ok = false;
+            return std::string();
+        }
+        p += size;
+        return std::string((const char *) p - size, size);
+    }
+};
+
+bool load_object(const char *path, asm_object_t *object) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    std::vector<u8> data;
+    u8 chunk[1 << 16];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof chunk, file)) > 0)
+        data.insert(data.end(), chunk, chunk + count);
+    fclose(file);
+
+    object_header_t header;
+    if (data.size() < sizeof header || (memcpy(&header, data.data(), sizeof header), strcmp(header.magic, OBJECT_MAGIC)) ||
+            header.version != OBJECT_VERSION || data.size() - sizeof header < header.code_size) {
+        fprintf(stderr, "%s is not an object file of this version\n", path);
+        return false;
+    }
+
+    const u8 *code = data.data() + sizeof header;
+    object_reader_t reader = {code + header.code_size, data.data() + data.size(), true};
+    object->code.assign(code, code + header.code_size);
+    object->sections.clear();
+    object->symbols.clear();
+    object->relocs.clear();
+
+    for (u32 i = 0; i < header.sections && reader.ok; i++) {
+        const u32 offset = reader.read_u32();
+        const u32 size = reader.read_u32();
+        object->sections.push_back({offset, size});
+        if (offset > header.code_size || size > header.code_size - offset)
+            reader.ok = false;
+    }
+    for (u32 i = 0; i < header.symbols && reader.ok; i++) {
+        const i32 section = reader.read_u32();
+        const i32 value = reader.read_u32();
+        object->symbols.push_back({reader.read_string(), section, value});
+        if (section < -1 || section >= (i32) header.sections)
+            reader.ok = false;
+    }
+    for (u32 i = 0; i < header.relocs && reader.ok; i++) {
+        const u32 section = reader.read_u32();
+        const u32 offset = reader.read_u32();
+        const u32 here = reader.read_u32();
+        const u32 field = reader.read_u32();
+        object->relocs.push_back({section, offset, here, (asm_field_t) field, reader.read_string()});
+        if (section >= header.sections || field > ASM_FIELD_WORD ||
+                offset + (field == ASM_FIELD_BYTE ? 1 : 2) > object->sections[section].size)
+            reader.ok = false;
+    }
+
+    object->files.clear();
+    for (u32 i = 0; i < header.files && reader.ok; i++)
+        object->files.push_back(reader.read_string());
+
+    object->lines.resize(reader.ok && (u32) (reader.end - reader.p) / sizeof(source_line_t) >= header.lines ? header.lines : 0);
+    reader.ok &= object->lines.size() == header.lines;
+    if (reader.ok) {
+        memcpy(object->lines.data(), reader.p, header.lines * sizeof(source_line_t));
+        for (const source_line_t &line : object->lines)
+            reader.ok &= line.file < header.files;
+    }
+
+    if (!reader.ok) {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        return false;
+    }
+
+    return true;    // Success
+}
+
+bool Linker::link(const std::vector<asm_object_t> &objects, const std::vector<std::string> &names, const char *entry,
+                  const Address starting_addr, u8 *buffer, u32 capacity, assembly_t *result) {
+    struct ref_t { u32 object, symbol; };
+    auto fail = [&](const std::string &message) {
+        result->errors.push_back(message);
+        return false;
+    };
+
+    result->size = 0;
+    result->insts = 0;
+    result->errors.clear();
+    result->symtab.clear();
+    result->map.clear();
+
+    // Sections are numbered across all objects, each object's start at first[object]
+    std::vector<u32> first(objects.size() + 1);
+    total_size = 0;
+    for (u32 i = 0; i < objects.size(); i++) {
+        first[i + 1] = first[i] + objects[i].sections.size();
+        total_size += objects[i].code.size();
+    }
+    sections = first.back();
+    kept_sections = 0;
+
+    // Shared names, then each object's own on top of them
+    std::unordered_map<std::string_view, ref_t> globals;
+    std::vector<std::unordered_map<std::string_view, ref_t>> locals(objects.size());
+    for (u32 i = 0; i < objects.size(); i++) {
+        for (u32 j = 0; j < objects[i].symbols.size(); j++) {
+            const std::string &name = objects[i].symbols[j].name;
+            locals[i].emplace(name, ref_t{i, j});
+            if (name[0] == '.')
+                continue;
+            // The same equ from a shared include is fine
+            const auto [it, inserted] = globals.emplace(name, ref_t{i, j});
+            const asm_symbol_t &other = objects[it->second.object].symbols[it->second.symbol];
+            if (!inserted && !(other.section < 0 && objects[i].symbols[j].section < 0 && other.value == objects[i].symbols[j].value))
+                fail(name + " is defined in " + names[it->second.object] + " and " + names[i]);
+        }
+    }
+    if (!result->errors.empty())
+        return false;
+
+    auto lookup = [&](u32 object, std::string_view name) -> const ref_t * {
+        auto it = locals[object].find(name);
+        if (it != locals[object].end())
+            return &it->second;
+        it = globals.find(name);
+        return it != globals.end() ? &it->second : NULL;
+    };
+    auto symbol = [&](const ref_t &ref) -> const asm_symbol_t & { return objects[ref.object].symbols[ref.symbol]; };
+
+    // The entry section is kept and placed first
+    u32 entry_section = 0;
+    if (entry) {
+        const auto it = globals.find(entry);
+        if (it == globals.end() || symbol(it->second).section < 0)
+            return fail(std::string("No label ") + entry + " to start from");
+        entry_section = first[it->second.object] + symbol(it->second).section;
+    } else if (!sections) {
+        return true;    // Nothing to link
+    }
+
+    // Relocations of every section, to follow what it refers to
+    std::vector<std::vector<const asm_reloc_t *>> relocs(sections);
+    std::vector<u32> object_of(sections);
+    for (u32 i = 0; i < objects.size(); i++) {
+        for (const asm_reloc_t &reloc : objects[i].relocs)
+            relocs[first[i] + reloc.section].push_back(&reloc);
+        for (u32 j = first[i]; j < first[i + 1]; j++)
+            object_of[j] = i;
+    }
+
+    std::vector<bool> kept(sections, !gc);
+    std::vector<u32> pending = {entry_section};
+    std::vector<std::string_view> used;
+    kept[entry_section] = true;
+    while (!pending.empty()) {
+        const u32 section = pending.back();
+        pending.pop_back();
+
+        used.clear();
+        for (const asm_reloc_t *reloc : relocs[section])
+            asm_symbols(reloc->expr, &used);
+        for (std::string_view name : used) {
+            const ref_t *ref = lookup(object_of[section], name);
+            if (!ref || symbol(*ref).section < 0)
+                continue;   // A number, an equ, or undefined and reported below
+            const u32 target = first[ref->object] + symbol(*ref).section;
+            if (!kept[target]) {
+                kept[target] = true;
+                pending.push_back(target);
+            }
+        }
+    }
+
+    // Lay the kept sections out in the order they were given
+    std::vector<u32> order = {entry_section};
+    for (u32 i = 0; i < sections; i++) {
+        if (kept[i] && i != entry_section)
+            order.push_back(i);
+    }
+
+    std::vector<u32> address(sections);
+    u32 size = 0;
+    for (u32 i : order) {
+        const asm_section_t &section = objects[object_of[i]].sections[i - first[object_of[i]]];
+        address[i] = starting_addr + size;
+        if (size + section.size <= capacity)
+            memcpy(buffer + size, objects[object_of[i]].code.data() + section.offset, section.size);
+        size += section.size;
+    }
+    kept_sections = order.size();
+    result->size = size;
+    if (size > capacity)
+        return fail("Program is " + std::to_string(size) + " bytes, only " + std::to_string(capacity) + " fit in memory");
+
+    auto value_of = [&](const ref_t &ref) {
+        const asm_symbol_t &s = symbol(ref);
+        return s.section < 0 ? s.value : (i32) address[first[ref.object] + s.section] + s.value;
+    };
+
+    for (const auto &[name, ref] : globals) {
+        const asm_symbol_t &s = symbol(ref);
+        if (s.section < 0 || kept[first[ref.object] + s.section])
+            result->symtab.emplace(name, value_of(ref));
+    }
+
+    // Source lines and labels move with their sections
+    std::vector<source_symbol_t> labels;
+    for (u32 i = 0; i < objects.size(); i++) {
+        const u32 files = result->map.files.size();
+        result->map.files.insert(result->map.files.end(), objects[i].files.begin(), objects[i].files.end());
+
+        for (const source_line_t &line : objects[i].lines) {
+            for (u32 j = first[i]; j < first[i + 1]; j++) {
+                const asm_section_t &section = objects[i].sections[j - first[i]];
+                if (kept[j] && line.addr >= section.offset && line.addr < section.offset + section.size) {
+                    const u32 size = std::min<u32>(line.size, section.offset + section.size - line.addr);
+                    result->map.lines.push_back({(u16) (address[j] + line.addr - section.offset), (u16) size,
+                                                 (u16) (files + line.file), 0, line.line});
+                }
+            }
+        }
+        for (const asm_symbol_t &s : objects[i].symbols) {
+            if (s.section >= 0 && kept[first[i] + s.section])
+                labels.push_back({(u16) value_of({i, (u32) (&s - objects[i].symbols.data())}), 0, s.name});
+        }
+    }
+    std::sort(result->map.lines.begin(), result->map.lines.end(),
+              [](const source_line_t &a, const source_line_t &b) { return a.addr < b.addr; });
+    result->map.set_symbols(std::move(labels), starting_addr + size);
+
+    // Patch the relocations, an object sees its own symbols over the shared ones
+    for (u32 i = 0; i < objects.size(); i++) {
+        std::unordered_map<std::string_view, i32> symtab;
+        for (const auto &[name, ref] : globals)
+            symtab.emplace(name, value_of(ref));
+        for (const auto &[name, ref] : locals[i])
+            symtab[name] = value_of(ref);
+
+        for (const asm_reloc_t &reloc : objects[i].relocs) {
+            const u32 section = first[i] + reloc.section;
+            const u32 offset = address[section] - starting_addr + reloc.offset;
+            std::string error;
+            i32 value;
+            u16 bits;
+
+            if (!kept[section])
+                continue;
+            if (!asm_evaluate(reloc.expr, symtab, address[section] + reloc.here, &value, &error)) {
+                fail(names[i] + ": " + error);
+                continue;
+            }
+            if (!asm_encode(reloc.field, value, &bits)) {
+                char message[64];
+                snprintf(message, sizeof message, " doesn't fit in %s (%s%X)", asm_field_name(reloc.field),
+                         value < 0 ? "-" : "", value < 0 ? 0u - (u32) value : (u32) value);
+                fail(names[i] + ": " + reloc.expr + message);
+                continue;
+            }
+
+            if (reloc.field == ASM_FIELD_BYTE) {
+                buffer[offset] = bits;
+            } else {
+                buffer[offset] |= bits >> 8;
+                buffer[offset + 1] |= bits & 0xFF;
+            }
+        }
+    }
+
+    return result->errors.empty();
+}
@@ -0,0 +1,216 @@
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include "../include/Metrics.h"
+
+Metrics metrics;
+
+#define METRICS_WORDS (sizeof(metrics_data_t) / sizeof(u64))
+
+static_assert(std::atomic<u64>::is_always_lock_free, "seqlock needs a lock free u64 across processes");
+
+// Create the shared memory segment (if name isn't empty) and start counting
+bool Metrics::open(const char *name, const char *prometheus_path) {
+    memset(&data, 0, sizeof data);
+    start_tick = second_tick = SDL_GetPerformanceCounter();
+    second_insts = 0;
+    fx0a_start = 0;
+    audio_playing = false;
+    audio_resumed = false;
+    audio_underruns = 0;
+    last_callback = 0;
+    prometheus_file = prometheus_path[0] != '\0' ? prometheus_path : NULL;
+
+    if (name[0] == '\0')
+        return true;
+
+    snprintf(shm_name, sizeof shm_name, "%s", name);
+    const int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        SDL_Log("Could not create shared memory %s\n", shm_name);
+        return false;
+    }
+    if (ftruncate(fd, sizeof(metrics_shm_t)) != 0) {
+        SDL_Log("Could not size shared memory %s\n", shm_name);
+        ::close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, sizeof(metrics_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        SDL_Log("Could not map shared memory %s\n", shm_name);
+        return false;
+    }
+
+    shm = (metrics_shm_t *) mem;
+    memset((void *) shm, 0, sizeof(metrics_shm_t));
+    memcpy(shm->magic, METRICS_MAGIC, sizeof shm->magic);
+    shm->version = METRICS_VERSION;
+    shm->pid = getpid();
+
+    return true;    // Success
+}
+
+void Metrics::close() {
+    if (prometheus_file)
+        write_prometheus();
+    prometheus_file = NULL;
+
+    if (!shm)
+        return;
+    munmap(shm, sizeof(metrics_shm_t));
+    shm_unlink(shm_name);
+    shm = NULL;
+}
+
+// End of an instruction burst
+void Metrics::burst(u32 insts, u64 ticks, bool overran) {
+    const u64 us = ticks * 1000000 / SDL_GetPerformanceFrequency();
+    u32 bucket = 0;
+
+    while (bucket < METRICS_BURST_BUCKETS - 1 && us >= (1ULL << bucket))
+        bucket++;
+    data.burst_us[bucket]++;
+    data.insts += insts;
+    if (overran)
+        data.frames_skipped++;
+}
+
+// FX0A executed without a key yet, called on every spin of the wait
+void Metrics::fx0a_waiting() {
+    if (!fx0a_start)
+        fx0a_start = SDL_GetPerformanceCounter();
+}
+
+// FX0A got its key
+void Metrics::fx0a_done() {
+    if (!fx0a_start)
+        return;
+    data.fx0a_waits++;
+    data.fx0a_wait_us += (SDL_GetPerformanceCounter() - fx0a_start) * 1000000 / SDL_GetPerformanceFrequency();
+    fx0a_start = 0;
+}
+
+// Sound timer started or stopped the tone, callbacks don't come while paused
+void Metrics::audio_state(bool playing) {
+    if (playing && !audio_playing)
+        audio_resumed.store(true, std::memory_order_relaxed);
+    audio_playing = playing;
+}
+
+// Called on the audio thread, a callback more than 2 buffers after the last one
+// means the device ran dry in between
+void Metrics::audio_callback(u32 samples, u32 sample_rate) {
+    const u64 now = SDL_GetPerformanceCounter();
+
+    if (audio_resumed.exchange(false, std::memory_order_relaxed) || !last_callback) {
+        last_callback = now;
+        return;
+    }
+
+    const u64 period = SDL_GetPerformanceFrequency() * samples / sample_rate;
+    if (now - last_callback > 2 * period)
+        audio_underruns.fetch_add(1, std::memory_order_relaxed);
+    last_callback = now;
+}
+
+void Metrics::publish() {
+    const u64 now = SDL_GetPerformanceCounter();
+    const u64 freq = SDL_GetPerformanceFrequency();
+    bool new_second = false;
+
+    data.uptime_ms = (now - start_tick) * 1000 / freq;
+    data.audio_underruns = audio_underruns.load(std::memory_order_relaxed);
+    if (now - second_tick >= freq) {
+        data.ips = (data.insts - second_insts) * freq / (now - second_tick);
+        second_insts = data.insts;
+        second_tick = now;
+        new_second = true;
+    }
+
+    if (shm) {
+        const u64 seq = shm->seq.load(std::memory_order_relaxed);
+        const u64 *src = (const u64 *) &data;
+        u64 *dst = (u64 *) &shm->data;
+
+        shm->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (u32 i = 0; i < METRICS_WORDS; i++)
+            __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+        shm->seq.store(seq + 2, std::memory_order_release);
+    }
+
+    if (new_second && prometheus_file)
+        write_prometheus();
+}
+
+bool Metrics::read(const metrics_shm_t *shm, metrics_data_t *out) {
+    if (memcmp(shm->magic, METRICS_MAGIC, sizeof shm->magic) != 0 || shm->version != METRICS_VERSION)
+        return false;
+
+    const u64 *src = (const u64 *) &shm->data;
+    u64 *dst = (u64 *) out;
+
+    for (u32 tries = 0; tries < 1000; tries++) {
+        const u64 before = shm->seq.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+
+        for (u32 i = 0; i < METRICS_WORDS; i++)
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (shm->seq.load(std::memory_order_relaxed) == before)
+            return true;
+    }
+
+    return false;
+}
+
+// Prometheus text format, written to a temporary file and renamed so scrapers never
+// see a partial file
+bool Metrics::write_prometheus() {
+    const std::string tmp = std::string(prometheus_file) + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "w");
+    if (!file) {
+        SDL_Log("Could not open metrics file %s\n", tmp.c_str());
+        return false;
+    }
+
+    const struct {
+        const char *name;
+        const char *type;
+        u64 value;
+    } values[] = {
+        {"chip8_uptime_milliseconds", "gauge", data.uptime_ms},
+        {"chip8_instructions_total", "counter", data.insts},
+        {"chip8_instructions_per_second", "gauge", data.ips},
+        {"chip8_frames_presented_total", "counter", data.frames_presented},
+        {"chip8_frames_skipped_total", "counter", data.frames_skipped},
+        {"chip8_audio_underruns_total", "counter", data.audio_underruns},
+        {"chip8_fx0a_waits_total", "counter", data.fx0a_waits},
+        {"chip8_fx0a_wait_microseconds_total", "counter", data.fx0a_wait_us},
+    };
+
+    for (const auto &v : values)
+        fprintf(file, "# TYPE %s %s\n%s %llu\n", v.name, v.type, v.name, (long long unsigned) v.value);
+
+    // Cumulative buckets, the last bucket has no upper bound
+    u64 count = 0;
+    fprintf(file, "# TYPE chip8_burst_microseconds histogram\n");
+    for (u32 i = 0; i < METRICS_BURST_BUCKETS; i++) {
+        count += data.burst_us[i];
+        if (i < METRICS_BURST_BUCKETS - 1)
+            fprintf(file, "chip8_burst_microseconds_bucket{le=\"%llu\"} %llu\n",
+                    (long long unsigned) (1ULL << i), (long long unsigned) count);
+    }
+    fprintf(file, "chip8_burst_microseconds_bucket{le=\"+Inf\"} %llu\n", (long long unsigned) count);
+    fprintf(file, "chip8_burst_microseconds_count %llu\n", (long long unsigned) count);
+
+    fclose(file);
+    return rename(tmp.c_str(), prometheus_file) == 0;
+}
@@ -0,0 +1,772 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include "../include/Assembler.h"
+
+// Octo front end
+// A program is whitespace separated tokens, '#' starts a comment that runs to the end of
+// the line. Statements are compiled as the tokens come in and go through the same symbols,
+// operands, fixups, source map and listing as the Assembler syntax, so a label used before
+// it is defined costs a fixup and the source is read once. Macros are token lists replayed
+// with the arguments in place of their parameters.
+
+// Token and where it came from, for the errors, the source map and the listing
+struct octo_token_t {
+    std::string_view text;
+    u32 line;                   // Source line, in an expansion the line the macro is used on
+    std::string_view macro;     // Innermost macro it was expanded from, empty in the source
+    u32 macro_line;             // Line in that macro
+    const char *line_start;     // Its line in the source, NULL in an expansion
+};
+
+enum octo_kind_t {
+    OCTO_LABEL,         // : name
+    OCTO_CONST,         // :const name value
+    OCTO_ALIAS,         // :alias name register
+    OCTO_MACRO,         // :macro name params { body }
+    OCTO_ORG,           // :org address
+    OCTO_BYTE,          // :byte value
+    OCTO_HINT,          // :breakpoint name, :monitor a b, the opcode is the operand count
+    OCTO_UNSUPPORTED,   // :calc and the other compile time directives
+    OCTO_NONE,          // clear
+    OCTO_N,             // scroll-down n
+    OCTO_PLANE,         // plane n, n goes in the X nibble
+    OCTO_X,             // bcd vx
+    OCTO_RANGE,         // save vx, or save vx - vy
+    OCTO_SPRITE,        // sprite vx vy n
+    OCTO_ADDR,          // jump label
+    OCTO_TIMER,         // delay := vx
+    OCTO_I,             // i := label, i += vx, i := hex vx, ...
+    OCTO_IF,            // if condition then, or if condition begin ... else ... end
+    OCTO_ELSE,
+    OCTO_END,
+    OCTO_LOOP,          // loop ... again, with any number of while condition in between
+    OCTO_WHILE,
+    OCTO_AGAIN,
+};
+
+struct octo_statement_t {
+    octo_kind_t kind;
+    u16 opcode;
+};
+
+static const std::unordered_map<std::string_view, octo_statement_t> octo_statements = {
+    {":",            {OCTO_LABEL, 0}},
+    {":const",       {OCTO_CONST, 0}},
+    {":alias",       {OCTO_ALIAS, 0}},
+    {":macro",       {OCTO_MACRO, 0}},
+    {":org",         {OCTO_ORG, 0}},
+    {":byte",        {OCTO_BYTE, 0}},
+    {":breakpoint",  {OCTO_HINT, 1}},
+    {":monitor",     {OCTO_HINT, 2}},
+    {":calc",        {OCTO_UNSUPPORTED, 0}},
+    {":unpack",      {OCTO_UNSUPPORTED, 0}},
+    {":next",        {OCTO_UNSUPPORTED, 0}},
+    {":call",        {OCTO_UNSUPPORTED, 0}},
+    {":pointer",     {OCTO_UNSUPPORTED, 0}},
+    {":stringmode",  {OCTO_UNSUPPORTED, 0}},
+    {":assert",      {OCTO_UNSUPPORTED, 0}},
+    {"clear",        {OCTO_NONE, 0x00E0}},
+    {"return",       {OCTO_NONE, 0x00EE}},
+    {";",            {OCTO_NONE, 0x00EE}},
+    {"exit",         {OCTO_NONE, 0x00FD}},
+    {"lores",        {OCTO_NONE, 0x00FE}},
+    {"hires",        {OCTO_NONE, 0x00FF}},
+    {"scroll-right", {OCTO_NONE, 0x00FB}},
+    {"scroll-left",  {OCTO_NONE, 0x00FC}},
+    {"audio",        {OCTO_NONE, 0xF002}},
+    {"scroll-down",  {OCTO_N, 0x00C0}},
+    {"scroll-up",    {OCTO_N, 0x00D0}},
+    {"plane",        {OCTO_PLANE, 0xF001}},
+    {"bcd",          {OCTO_X, 0xF033}},
+    {"saveflags",    {OCTO_X, 0xF075}},
+    {"loadflags",    {OCTO_X, 0xF085}},
+    {"save",         {OCTO_RANGE, 0xF055}},
+    {"load",         {OCTO_RANGE, 0xF065}},
+    {"sprite",       {OCTO_SPRITE, 0xD000}},
+    {"jump",         {OCTO_ADDR, 0x1000}},
+    {"jump0",        {OCTO_ADDR, 0xB000}},
+    {"native",       {OCTO_ADDR, 0x0000}},
+    {"delay",        {OCTO_TIMER, 0xF015}},
+    {"buzzer",       {OCTO_TIMER, 0xF018}},
+    {"pitch",        {OCTO_TIMER, 0xF03A}},
+    {"i",            {OCTO_I, 0}},
+    {"if",           {OCTO_IF, 0}},
+    {"else",         {OCTO_ELSE, 0}},
+    {"end",          {OCTO_END, 0}},
+    {"loop",         {OCTO_LOOP, 0}},
+    {"while",        {OCTO_WHILE, 0}},
+    {"again",        {OCTO_AGAIN, 0}},
+};
+
+// vx op vy, and vx op value for the operators with a byte form
+struct octo_assignment_t {
+    u16 opcode;
+    u16 opcode_nn;
+};
+
+static const std::unordered_map<std::string_view, octo_assignment_t> octo_assignments = {
+    {":=",  {0x8000, 0x6000}},
+    {"+=",  {0x8004, 0x7000}},
+    {"-=",  {0x8005, 0x7000}},      // Adds the negated value
+    {"=-",  {0x8007, 0}},
+    {"|=",  {0x8001, 0}},
+    {"&=",  {0x8002, 0}},
+    {"^=",  {0x8003, 0}},
+    {">>=", {0x8006, 0}},
+    {"<<=", {0x800E, 0}},
+};
+
+// In pairs, the negation of a comparison is the other one of its pair
+enum octo_compare_t {
+    OCTO_EQ, OCTO_NE,
+    OCTO_LT, OCTO_GE,
+    OCTO_GT, OCTO_LE,
+    OCTO_KEY, OCTO_NOT_KEY,
+};
+
+static const std::unordered_map<std::string_view, octo_compare_t> octo_compares = {
+    {"==", OCTO_EQ}, {"!=", OCTO_NE}, {"<", OCTO_LT}, {">=", OCTO_GE},
+    {">", OCTO_GT}, {"<=", OCTO_LE}, {"key", OCTO_KEY}, {"-key", OCTO_NOT_KEY},
+};
+
+struct octo_condition_t {
+    u8 x;
+    octo_compare_t compare;
+    bool reg;                   // Compared to vy, or else to value
+    u8 y;
+    octo_token_t value;
+};
+
+// if ... begin, else or loop waiting for its end or again
+struct octo_block_t {
+    octo_kind_t kind;           // OCTO_IF, OCTO_ELSE or OCTO_LOOP
+    u32 offset;                 // jump to patch where the block ends, the address a loop starts at
+    octo_token_t at;            // For the error if it's never closed
+    std::vector<u32> exits;     // jump of every while in a loop
+};
+
+struct octo_macro_t {
+    std::vector<std::string_view> params;
+    std::vector<octo_token_t> body;
+    u32 line;
+};
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Decimal, 0x hex or 0b binary, with an optional '-'
+static bool octo_number(std::string_view text, i32 *value) {
+    const bool negative = !text.empty() && text[0] == '-';
+    u32 base = 10;
+    u64 result = 0;
+
+    text.remove_prefix(negative);
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X' || text[1] == 'b' || text[1] == 'B')) {
+        base = text[1] == 'x' || text[1] == 'X' ? 16 : 2;
+        text.remove_prefix(2);
+    }
+    if (text.empty())
+        return false;
+    for (char c : text) {
+        const i32 digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                          c >= 'A' && c <= 'F' ? c - 'A' + 10 : 16;
+        if ((u32) digit >= base || (result = result * base + digit) > 0xFFFFFFFF)
+            return false;
+    }
+    *value = negative ? (i32) (0u - (u32) result) : (i32) result;
+    return true;
+}
+
+struct Assembler::octo_t {
+    // Each frame replays an expansion, the source is read once they are done
+    struct frame_t {
+        const std::vector<octo_token_t> *tokens;
+        size_t next;
+    };
+
+    Assembler &as;
+    const char *p, *end;
+    u32 line;
+    const char *line_start;
+    octo_token_t lookahead;
+    bool peeked;
+    std::vector<frame_t> frames;
+    std::deque<std::vector<octo_token_t>> expansions;
+    std::unordered_map<std::string_view, octo_macro_t> macros;
+    std::unordered_map<std::string_view, u8> aliases;
+    std::vector<octo_block_t> blocks;
+    bool started;               // Something was placed, main is reached by a jump unless it was first
+    u32 listed_line;            // Last line in the listing
+    octo_token_t at;            // First token of the statement being compiled
+
+    octo_t(Assembler &as, const char *p, const char *end)
+        : as(as), p(p), end(end), line(1), line_start(p), lookahead(), peeked(false), started(false),
+          listed_line(0), at() {}
+
+    bool read(octo_token_t *token) {
+        while (!frames.empty()) {
+            frame_t &frame = frames.back();
+            if (frame.next < frame.tokens->size()) {
+                *token = (*frame.tokens)[frame.next++];
+                return true;
+            }
+            frames.pop_back();
+        }
+
+        for (;;) {
+            for (; p < end && is_space(*p); p++) {
+                if (*p == '\n') {
+                    line++;
+                    line_start = p + 1;
+                }
+            }
+            if (p == end || *p != '#')
+                break;
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            p = eol ? eol : end;
+        }
+        if (p == end)
+            return false;
+
+        const char *start = p;
+        while (p < end && !is_space(*p))
+            p++;
+        *token = {std::string_view(start, p - start), line, std::string_view(), 0, line_start};
+        return true;
+    }
+
+    bool next(octo_token_t *token) {
+        if (peeked) {
+            peeked = false;
+            *token = lookahead;
+            return true;
+        }
+        return read(token);
+    }
+
+    bool peek(octo_token_t *token) {
+        if (!peeked && !(peeked = read(&lookahead)))
+            return false;
+        *token = lookahead;
+        return true;
+    }
+
+    // Next token, which the statement can't do without
+    bool operand(octo_token_t *token) {
+        return next(token) || as.error("%.*s is missing an operand", (int) at.text.size(), at.text.data());
+    }
+
+    bool reg(std::string_view text, u8 *x) const {
+        if (text.size() == 2 && (text[0] == 'v' || text[0] == 'V') && isxdigit((u8) text[1])) {
+            *x = text[1] <= '9' ? text[1] - '0' : (text[1] | 0x20) - 'a' + 10;
+            return true;
+        }
+        const auto alias = aliases.find(text);
+        if (alias == aliases.end())
+            return false;
+        *x = alias->second;
+        return true;
+    }
+
+    bool reg_operand(u8 *x) {
+        octo_token_t token;
+        if (!operand(&token))
+            return false;
+        return reg(token.text, x) || as.error("Expected a register: %.*s", (int) token.text.size(), token.text.data());
+    }
+
+    bool word(const char *expected) {
+        octo_token_t token;
+        if (!operand(&token))
+            return false;
+        return token.text == expected ||
+               as.error("Expected %s after %.*s: %.*s", expected, (int) at.text.size(), at.text.data(),
+                        (int) token.text.size(), token.text.data());
+    }
+
+    // Anything that isn't a number, a register or a keyword can name a label or constant
+    bool is_name(std::string_view text) const {
+        i32 value;
+        u8 x;
+        return !text.empty() && (isalpha((u8) text[0]) || text[0] == '_') && !octo_number(text, &value) &&
+               !reg(text, &x) && !octo_statements.count(text);
+    }
+
+    // Value that is defined above
+    bool known(const octo_token_t &token, i32 *value) const {
+        if (octo_number(token.text, value))
+            return true;
+        const auto it = as.symtab.find(token.text);
+        if (it == as.symtab.end())
+            return false;
+        *value = it->second;
+        return true;
+    }
+
+    // Number, constant or label in its field, a name that isn't defined yet is
+    // a label further down and is patched in once the source is done
+    bool value(const octo_token_t &token, asm_field_t field, u32 offset, u16 *bits) {
+        i32 value;
+        *bits = 0;
+        if (known(token, &value))
+            return as.encode(field, value, token.text, bits);
+        if (!is_name(token.text))
+            return as.error("Expected a value: %.*s", (int) token.text.size(), token.text.data());
+        as.fixups.push_back({offset, as.file, as.line_no, as.here, field, token.text, true});
+        return true;
+    }
+
+    bool inst(u16 opcode, const octo_token_t *operand = NULL, asm_field_t field = ASM_FIELD_NNN) {
+        u16 bits = 0;
+        if (operand && !value(*operand, field, as.result->size, &bits))
+            return false;
+        as.emit(opcode | bits);
+        as.result->insts++;
+        return true;
+    }
+
+    // Point the jump at offset here
+    bool patch(u32 offset) {
+        u16 bits;
+        if (!as.encode(ASM_FIELD_NNN, as.starting_addr + as.result->size, at.text, &bits))
+            return false;
+        if (offset + 2 <= as.capacity) {
+            as.buffer[offset] |= bits >> 8;
+            as.buffer[offset + 1] |= bits & 0xFF;
+        }
+        return true;
+    }
+
+    // Octo starts at main, a jump to it goes first unless it's the first label
+    void enter(std::string_view label) {
+        if (started)
+            return;
+        started = true;
+        if (label != "main") {
+            const octo_token_t main = {"main", at.line, at.macro, at.macro_line, NULL};
+            inst(0x1000, &main);
+        }
+    }
+
+    bool condition(octo_condition_t *condition) {
+        octo_token_t op;
+        if (!reg_operand(&condition->x) || !operand(&op))
+            return false;
+
+        const auto compare = octo_compares.find(op.text);
+        if (compare == octo_compares.end())
+            return as.error("Invalid comparison: %.*s", (int) op.text.size(), op.text.data());
+        condition->compare = compare->second;
+        if (condition->compare == OCTO_KEY || condition->compare == OCTO_NOT_KEY)
+            return true;
+
+        if (!operand(&condition->value))
+            return false;
+        condition->reg = reg(condition->value.text, &condition->y);
+        return true;
+    }
+
+    // Instructions after which the next one only runs if the condition holds, or if it doesn't when negated
+    bool skip_unless(const octo_condition_t &condition, bool negate) {
+        const octo_compare_t compare = (octo_compare_t) (condition.compare ^ negate);
+        const u16 x = condition.x << 8, y = condition.y << 4;
+
+        switch (compare) {
+        case OCTO_EQ:
+            return condition.reg ? inst(0x9000 | x | y) : inst(0x4000 | x, &condition.value, ASM_FIELD_NN);
+        case OCTO_NE:
+            return condition.reg ? inst(0x5000 | x | y) : inst(0x3000 | x, &condition.value, ASM_FIELD_NN);
+        case OCTO_KEY:
+            return inst(0xE0A1 | x);
+        case OCTO_NOT_KEY:
+            return inst(0xE09E | x);
+        default:
+            // vf := value, then vf = value - vx for > and <=, vx - value for < and >=,
+            // which leaves the no borrow flag in vf
+            if (!(condition.reg ? inst(0x8F00 | y) : inst(0x6F00, &condition.value, ASM_FIELD_NN)))
+                return false;
+            inst((compare == OCTO_GT || compare == OCTO_LE ? 0x8F05 : 0x8F07) | condition.x << 4);
+            return inst(compare == OCTO_GT || compare == OCTO_LT ? 0x3F01 : 0x3F00);
+        }
+    }
+
+    // vx := vy, vx += 5, vx := random 0xFF, ...
+    bool assign(u8 x) {
+        octo_token_t op, source;
+        u8 y;
+        if (!operand(&op))
+            return false;
+        const auto assignment = octo_assignments.find(op.text);
+        if (assignment == octo_assignments.end())
+            return as.error("Invalid operator: %.*s", (int) op.text.size(), op.text.data());
+        if (!operand(&source))
+            return false;
+
+        if (reg(source.text, &y))
+            return inst(assignment->second.opcode | x << 8 | y << 4);
+        if (op.text == ":=" && source.text == "random") {
+            octo_token_t mask;
+            return operand(&mask) && inst(0xC000 | x << 8, &mask, ASM_FIELD_NN);
+        }
+        if (op.text == ":=" && source.text == "key")
+            return inst(0xF00A | x << 8);
+        if (op.text == ":=" && source.text == "delay")
+            return inst(0xF007 | x << 8);
+        if (!assignment->second.opcode_nn)
+            return as.error("%.*s takes a register: %.*s", (int) op.text.size(), op.text.data(),
+                            (int) source.text.size(), source.text.data());
+
+        if (op.text == "-=") {
+            i32 value;
+            u16 bits;
+            if (!known(source, &value))
+                return as.error("%.*s has to be defined above to be subtracted", (int) source.text.size(), source.text.data());
+            return as.encode(ASM_FIELD_NN, value, source.text, &bits) && inst(0x7000 | x << 8 | ((0x100 - bits) & 0xFF));
+        }
+        return inst(assignment->second.opcode_nn | x << 8, &source, ASM_FIELD_NN);
+    }
+
+    // i := label, i := hex vx, i := bighex vx, i := long label, i += vx
+    bool index() {
+        octo_token_t op, source;
+        u8 x = 0;
+        if (!operand(&op) || !operand(&source))
+            return false;
+
+        if (op.text == "+=")
+            return reg(source.text, &x) ? inst(0xF01E | x << 8) :
+                   as.error("Expected a register: %.*s", (int) source.text.size(), source.text.data());
+        if (op.text != ":=")
+            return as.error("Invalid operator: %.*s", (int) op.text.size(), op.text.data());
+
+        if (source.text == "hex" || source.text == "bighex")
+            return reg_operand(&x) && inst((source.text == "hex" ? 0xF029 : 0xF030) | x << 8);
+        if (source.text == "long") {
+            octo_token_t addr;
+            u16 bits;
+            if (!operand(&addr) || !inst(0xF000) || !value(addr, ASM_FIELD_WORD, as.result->size, &bits))
+                return false;
+            as.emit(bits);
+            return true;
+        }
+        return inst(0xA000, &source);
+    }
+
+    bool define_macro() {
+        octo_token_t name, token;
+        octo_macro_t macro = {};
+        if (!operand(&name))
+            return false;
+        if (!is_name(name.text) || macros.count(name.text))
+            return as.error("Invalid or duplicate macro name: %.*s", (int) name.text.size(), name.text.data());
+
+        macro.line = name.line;
+        while (next(&token) && token.text != "{")
+            macro.params.push_back(token.text);
+        for (u32 depth = 1; next(&token); ) {
+            depth += token.text == "{";
+            depth -= token.text == "}";
+            if (!depth) {
+                macros.emplace(name.text, std::move(macro));
+                return true;
+            }
+            macro.body.push_back(token);
+        }
+        return as.error("Missing } after macro %.*s", (int) name.text.size(), name.text.data());
+    }
+
+    bool expand(const octo_macro_t &macro, const octo_token_t &name) {
+        std::vector<octo_token_t> args(macro.params.size());
+        for (octo_token_t &arg : args) {
+            if (!operand(&arg))
+                return false;
+        }
+        if (frames.size() >= ASM_MAX_DEPTH)
+            return as.error("Macros nested more than %u deep in %.*s", ASM_MAX_DEPTH, (int) name.text.size(), name.text.data());
+
+        std::vector<octo_token_t> &tokens = expansions.emplace_back();
+        tokens.reserve(macro.body.size());
+        for (const octo_token_t &token : macro.body) {
+            const auto param = std::find(macro.params.begin(), macro.params.end(), token.text);
+            tokens.push_back({param != macro.params.end() ? args[param - macro.params.begin()].text : token.text,
+                              name.line, name.text, token.line - macro.line + 1, NULL});
+        }
+        frames.push_back({&tokens, 0});
+        return true;
+    }
+
+    octo_block_t *innermost(octo_kind_t kind) {
+        for (auto block = blocks.rbegin(); block != blocks.rend(); block++) {
+            if (block->kind == kind)
+                return &*block;
+        }
+        return NULL;
+    }
+
+    bool statement(const octo_token_t &token) {
+        octo_token_t operand_token;
+        i32 number;
+        u8 x = 0, y = 0;
+
+        if (reg(token.text, &x)) {
+            enter("");
+            return assign(x);
+        }
+
+        const auto found = octo_statements.find(token.text);
+        if (found == octo_statements.end()) {
+            const auto macro = macros.find(token.text);
+            if (macro != macros.end())
+                return expand(macro->second, token);
+
+            // A number or constant is a byte of data, a label is called
+            enter("");
+            if (known(token, &number) && (octo_number(token.text, &number) || as.equs.count(token.text))) {
+                u16 bits;
+                if (!as.encode(ASM_FIELD_BYTE, number, token.text, &bits))
+                    return false;
+                as.emit_byte(bits);
+                return true;
+            }
+            if (!is_name(token.text))
+                return as.error("Unexpected %.*s", (int) token.text.size(), token.text.data());
+            return inst(0x2000, &token);
+        }
+
+        const octo_statement_t &entry = found->second;
+        if (entry.kind != OCTO_CONST && entry.kind != OCTO_ALIAS && entry.kind != OCTO_MACRO &&
+                entry.kind != OCTO_HINT && entry.kind != OCTO_UNSUPPORTED && entry.kind != OCTO_LABEL)
+            enter("");
+
+        switch (entry.kind) {
+        case OCTO_LABEL:
+            if (!operand(&operand_token))
+                return false;
+            if (!is_name(operand_token.text))
+                return as.error("Invalid label: %.*s", (int) operand_token.text.size(), operand_token.text.data());
+            enter(operand_token.text);
+            return as.define_label(operand_token.text);
+
+        case OCTO_CONST: {
+            octo_token_t name;
+            if (!operand(&name) || !operand(&operand_token))
+                return false;
+            if (!is_name(name.text))
+                return as.error("Invalid constant name: %.*s", (int) name.text.size(), name.text.data());
+            if (!known(operand_token, &number))
+                return as.error("%.*s has to be defined above", (int) operand_token.text.size(), operand_token.text.data());
+            as.equs.insert(name.text);
+            return as.define(name.text, number);
+        }
+
+        case OCTO_ALIAS: {
+            octo_token_t name;
+            if (!operand(&name) || !reg_operand(&x))
+                return false;
+            if (!is_name(name.text))
+                return as.error("Invalid alias name: %.*s", (int) name.text.size(), name.text.data());
+            aliases[name.text] = x;     // Octo programs often move an alias to another register
+            return true;
+        }
+
+        case OCTO_MACRO:
+            return define_macro();
+
+        case OCTO_ORG:
+            if (!operand(&operand_token))
+                return false;
+            if (!known(operand_token, &number))
+                return as.error("%.*s has to be defined above", (int) operand_token.text.size(), operand_token.text.data());
+            if (number < (i32) as.here || number > (i32) (as.starting_addr + as.capacity))
+                return as.error(":org %X is outside %X-%X", number, as.here, as.starting_addr + as.capacity);
+            as.fill(number - as.here);
+            return true;
+
+        case OCTO_BYTE: {
+            u16 bits;
+            if (!operand(&operand_token) || !value(operand_token, ASM_FIELD_BYTE, as.result->size, &bits))
+                return false;
+            as.emit_byte(bits);
+            return true;
+        }
+
+        case OCTO_HINT:
+            // Debugger hints of the Octo IDE, the operands are names or registers
+            for (u32 i = 0; i < entry.opcode; i++) {
+                if (!operand(&operand_token))
+                    return false;
+            }
+            return true;
+
+        case OCTO_UNSUPPORTED:
+            return as.error("%.*s is not supported", (int) token.text.size(), token.text.data());
+
+        case OCTO_NONE:
+            return inst(entry.opcode);
+
+        case OCTO_N:
+            return operand(&operand_token) && inst(entry.opcode, &operand_token, ASM_FIELD_N);
+
+        case OCTO_PLANE: {
+            u16 bits;
+            if (!operand(&operand_token))
+                return false;
+            if (!known(operand_token, &number))
+                return as.error("%.*s has to be defined above", (int) operand_token.text.size(), operand_token.text.data());
+            return as.encode(ASM_FIELD_N, number, operand_token.text, &bits) && inst(entry.opcode | bits << 8);
+        }
+
+        case OCTO_X:
+            return reg_operand(&x) && inst(entry.opcode | x << 8);
+
+        case OCTO_RANGE:
+            if (!reg_operand(&x))
+                return false;
+            // save vx - vy is the XO-CHIP range form
+            if (peek(&operand_token) && operand_token.text == "-") {
+                next(&operand_token);
+                return reg_operand(&y) && inst(((entry.opcode & 0xFF) == 0x55 ? 0x5002 : 0x5003) | x << 8 | y << 4);
+            }
+            return inst(entry.opcode | x << 8);
+
+        case OCTO_SPRITE:
+            return reg_operand(&x) && reg_operand(&y) && operand(&operand_token) &&
+                   inst(entry.opcode | x << 8 | y << 4, &operand_token, ASM_FIELD_N);
+
+        case OCTO_ADDR:
+            return operand(&operand_token) && inst(entry.opcode, &operand_token);
+
+        case OCTO_TIMER:
+            return word(":=") && reg_operand(&x) && inst(entry.opcode | x << 8);
+
+        case OCTO_I:
+            return index();
+
+        case OCTO_IF: {
+            octo_condition_t test = {};
+            if (!condition(&test) || !operand(&operand_token))
+                return false;
+            if (operand_token.text == "then")
+                return skip_unless(test, false);
+            if (operand_token.text != "begin")
+                return as.error("Expected then or begin: %.*s", (int) operand_token.text.size(), operand_token.text.data());
+            if (!skip_unless(test, true))
+                return false;
+            blocks.push_back({OCTO_IF, as.result->size, token, {}});
+            return inst(0x1000);
+        }
+
+        case OCTO_ELSE: {
+            if (blocks.empty() || blocks.back().kind != OCTO_IF)
+                return as.error("else without if ... begin");
+            const u32 offset = as.result->size;
+            if (!inst(0x1000) || !patch(blocks.back().offset))
+                return false;
+            blocks.back().kind = OCTO_ELSE;
+            blocks.back().offset = offset;
+            return true;
+        }
+
+        case OCTO_END: {
+            if (blocks.empty() || blocks.back().kind == OCTO_LOOP)
+                return as.error("end without if ... begin");
+            const u32 offset = blocks.back().offset;
+            blocks.pop_back();
+            return patch(offset);
+        }
+
+        case OCTO_LOOP:
+            blocks.push_back({OCTO_LOOP, as.starting_addr + as.result->size, token, {}});
+            return true;
+
+        case OCTO_WHILE: {
+            octo_condition_t test = {};
+            octo_block_t *loop = innermost(OCTO_LOOP);
+            if (!loop)
+                return as.error("while without loop");
+            if (!condition(&test) || !skip_unless(test, true))
+                return false;
+            loop->exits.push_back(as.result->size);
+            return inst(0x1000);
+        }
+
+        case OCTO_AGAIN: {
+            u16 bits;
+            if (blocks.empty() || blocks.back().kind != OCTO_LOOP)
+                return as.error("again without loop");
+            const octo_block_t loop = std::move(blocks.back());
+            blocks.pop_back();
+            if (!as.encode(ASM_FIELD_NNN, loop.offset, token.text, &bits) || !inst(0x1000 | bits))
+                return false;
+            for (u32 exit : loop.exits) {
+                if (!patch(exit))
+                    return false;
+            }
+            return true;
+        }
+        }
+        return true;
+    }
+
+    // The rest of a statement that went wrong, up to the end of its line
+    void skip_line() {
+        octo_token_t token;
+        while (peek(&token) && token.line == at.line && token.macro.data() == at.macro.data() &&
+               token.macro_line == at.macro_line)
+            next(&token);
+    }
+
+    void run() {
+        octo_token_t token;
+        while (next(&token)) {
+            const u32 offset = as.result->size;
+            at = token;
+            as.line_no = token.line;
+            as.macro_name = token.macro;
+            as.macro_line = token.macro_line;
+            as.here = as.starting_addr + offset;
+
+            // Lines of the source go in the listing as they start, expansions count as the line they are used on
+            if (as.listing && token.line_start && token.line != listed_line) {
+                const char *eol = (const char *) memchr(token.line_start, '\n', end - token.line_start);
+                as.listed.push_back({offset, 0, as.file, token.line, 0,
+                                     std::string_view(token.line_start, (eol ? eol : end) - token.line_start)});
+                listed_line = token.line;
+            }
+
+            // A statement that failed half way leaves no fixups behind
+            const size_t pending = as.fixups.size();
+            if (!statement(token)) {
+                as.fixups.resize(pending);
+                skip_line();
+            }
+
+            if (as.listing && !as.listed.empty())
+                as.listed.back().size = as.result->size - as.listed.back().offset;
+            if (as.result->size > offset) {
+                std::vector<source_line_t> &lines = as.result->map.lines;
+                const u16 addr = as.starting_addr + offset, size = as.result->size - offset;
+                if (!lines.empty() && lines.back().line == token.line && lines.back().file == as.file &&
+                        lines.back().addr + lines.back().size == addr)
+                    lines.back().size += size;
+                else
+                    lines.push_back({addr, size, (u16) as.file, 0, token.line});
+            }
+        }
+
+        for (const octo_block_t &block : blocks) {
+            as.line_no = block.at.line;
+            as.macro_name = block.at.macro;
+            as.macro_line = block.at.macro_line;
+            as.error("%s", block.kind == OCTO_LOOP ? "loop without again" : "if ... begin without end");
+        }
+        as.macro_name = std::string_view();
+    }
+};
+
+void Assembler::assemble_octo(u32 index) {
+    octo_t octo(*this, sources[index].data, sources[index].data + sources[index].size);
+    octo.run();
+}
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "../include/Profiler.h"
+#include "../include/SourceMap.h"
+
+Profiler profiler;
+
+#define PROFILER_TOP_PCS 20     // PCs listed in the report
+#define PROFILER_TOP_LINES 20   // Source lines listed in the report
+#define PROFILER_MAX_DEPTH 15   // Same as the guest stack, deeper CALLs are dropped by Chip8::push too
+
+// Opcode classes for the report, first matching pattern wins
+static const struct {
+    u16 mask;
+    u16 value;
+    const char *name;
+} opcode_classes[] = {
+    {0xFFFF, 0x00E0, "00E0 cls"},
+    {0xFFFF, 0x00EE, "00EE ret"},
+    {0xFFF0, 0x00C0, "00CN scd"},
+    {0xFFF0, 0x00D0, "00DN scu"},
+    {0xFFF0, 0x00F0, "00FN scr/scl/exit/low/high"},
+    {0xF000, 0x1000, "1NNN jp"},
+    {0xF000, 0x2000, "2NNN call"},
+    {0xF000, 0x3000, "3XNN se"},
+    {0xF000, 0x4000, "4XNN sne"},
+    {0xF00F, 0x5000, "5XY0 se"},
+    {0xF00E, 0x5002, "5XY2/3 ld range"},
+    {0xF000, 0x6000, "6XNN ld"},
+    {0xF000, 0x7000, "7XNN add"},
+    {0xF00F, 0x8000, "8XY0 ld"},
+    {0xF00C, 0x8000, "8XY1-3 or/and/xor"},
+    {0xF00F, 0x8004, "8XY4 add"},
+    {0xF00D, 0x8005, "8XY5/7 sub/subn"},
+    {0xF007, 0x8006, "8XY6/E shr/shl"},
+    {0xF000, 0x9000, "9XY0 sne"},
+    {0xF000, 0xA000, "ANNN ld i"},
+    {0xF000, 0xB000, "BNNN jp v0"},
+    {0xF000, 0xC000, "CXNN rnd"},
+    {0xF000, 0xD000, "DXYN drw"},
+    {0xF000, 0xE000, "EXNN skp/sknp"},
+    {0xF0FF, 0xF00A, "FX0A ld k"},
+    {0xF0FF, 0xF033, "FX33 bcd"},
+    {0xF0FF, 0xF055, "FX55 ld [i]"},
+    {0xF0FF, 0xF065, "FX65 ld [i]"},
+    {0xF000, 0xF000, "FXNN other"},
+    {0x0000, 0x0000, "0NNN other"},
+};
+
+#define OPCODE_CLASSES (sizeof opcode_classes / sizeof opcode_classes[0])
+
+// Allocate the counters and start profiling at the root stack
+bool Profiler::start(Address entry_point) {
+    stop();
+
+    pc_insts = new (std::nothrow) u64[0x10000]();
+    pc_ticks = new (std::nothrow) u64[0x10000]();
+    op_insts = new (std::nothrow) u64[0x10000]();
+    op_ticks = new (std::nothrow) u64[0x10000]();
+    if (!pc_insts || !pc_ticks || !op_insts || !op_ticks) {
+        SDL_Log("Could not allocate profiler counters\n");
+        stop();
+        return false;
+    }
+
+    nodes.assign(1, {.addr = entry_point, .parent = 0, .depth = 0, .insts = 0});
+    children.clear();
+    current = 0;
+    dropped = 0;
+    last_tick = 0;
+
+    return true;    // Success
+}
+
+void Profiler::stop() {
+    delete[] pc_insts;
+    delete[] pc_ticks;
+    delete[] op_insts;
+    delete[] op_ticks;
+    pc_insts = pc_ticks = op_insts = op_ticks = NULL;
+}
+
+void Profiler::call(Address target) {
+    if (nodes[current].depth == PROFILER_MAX_DEPTH) {
+        dropped++;
+        return;
+    }
+
+    const u64 key = ((u64) current << 16) | target;
+    auto it = children.find(key);
+
+    if (it != children.end()) {
+        current = it->second;
+        return;
+    }
+
+    nodes.push_back({.addr = target, .parent = current, .depth = (u8) (nodes[current].depth + 1), .insts = 0});
+    current = children[key] = nodes.size() - 1;
+}
+
+void Profiler::ret() {
+    // RETs of dropped CALLs come first, RET with an empty stack stays at the root
+    if (dropped) {
+        dropped--;
+        return;
+    }
+    current = nodes[current].parent;
+}
+
+void Profiler::pause() {
+    if (!last_tick)
+        return;
+
+    const u64 now = SDL_GetPerformanceCounter();
+    pc_ticks[last_pc] += now - last_tick;
+    op_ticks[last_opcode] += now - last_tick;
+    last_tick = 0;
+}
+
+void Profiler::report(FILE *out) {
+    const f64 ns_per_tick = 1e9 / SDL_GetPerformanceFrequency();
+    u64 total_insts = 0, total_ticks = 0;
+
+    std::vector<Address> pcs;
+    for (u32 pc = 0; pc < 0x10000; pc++) {
+        if (!pc_insts[pc])
+            continue;
+        pcs.push_back(pc);
+        total_insts += pc_insts[pc];
+        total_ticks += pc_ticks[pc];
+    }
+    if (!total_insts)
+        return;
+
+    // Rank PCs by host time spent on them
+    std::sort(pcs.begin(), pcs.end(), [this](Address a, Address b) { return pc_ticks[a] > pc_ticks[b]; });
+
+    fprintf(out, "==== PROFILE: %llu instructions, %0.3fms ====\n",
+            (long long unsigned) total_insts, total_ticks * ns_per_tick / 1e6);
+    fprintf(out, "%-6s %12s %7s %10s %8s%s\n", "PC", "count", "time%", "time(us)", "ns/inst",
+            source_map.empty() ? "" : "  source");
+    for (size_t i = 0; i < pcs.size() && i < PROFILER_TOP_PCS; i++) {
+        const Address pc = pcs[i];
+        const std::string where = source_map.describe(pc);
+        fprintf(out, "0x%04X %12llu %6.2f%% %10.1f %8.1f%s%s\n", pc, (long long unsigned) pc_insts[pc],
+                100.0 * pc_ticks[pc] / (total_ticks ? total_ticks : 1),
+                pc_ticks[pc] * ns_per_tick / 1e3, pc_ticks[pc] * ns_per_tick / pc_insts[pc],
+                where.empty() ? "" : "  ", where.c_str());
+    }
+
+    // Fold PCs into the source lines they were assembled from, unrolled code shares its lines
+    if (!source_map.lines.empty()) {
+        std::unordered_map<u64, std::pair<u64, u64>> by_line;     // file << 32 | line -> insts, ticks
+        for (Address pc : pcs) {
+            const source_line_t *line = source_map.line_at(pc);
+            if (line) {
+                std::pair<u64, u64> &counts = by_line[(u64) line->file << 32 | line->line];
+                counts.first += pc_insts[pc];
+                counts.second += pc_ticks[pc];
+            }
+        }
+
+        std::vector<std::pair<u64, std::pair<u64, u64>>> lines(by_line.begin(), by_line.end());
+        std::sort(lines.begin(), lines.end(), [](const auto &a, const auto &b) { return a.second.second > b.second.second; });
+
+        fprintf(out, "%-26s %12s %7s %8s\n", "source line", "count", "time%", "ns/inst");
+        for (size_t i = 0; i < lines.size() && i < PROFILER_TOP_LINES; i++) {
+            const std::string &file = source_map.files[lines[i].first >> 32];
+            const std::string name = (file.empty() ? "line " : file.substr(file.rfind('/') + 1) + ":") +
+                                     std::to_string((u32) lines[i].first);
+            const auto [insts, ticks] = lines[i].second;
+            fprintf(out, "%-26s %12llu %6.2f%% %8.1f\n", name.c_str(), (long long unsigned) insts,
+                    100.0 * ticks / (total_ticks ? total_ticks : 1), ticks * ns_per_tick / insts);
+        }
+    }
+
+    // Fold opcodes into classes
+    u64 class_insts[OPCODE_CLASSES] = {0}, class_ticks[OPCODE_CLASSES] = {0};
+    for (u32 opcode = 0; opcode < 0x10000; opcode++) {
+        if (!op_insts[opcode])
+            continue;
+        for (u32 c = 0; c < OPCODE_CLASSES; c++) {
+            if ((opcode & opcode_classes[c].mask) == opcode_classes[c].value) {
+                class_insts[c] += op_insts[opcode];
+                class_ticks[c] += op_ticks[opcode];
+                break;
+            }
+        }
+    }
+
+    u32 classes[OPCODE_CLASSES];
+    for (u32 c = 0; c < OPCODE_CLASSES; c++)
+        classes[c] = c;
+    std::sort(classes, classes + OPCODE_CLASSES, [&](u32 a, u32 b) { return class_ticks[a] > class_ticks[b]; });
+
+    fprintf(out, "%-26s %12s %7s %8s\n", "opcode class", "count", "time%", "ns/inst");
+    for (u32 i = 0; i < OPCODE_CLASSES && class_insts[classes[i]]; i++) {
+        const u32 c = classes[i];
+        fprintf(out, "%-26s %12llu %6.2f%% %8.1f\n", opcode_classes[c].name, (long long unsigned) class_insts[c],
+                100.0 * class_ticks[c] / (total_ticks ? total_ticks : 1), class_ticks[c] * ns_per_tick / class_insts[c]);
+    }
+}
+
+bool Profiler::write_collapsed(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        SDL_Log("Could not open profile file %s\n", path);
+        return false;
+    }
+
+    std::vector<u32> chain;
+    for (u32 n = 0; n < nodes.size(); n++) {
+        if (!nodes[n].insts)
+            continue;
+
+        // Walk up to the root, then print outermost first
+        chain.clear();
+        for (u32 i = n; i != 0; i = nodes[i].parent)
+            chain.push_back(i);
+
+        // Subroutines are named after their label when the program has a source map
+        fprintf(file, "main");
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+            const source_symbol_t *symbol = source_map.symbol_at(nodes[*it].addr);
+            if (symbol && symbol->addr == nodes[*it].addr)
+                fprintf(file, ";%s", symbol->name.c_str());
+            else
+                fprintf(file, ";sub_%04X", nodes[*it].addr);
+        }
+        fprintf(file, " %llu\n", (long long unsigned) nodes[n].insts);
+    }
+
+    fclose(file);
+    return true;    // Success
+}
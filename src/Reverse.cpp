@@ -0,0 +1,157 @@
+#include <cstring>
+#include "../include/Reverse.h"
+
+Reverse reverse;
+
+// Checkpoints are preallocated so memory stays fixed for the whole session
+bool Reverse::start(u32 interval, u32 count) {
+    if (interval == 0 || count == 0) {
+        SDL_Log("Reverse execution needs a checkpoint interval and count\n");
+        return false;
+    }
+
+    ring.assign(count, checkpoint_t{});
+    oldest = used = 0;
+    this->interval = interval;
+    next_checkpoint = 0;
+    events.clear();
+    cursor = 0;
+
+    return true;    // Success
+}
+
+void Reverse::stop() {
+    ring.clear();
+    events.clear();
+    oldest = used = 0;
+    interval = 0;
+}
+
+void Reverse::take(const Chip8 &chip8) {
+    u32 slot;
+    if (used < ring.size()) {
+        slot = (oldest + used++) % ring.size();
+    } else {
+        // Overwrite the oldest, and forget inputs only it needed
+        slot = oldest;
+        oldest = (oldest + 1) % ring.size();
+    }
+
+    checkpoint_t &checkpoint = ring[slot];
+    checkpoint.chip8 = chip8;
+    if (chip8.ram != chip8.core_ram)
+        checkpoint.xo_ram.assign(chip8.ram, chip8.ram + chip8.ram_size + RAM_PADDING);
+    else
+        checkpoint.xo_ram.clear();
+
+    while (!events.empty() && events.front().insts <= begin())
+        events.pop_front();
+    next_checkpoint = chip8.insts + interval;
+}
+
+void Reverse::frame(const Chip8 &chip8) {
+    input_event_t event = {
+        .insts = chip8.insts,
+        .keypad = 0,
+        .delay_timer = chip8.delay_timer,
+        .sound_timer = chip8.sound_timer,
+        .vblank = chip8.vblank,
+    };
+    for (u8 key = 0; key < 16; key++)
+        if (chip8.keypad[key])
+            event.keypad |= 1 << key;
+
+    // A checkpoint already holds the inputs of its own instruction count
+    if (chip8.insts >= next_checkpoint)
+        take(chip8);
+    else
+        events.push_back(event);
+}
+
+void Reverse::reset(const Chip8 &chip8) {
+    oldest = used = 0;
+    events.clear();
+    take(chip8);
+}
+
+bool Reverse::checkpoint_before(u64 insts, u64 *checkpoint) const {
+    for (u32 i = used; i > 0; i--) {
+        const Chip8 &state = ring[(oldest + i - 1) % ring.size()].chip8;
+        if (state.insts < insts) {
+            *checkpoint = state.insts;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Reverse::rewind(Chip8 *chip8, const config_t &config, u64 target) {
+    const checkpoint_t *checkpoint = NULL;
+    for (u32 i = used; i > 0 && !checkpoint; i--) {
+        const checkpoint_t &c = ring[(oldest + i - 1) % ring.size()];
+        if (c.chip8.insts <= target)
+            checkpoint = &c;
+    }
+    if (!checkpoint)
+        return false;
+
+    // Keep the live XO-CHIP block, the copy's ram pointer is the same one
+    u8 *ram = chip8->ram;
+    *chip8 = checkpoint->chip8;
+    chip8->ram = checkpoint->xo_ram.empty() ? chip8->core_ram : ram;
+    if (!checkpoint->xo_ram.empty())
+        memcpy(chip8->ram, checkpoint->xo_ram.data(), checkpoint->xo_ram.size());
+
+    cursor = 0;
+    while (cursor < events.size() && events[cursor].insts <= chip8->insts)
+        cursor++;
+
+    // Same program, no logs, profiler or heatmap counts for instructions that already ran
+    replay_config = config;
+    replay_config.instruction_execution = replay_config.register_changes = false;
+    replay_config.memory_access = replay_config.stack_operations = false;
+    replay_config.profiler = replay_config.latency_metrics = replay_config.heatmap = false;
+    replay_config.trace_db = false;
+    chip8->select_interpreter(&replay_config);
+
+    return true;    // Success
+}
+
+void Reverse::apply_events(Chip8 *chip8) {
+    for (; cursor < events.size() && events[cursor].insts <= chip8->insts; cursor++) {
+        const input_event_t &event = events[cursor];
+        for (u8 key = 0; key < 16; key++)
+            chip8->keypad[key] = event.keypad >> key & 1;
+        chip8->delay_timer = event.delay_timer;
+        chip8->sound_timer = event.sound_timer;
+        chip8->vblank = event.vblank;
+    }
+}
+
+void Reverse::step(Chip8 *chip8) {
+    apply_events(chip8);
+    chip8->emulate_inst(replay_config);
+}
+
+bool Reverse::seek(Chip8 *chip8, const config_t &config, u64 target) {
+    if (!rewind(chip8, config, target))
+        return false;
+
+    while (chip8->insts < target)
+        step(chip8);
+    apply_events(chip8);
+
+    return true;    // Success
+}
+
+void Reverse::finish(Chip8 *chip8, const config_t &config) {
+    while (used > 0 && ring[(oldest + used - 1) % ring.size()].chip8.insts > chip8->insts)
+        used--;
+    while (!events.empty() && events.back().insts > chip8->insts)
+        events.pop_back();
+    next_checkpoint = (used ? ring[(oldest + used - 1) % ring.size()].chip8.insts : 0) + interval;
+
+    chip8->select_interpreter(&config);
+    chip8->dirty_rows = ~0ULL;      // The display went back too
+    chip8->draw = true;
+}
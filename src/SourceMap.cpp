@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "../include/SourceMap.h"
+
+SourceMap source_map;
+
+void SourceMap::clear() {
+    files.clear();
+    lines.clear();
+    symbols.clear();
+}
+
+void SourceMap::set_symbols(std::vector<source_symbol_t> labels, u32 end) {
+    // One symbol per address, a .local only if nothing else is there
+    std::sort(labels.begin(), labels.end(), [](const source_symbol_t &a, const source_symbol_t &b) {
+        return a.addr != b.addr ? a.addr < b.addr : (a.name[0] != '.') > (b.name[0] != '.');
+    });
+    labels.erase(std::unique(labels.begin(), labels.end(),
+                             [](const source_symbol_t &a, const source_symbol_t &b) { return a.addr == b.addr; }),
+                 labels.end());
+
+    for (size_t i = 0; i < labels.size(); i++)
+        labels[i].end = i + 1 < labels.size() ? labels[i + 1].addr : std::min<u32>(std::max<u32>(end, labels[i].addr), 0x10000);
+    symbols = std::move(labels);
+}
+
+static void put(FILE *file, const void *data, size_t size) {
+    fwrite(data, 1, size, file);
+}
+
+static void put_string(FILE *file, const std::string &s) {
+    const u32 size = s.size();
+    put(file, &size, sizeof size);
+    put(file, s.data(), size);
+}
+
+bool SourceMap::save(const char *path) const {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const sourcemap_header_t header = {
+        .magic = SOURCEMAP_MAGIC,
+        .version = SOURCEMAP_VERSION,
+        .files = (u32) files.size(),
+        .lines = (u32) lines.size(),
+        .symbols = (u32) symbols.size(),
+    };
+    put(file, &header, sizeof header);
+    for (const std::string &name : files)
+        put_string(file, name);
+    put(file, lines.data(), lines.size() * sizeof(source_line_t));
+    for (const source_symbol_t &symbol : symbols) {
+        put(file, &symbol.addr, sizeof symbol.addr);
+        put(file, &symbol.end, sizeof symbol.end);
+        put_string(file, symbol.name);
+    }
+
+    const bool success = !ferror(file);
+    if (fclose(file) != 0 || !success) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+    return true;    // Success
+}
+
+static bool get_string(FILE *file, std::string *s) {
+    u32 size;
+    if (fread(&size, sizeof size, 1, file) != 1 || size > 0x10000)
+        return false;
+    s->resize(size);
+    return !size || fread(s->data(), size, 1, file) == 1;
+}
+
+bool SourceMap::load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    clear();
+    sourcemap_header_t header;
+    bool ok = fread(&header, sizeof header, 1, file) == 1 && !strcmp(header.magic, SOURCEMAP_MAGIC) &&
+              header.version == SOURCEMAP_VERSION && header.lines <= 0x10000 && header.symbols <= 0x10000;
+
+    files.resize(ok ? header.files : 0);
+    for (std::string &name : files)
+        ok = ok && get_string(file, &name);
+
+    lines.resize(ok ? header.lines : 0);
+    ok = ok && (lines.empty() || fread(lines.data(), sizeof(source_line_t), lines.size(), file) == lines.size());
+    for (const source_line_t &line : lines)
+        ok = ok && line.file < files.size();
+
+    symbols.resize(ok ? header.symbols : 0);
+    for (source_symbol_t &symbol : symbols) {
+        ok = ok && fread(&symbol.addr, sizeof symbol.addr, 1, file) == 1 && fread(&symbol.end, sizeof symbol.end, 1, file) == 1 &&
+             get_string(file, &symbol.name);
+    }
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "%s is not a source map of this version\n", path);
+        clear();
+        return false;
+    }
+    return true;    // Success
+}
+
+const source_line_t *SourceMap::line_at(u32 addr) const {
+    auto it = std::upper_bound(lines.begin(), lines.end(), addr,
+                               [](u32 addr, const source_line_t &line) { return addr < line.addr; });
+    if (it == lines.begin() || addr >= (u32) (it - 1)->addr + (it - 1)->size)
+        return NULL;
+    return &*(it - 1);
+}
+
+const source_symbol_t *SourceMap::symbol_at(u32 addr) const {
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), addr,
+                               [](u32 addr, const source_symbol_t &symbol) { return addr < symbol.addr; });
+    if (it == symbols.begin() || addr >= (it - 1)->end)
+        return NULL;
+    return &*(it - 1);
+}
+
+std::string SourceMap::describe(u32 addr) const {
+    const source_symbol_t *symbol = symbol_at(addr);
+    const source_line_t *line = line_at(addr);
+    std::string text;
+    char number[16];
+
+    if (symbol) {
+        text = symbol->name;
+        if (addr != symbol->addr) {
+            snprintf(number, sizeof number, "+%X", addr - symbol->addr);
+            text += number;
+        }
+    }
+    if (line) {
+        if (!text.empty())
+            text += ' ';
+        text += files[line->file].empty() ? "line " : files[line->file] + ":";
+        text += std::to_string(line->line);
+    }
+    return text;
+}
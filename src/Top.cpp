@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../include/Metrics.h"
+
+// Burst time percentile from the log2 buckets, upper bound of the bucket in us
+static u64 burst_percentile(const metrics_data_t &data, f64 p) {
+    u64 total = 0, seen = 0;
+
+    for (u32 i = 0; i < METRICS_BURST_BUCKETS; i++)
+        total += data.burst_us[i];
+    for (u32 i = 0; i < METRICS_BURST_BUCKETS; i++) {
+        seen += data.burst_us[i];
+        if (seen > 0 && seen >= p / 100.0 * total)
+            return 1ULL << i;
+    }
+
+    return 0;
+}
+
+static void print_metrics(const metrics_shm_t *shm, const metrics_data_t &data) {
+    printf("chip8 pid %u, up %llu.%03llus\n", shm->pid,
+           (long long unsigned) data.uptime_ms / 1000, (long long unsigned) data.uptime_ms % 1000);
+    printf("  instructions     %12llu  (%llu/s)\n", (long long unsigned) data.insts, (long long unsigned) data.ips);
+    printf("  frames presented %12llu\n", (long long unsigned) data.frames_presented);
+    printf("  frames skipped   %12llu\n", (long long unsigned) data.frames_skipped);
+    printf("  audio underruns  %12llu\n", (long long unsigned) data.audio_underruns);
+    printf("  fx0a waits       %12llu  (avg %llu us)\n", (long long unsigned) data.fx0a_waits,
+           (long long unsigned) (data.fx0a_waits ? data.fx0a_wait_us / data.fx0a_waits : 0));
+    printf("  burst time       p50 <%llu us  p99 <%llu us\n",
+           (long long unsigned) burst_percentile(data, 50), (long long unsigned) burst_percentile(data, 99));
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = "/chip8";
+    bool once = false;
+
+    for (i32 i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--once"))
+            once = true;
+        else if (argv[i][0] == '/')
+            name = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s [/shm_name] [--once]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Read only mapping, the emulator never sees readers
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No emulator metrics at %s, set metrics_shm in config.ini\n", name);
+        exit(EXIT_FAILURE);
+    }
+    void *mem = mmap(NULL, sizeof(metrics_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    const metrics_shm_t *shm = (const metrics_shm_t *) mem;
+    metrics_data_t data;
+
+    while (true) {
+        if (!Metrics::read(shm, &data)) {
+            fprintf(stderr, "Could not read metrics from %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+
+        if (!once)
+            printf("\033[H\033[J");     // Clear the terminal
+        print_metrics(shm, data);
+        fflush(stdout);
+
+        if (once)
+            break;
+        sleep(1);
+    }
+
+    munmap(mem, sizeof(metrics_shm_t));
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cstring>
+#include <SDL2/SDL.h>
+#include "../include/Trace.h"
+
+TraceSink trace_sink;
+
+// Create the trace file and start the writer thread
+bool TraceSink::open(const char *path) {
+    file = fopen(path, "wb");
+    if (!file) {
+        SDL_Log("Could not open trace file %s\n", path);
+        return false;
+    }
+
+    trace_header_t header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION, .record_size = sizeof(debug_record_t)};
+    fwrite(&header, sizeof header, 1, file);
+
+    ring = new debug_record_t[TRACE_RING_SIZE];
+    head = tail = 0;
+    running = true;
+    writer = std::thread(&TraceSink::drain, this);
+
+    return true;    // Success
+}
+
+// Stop the writer once everything pushed so far is on disk
+void TraceSink::close() {
+    if (!file)
+        return;
+
+    // Records written into the ring since the last flush, the buffer can't point into it after this
+    if (holds(debug_buffer.records))
+        commit(debug_buffer.count);
+    debug_buffer.records = debug_buffer.storage;
+    debug_buffer.capacity = DEBUG_BUFFER_SIZE;
+    debug_buffer.count = 0;
+
+    running = false;
+    writer.join();
+
+    fclose(file);
+    file = NULL;
+    delete[] ring;
+    ring = NULL;
+}
+
+void TraceSink::push(const debug_record_t *records, u32 count) {
+    u64 h = head.load(std::memory_order_relaxed);
+
+    while (count > 0) {
+        // Copy as much as fits before the writer's position or the end of the ring
+        const u64 space = TRACE_RING_SIZE - (h - tail.load(std::memory_order_acquire));
+        if (space == 0) {
+            wake.notify_one();
+            std::this_thread::yield();
+            continue;
+        }
+
+        const u32 offset = h & (TRACE_RING_SIZE - 1);
+        const u32 n = std::min<u64>({count, space, TRACE_RING_SIZE - offset});
+
+        memcpy(&ring[offset], records, n * sizeof(debug_record_t));
+        records += n;
+        count -= n;
+        h += n;
+        head.store(h, std::memory_order_release);
+    }
+}
+
+debug_record_t *TraceSink::reserve(u32 *capacity) {
+    const u64 h = head.load(std::memory_order_relaxed);
+    u64 space;
+
+    while ((space = TRACE_RING_SIZE - (h - tail.load(std::memory_order_acquire))) == 0) {
+        wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    const u32 offset = h & (TRACE_RING_SIZE - 1);
+    // No more than a buffer's worth, so the writer can drain while the rest is filled
+    *capacity = std::min<u64>({space, TRACE_RING_SIZE - offset, DEBUG_BUFFER_SIZE});
+    return &ring[offset];
+}
+
+void TraceSink::commit(u32 count) {
+    const u64 h = head.load(std::memory_order_relaxed) + count;
+    head.store(h, std::memory_order_release);
+    if (h - tail.load(std::memory_order_relaxed) >= TRACE_RING_SIZE / 4)
+        wake.notify_one();
+}
+
+// Writer thread
+void TraceSink::drain() {
+    u64 t = tail.load(std::memory_order_relaxed);
+
+    while (true) {
+        // Read running before head so the last push is seen before exiting
+        const bool stopping = !running.load(std::memory_order_acquire);
+        const u64 h = head.load(std::memory_order_acquire);
+
+        if (h == t) {
+            if (stopping)
+                break;
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait_for(guard, std::chrono::milliseconds(1));
+            continue;
+        }
+
+        const u32 offset = t & (TRACE_RING_SIZE - 1);
+        const u32 n = std::min<u64>(h - t, TRACE_RING_SIZE - offset);
+
+        fwrite(&ring[offset], sizeof(debug_record_t), n, file);
+        t += n;
+        tail.store(t, std::memory_order_release);
+    }
+
+    fflush(file);
+}
@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/TraceDb.h"
+
+TraceDb tracedb;
+
+// Decode the instruction of the next record in [p, end)
+static u64 next_record(const u8 *&p, const u8 *end, u64 last) {
+    if (p >= end)
+        return ~0ULL;
+
+    u64 delta = 0;
+    for (u8 shift = 0; ; shift += 7) {
+        delta |= (u64) (*p & 0x7F) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    return last + delta;
+}
+
+void tracedb_column_t::flush() {
+    if (!buffer.empty())
+        fwrite(buffer.data(), 1, buffer.size(), file);
+    size += buffer.size();
+    buffer.clear();
+}
+
+bool TraceDb::open_column(tracedb_column_t *column, const char *name) {
+    const std::string path = dir + "/" + name;
+
+    column->file = fopen(path.c_str(), "wb");
+    if (!column->file) {
+        SDL_Log("Could not create trace column %s\n", path.c_str());
+        return false;
+    }
+    column->buffer.reserve(1 << 16);
+    column->size = column->last = 0;
+
+    return true;    // Success
+}
+
+// Memory before the first instruction, the write index starts from it
+bool TraceDb::write_ram(const Chip8 &chip8) {
+    const std::string ram_path = dir + "/ram";
+    FILE *file = fopen(ram_path.c_str(), "wb");
+    if (!file) {
+        SDL_Log("Could not create trace column %s\n", ram_path.c_str());
+        return false;
+    }
+    fwrite(chip8.ram, 1, chip8.ram_size, file);
+    fclose(file);
+
+    return true;    // Success
+}
+
+bool TraceDb::open(const char *path, const Chip8 &chip8) {
+    dir = path;
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        SDL_Log("Could not create trace directory %s\n", path);
+        return false;
+    }
+
+    if (!write_ram(chip8))
+        return false;
+
+    tracedb_column_t *columns[] = {&ops, &branches, &regs, &writes, &frames, &blocks};
+    const char *names[] = {"ops", "branches", "regs", "writes", "frames", "blocks"};
+    for (u32 i = 0; i < 6; i++) {
+        if (!open_column(columns[i], names[i])) {
+            close();
+            return false;
+        }
+    }
+
+    insts = write_count = 0;
+    next_pc = chip8.PC;
+    ram_size = chip8.ram_size;
+    pending_count = 0;
+
+    return true;    // Success
+}
+
+void TraceDb::frame() {
+    frames.put64(insts);
+}
+
+void TraceDb::inst(const Chip8 &chip8) {
+    // A block restarts the deltas and carries the state to start reading from
+    if (insts % TRACEDB_BLOCK == 0) {
+        tracedb_block_t block = {
+            .branches = branches.size + branches.buffer.size(),
+            .regs = regs.size + regs.buffer.size(),
+            .writes = writes.size + writes.buffer.size(),
+            .pc = chip8.PC,
+            .I = chip8.I,
+            .V = {},
+        };
+        memcpy(block.V, chip8.V, sizeof block.V);
+        for (u32 i = 0; i < sizeof block; i++)
+            blocks.put(((const u8 *) &block)[i]);
+        branches.last = regs.last = writes.last = insts;
+    }
+
+    ops.put16(chip8.inst.opcode);
+    if (chip8.PC != next_pc) {
+        branches.delta(insts);
+        branches.put16(chip8.PC);
+    }
+    next_pc = chip8.PC + 2;
+}
+
+void TraceDb::retire(const Chip8 &chip8, const u8 *prev_V, u16 prev_I) {
+    for (u8 i = 0; i < 16; i++) {
+        if (chip8.V[i] != prev_V[i]) {
+            regs.delta(insts);
+            regs.put(i);
+            regs.put(chip8.V[i]);
+        }
+    }
+    if (chip8.I != prev_I) {
+        regs.delta(insts);
+        regs.put(TRACEDB_REG_I);
+        regs.put16(chip8.I);
+    }
+
+    for (u32 i = 0; i < pending_count; i++) {
+        for (u32 addr = pending[i].addr; addr < pending[i].addr + pending[i].len; addr++) {
+            writes.delta(insts);
+            writes.put16(addr & (TRACEDB_ADDRESSES - 1));
+            writes.put(chip8.ram[addr]);
+            write_count++;
+        }
+    }
+    pending_count = 0;
+
+    insts++;
+}
+
+void TraceDb::patch(const Chip8 &chip8, u32 addr, u32 len) {
+    // Nothing ran yet, it's still the memory the trace starts from
+    if (insts == 0) {
+        write_ram(chip8);
+        return;
+    }
+
+    for (u32 i = addr; i < addr + len; i++) {
+        writes.delta(insts);
+        writes.put16(i & (TRACEDB_ADDRESSES - 1));
+        writes.put(chip8.ram[i]);
+        write_count++;
+    }
+}
+
+void TraceDb::patch(const Chip8 &chip8, const u8 *before) {
+    if (insts == 0) {
+        write_ram(chip8);
+        return;
+    }
+
+    for (u32 addr = 0; addr < chip8.ram_size; addr++)
+        if (chip8.ram[addr] != before[addr])
+            patch(chip8, addr, 1);
+}
+
+void TraceDb::close() {
+    if (!active())
+        return;
+
+    tracedb_column_t *columns[] = {&ops, &branches, &regs, &writes, &frames, &blocks};
+    for (tracedb_column_t *column : columns) {
+        if (column->file) {
+            column->flush();
+            fclose(column->file);
+            column->file = NULL;
+        }
+    }
+
+    if (!build_index())
+        return;
+
+    // meta goes last, a trace without it was cut short
+    tracedb_meta_t meta = {
+        .magic = TRACEDB_MAGIC,
+        .version = TRACEDB_VERSION,
+        .ram_size = ram_size,
+        .insts = insts,
+        .frames = frames.size / 8,
+        .writes = write_count,
+    };
+    const std::string path = dir + "/meta";
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        SDL_Log("Could not create trace column %s\n", path.c_str());
+        return;
+    }
+    fwrite(&meta, sizeof meta, 1, file);
+    fclose(file);
+}
+
+// Invert the writes column into one list per address
+// Two passes over the mapped column, the index is written through a mapping too,
+// so neither side has to fit in memory
+bool TraceDb::build_index() {
+    const std::string path = dir + "/index";
+    const u64 header = (TRACEDB_ADDRESSES + 1) * sizeof(u64);
+    const u64 size = header + write_count * sizeof(u64);
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        SDL_Log("Could not create trace index %s\n", path.c_str());
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        SDL_Log("Could not map trace index %s\n", path.c_str());
+        return false;
+    }
+    u64 *start = (u64 *) mem;
+    u64 *entries = start + TRACEDB_ADDRESSES + 1;
+
+    // Walk the writes column block by block, calling back (instruction, address, value)
+    const std::string writes_path = dir + "/writes", blocks_path = dir + "/blocks";
+    const int writes_fd = ::open(writes_path.c_str(), O_RDONLY);
+    const int blocks_fd = ::open(blocks_path.c_str(), O_RDONLY);
+    const u64 block_count = blocks.size / sizeof(tracedb_block_t);
+    const u8 *column = writes.size ? (const u8 *) mmap(NULL, writes.size, PROT_READ, MAP_PRIVATE, writes_fd, 0) : NULL;
+    const tracedb_block_t *block = block_count ?
+        (const tracedb_block_t *) mmap(NULL, blocks.size, PROT_READ, MAP_PRIVATE, blocks_fd, 0) : NULL;
+    ::close(writes_fd);
+    ::close(blocks_fd);
+    if (column == MAP_FAILED || block == MAP_FAILED) {
+        SDL_Log("Could not map the trace writes column\n");
+        munmap(mem, size);
+        return false;
+    }
+
+    auto scan = [&](auto &&record) {
+        for (u64 b = 0; b < block_count; b++) {
+            const u8 *p = column + block[b].writes;
+            const u8 *end = column + (b + 1 < block_count ? block[b + 1].writes : writes.size);
+            u64 inst = b * TRACEDB_BLOCK;
+
+            while ((inst = next_record(p, end, inst)) != ~0ULL) {
+                record(inst, (u16) (p[0] | p[1] << 8), p[2]);
+                p += 3;
+            }
+        }
+    };
+
+    // Count, prefix sum, then fill
+    memset(start, 0, header);
+    if (write_count) {
+        scan([&](u64, u16 addr, u8) { start[addr + 1]++; });
+        for (u32 addr = 0; addr < TRACEDB_ADDRESSES; addr++)
+            start[addr + 1] += start[addr];
+
+        std::vector<u64> fill(start, start + TRACEDB_ADDRESSES);
+        scan([&](u64 inst, u16 addr, u8 value) { entries[fill[addr]++] = inst << 8 | value; });
+    }
+
+    if (column)
+        munmap((void *) column, writes.size);
+    if (block)
+        munmap((void *) block, blocks.size);
+    munmap(mem, size);
+
+    return true;    // Success
+}
+
+bool TraceDbReader::map(const std::string &dir, const char *name, mapping_t *mapping) {
+    const std::string path = dir + "/" + name;
+    struct stat st;
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open trace column %s\n", path.c_str());
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+
+    mapping->size = st.st_size;
+    mapping->data = NULL;
+    if (mapping->size) {
+        void *mem = mmap(NULL, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Could not map trace column %s\n", path.c_str());
+            ::close(fd);
+            return false;
+        }
+        mapping->data = (const u8 *) mem;
+    }
+    ::close(fd);
+
+    return true;    // Success
+}
+
+bool TraceDbReader::open(const char *path) {
+    const std::string dir = path;
+    const std::string meta_path = dir + "/meta";
+
+    FILE *file = fopen(meta_path.c_str(), "rb");
+    if (!file || fread(&meta, sizeof meta, 1, file) != 1 || strcmp(meta.magic, TRACEDB_MAGIC) ||
+            meta.version != TRACEDB_VERSION) {
+        fprintf(stderr, "%s is not a complete trace database of this version\n", path);
+        if (file)
+            fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    if (!map(dir, "ops", &ops) || !map(dir, "branches", &branches) || !map(dir, "regs", &regs) ||
+            !map(dir, "writes", &writes) || !map(dir, "frames", &frames) || !map(dir, "blocks", &blocks) ||
+            !map(dir, "ram", &ram) || !map(dir, "index", &index)) {
+        close();
+        return false;
+    }
+
+    return true;    // Success
+}
+
+void TraceDbReader::close() {
+    mapping_t *mappings[] = {&ops, &branches, &regs, &writes, &frames, &blocks, &ram, &index};
+    for (mapping_t *mapping : mappings) {
+        if (mapping->data)
+            munmap((void *) mapping->data, mapping->size);
+        mapping->data = NULL;
+        mapping->size = 0;
+    }
+}
+
+u64 TraceDbReader::frame_start(u64 frame) const {
+    if (frame >= frame_count())
+        return meta.insts;
+    return ((const u64 *) frames.data)[frame];
+}
+
+// Frame an instruction ran in, 0 for instructions before the first frame
+u64 TraceDbReader::frame_of(u64 inst) const {
+    const u64 *start = (const u64 *) frames.data;
+    const u64 *frame = std::upper_bound(start, start + frame_count(), inst);
+    return frame == start ? 0 : frame - start - 1;
+}
+
+const u64 *TraceDbReader::writes_to(u32 addr, u64 *count) const {
+    const u64 *start = (const u64 *) index.data;
+    const u64 *entries = start + TRACEDB_ADDRESSES + 1;
+
+    *count = start[addr + 1] - start[addr];
+    return entries + start[addr];
+}
+
+TraceDbReader::cursor_t TraceDbReader::cursor(u64 inst) const {
+    cursor_t cursor = {};
+    cursor.db = this;
+    cursor.inst = ~0ULL;
+    cursor.seek(inst);
+    return cursor;
+}
+
+void TraceDbReader::cursor_t::load_block(u64 b) {
+    const u64 block_count = db->blocks.size / sizeof(tracedb_block_t);
+    const tracedb_block_t *blocks = (const tracedb_block_t *) db->blocks.data;
+    const tracedb_block_t &block = blocks[b];
+
+    inst = b * TRACEDB_BLOCK;
+    pc = block.pc;
+    I = block.I;
+    memcpy(V, block.V, sizeof V);
+
+    branch = db->branches.data + block.branches;
+    branch_end = db->branches.data + (b + 1 < block_count ? blocks[b + 1].branches : db->branches.size);
+    reg = db->regs.data + block.regs;
+    reg_end = db->regs.data + (b + 1 < block_count ? blocks[b + 1].regs : db->regs.size);
+    next_branch = next_record(branch, branch_end, inst);
+    next_reg = next_record(reg, reg_end, inst);
+
+    if (next_branch == inst) {
+        branch += 2;    // The block already has this PC
+        next_branch = next_record(branch, branch_end, inst);
+    }
+}
+
+void TraceDbReader::cursor_t::seek(u64 target) {
+    if (target >= db->meta.insts) {
+        inst = db->meta.insts;
+        return;
+    }
+
+    // Going forward in the same block only replays the gap
+    if (target < inst || target / TRACEDB_BLOCK != inst / TRACEDB_BLOCK)
+        load_block(target / TRACEDB_BLOCK);
+    while (inst < target)
+        next();
+}
+
+void TraceDbReader::cursor_t::next() {
+    while (next_reg == inst) {
+        const u8 r = *reg++;
+        if (r == TRACEDB_REG_I) {
+            I = reg[0] | reg[1] << 8;
+            reg += 2;
+        } else {
+            V[r] = *reg++;
+        }
+        next_reg = next_record(reg, reg_end, inst);
+    }
+
+    inst++;
+    if (inst >= db->meta.insts)
+        return;
+    if (inst % TRACEDB_BLOCK == 0) {
+        load_block(inst / TRACEDB_BLOCK);
+        return;
+    }
+
+    if (next_branch == inst) {
+        pc = branch[0] | branch[1] << 8;
+        branch += 2;
+        next_branch = next_record(branch, branch_end, inst);
+    } else {
+        pc += 2;
+    }
+}
@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../include/Debug.h"
+#include "../include/SourceMap.h"
+#include "../include/TraceDb.h"
+
+// Query options, every range is inclusive
+struct query_t {
+    u64 frame_start, frame_end;
+    u16 pc_start, pc_end;
+    opcode_filter_t filter;
+    i32 reg;            // Register to test after the instruction ran, -1 if none, 0x10 is I
+    u16 reg_value;
+    bool changes;       // Only writes that changed the byte
+};
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s <trace_db> <query> [options]\n"
+            "  info                 instructions, frames and writes in the trace\n"
+            "  state <inst>         registers before an instruction\n"
+            "  writes <addr>        writes to a byte [--frames a-b] [--changes]\n"
+            "  last-change <addr>   last write that changed a byte [--before-frame f]\n"
+            "  find <pattern>       instructions e.g. DXYN [--frames a-b] [--pc 200-2ff] [--reg VF=1]\n"
+            "  --map <rom.map>      label and source line of every instruction\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+// Label and source line of a PC when there is a source map
+static std::string where(u16 pc) {
+    const std::string text = source_map.describe(pc);
+    return text.empty() ? text : "  ; " + text;
+}
+
+// Byte of memory as an instruction fetched it, the last write to it from the index
+// Writes at inst itself are patches made before it, fetching writes nothing
+static u8 byte_at(const TraceDbReader &db, u32 addr, u64 inst) {
+    u64 count;
+    const u64 *entries = db.writes_to(addr, &count);
+    const u64 *after = std::lower_bound(entries, entries + count, (inst + 1) << 8);
+    return after != entries ? TRACEDB_INDEX_VALUE(after[-1]) : db.initial(addr);
+}
+
+static void print_inst(const TraceDbReader &db, const TraceDbReader::cursor_t &cursor) {
+    // Same arg as the interpreter logs. F000 NNNN reads its second word from memory as it was,
+    // FX07 the timer from the register it loaded. Timers aren't stored, FX15/FX18 print without one
+    const u16 opcode = db.opcode(cursor.inst);
+    const u16 op = opcode & 0xF0FF;
+    u16 arg = cursor.I;
+    if (opcode == 0xF000) {
+        arg = byte_at(db, (cursor.pc + 2) & (TRACEDB_ADDRESSES - 1), cursor.inst) << 8 |
+              byte_at(db, (cursor.pc + 3) & (TRACEDB_ADDRESSES - 1), cursor.inst);
+    } else if (op == 0xF007) {
+        TraceDbReader::cursor_t after = cursor;
+        after.next();
+        arg = after.V[opcode >> 8 & 0xF];
+    }
+
+    const debug_record_t record = {
+        .pc = cursor.pc,
+        .opcode = opcode,
+        .arg = arg,
+        .event = DEBUG_INST,
+        .reg = op == 0xF015 || op == 0xF018,
+    };
+
+    printf("#%llu frame %llu ", (long long unsigned) cursor.inst, (long long unsigned) db.frame_of(cursor.inst));
+    debug_print(record);
+}
+
+static void print_state(const TraceDbReader &db, u64 inst) {
+    if (inst >= db.meta.insts) {
+        fprintf(stderr, "The trace has %llu instructions\n", (long long unsigned) db.meta.insts);
+        exit(EXIT_FAILURE);
+    }
+
+    const TraceDbReader::cursor_t cursor = db.cursor(inst);
+    print_inst(db, cursor);
+    for (u8 i = 0; i < 16; i++)
+        printf("V%01X=%02X%s", i, cursor.V[i], i == 7 ? "\n" : " ");
+    printf("I=%04X\n", cursor.I);
+}
+
+// Writes from the per address index, PCs come from one cursor moving forward
+static void print_writes(const TraceDbReader &db, u32 addr, const query_t &query) {
+    u64 count;
+    const u64 *entries = db.writes_to(addr, &count);
+    const u64 first = db.frame_start(query.frame_start);
+    const u64 last = query.frame_end == ~0ULL ? ~0ULL : db.frame_start(query.frame_end + 1);
+    TraceDbReader::cursor_t cursor = {};
+    bool positioned = false;
+
+    for (u64 i = 0; i < count; i++) {
+        const u64 inst = TRACEDB_INDEX_INST(entries[i]);
+        const u8 value = TRACEDB_INDEX_VALUE(entries[i]);
+        const u8 old = i ? TRACEDB_INDEX_VALUE(entries[i - 1]) : db.initial(addr);
+
+        if (inst < first || inst >= last || (query.changes && value == old))
+            continue;
+
+        if (!positioned) {
+            cursor = db.cursor(inst);
+            positioned = true;
+        } else {
+            cursor.seek(inst);
+        }
+        printf("#%llu frame %llu pc %03X: [%04X] %02X -> %02X%s\n", (long long unsigned) inst,
+               (long long unsigned) db.frame_of(inst), cursor.pc, addr, old, value, where(cursor.pc).c_str());
+    }
+}
+
+static void print_last_change(const TraceDbReader &db, u32 addr, u64 before_frame) {
+    u64 count;
+    const u64 *entries = db.writes_to(addr, &count);
+    const u64 before = db.frame_start(before_frame);
+
+    // Newest write before the frame whose value differs from the one it replaced
+    for (u64 i = count; i > 0; i--) {
+        const u64 inst = TRACEDB_INDEX_INST(entries[i - 1]);
+        const u8 value = TRACEDB_INDEX_VALUE(entries[i - 1]);
+        const u8 old = i > 1 ? TRACEDB_INDEX_VALUE(entries[i - 2]) : db.initial(addr);
+
+        if (inst >= before || value == old)
+            continue;
+
+        const TraceDbReader::cursor_t cursor = db.cursor(inst);
+        printf("#%llu frame %llu pc %03X: [%04X] %02X -> %02X%s\n", (long long unsigned) inst,
+               (long long unsigned) db.frame_of(inst), cursor.pc, addr, old, value, where(cursor.pc).c_str());
+        return;
+    }
+
+    printf("[%04X] never changed before frame %llu, it is %02X from the start\n", addr,
+           (long long unsigned) before_frame, db.initial(addr));
+}
+
+// Sequential scan of the selected frames, registers are checked after the instruction ran
+static void find(const TraceDbReader &db, const query_t &query) {
+    const u64 first = db.frame_start(query.frame_start);
+    const u64 last = query.frame_end == ~0ULL ? db.meta.insts : db.frame_start(query.frame_end + 1);
+    u64 matches = 0;
+
+    if (first >= last)
+        return;
+
+    TraceDbReader::cursor_t cursor = db.cursor(first);
+    while (cursor.inst < last) {
+        const u16 opcode = db.opcode(cursor.inst);
+
+        if ((opcode & query.filter.mask) != query.filter.value ||
+                cursor.pc < query.pc_start || cursor.pc > query.pc_end) {
+            cursor.next();
+            continue;
+        }
+
+        const TraceDbReader::cursor_t match = cursor;
+        cursor.next();
+        if (query.reg >= 0) {
+            const u16 value = query.reg == TRACEDB_REG_I ? cursor.I : cursor.V[query.reg];
+            if (value != query.reg_value)
+                continue;
+        }
+
+        print_inst(db, match);
+        matches++;
+    }
+
+    printf("%llu matches\n", (long long unsigned) matches);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3)
+        usage(argv[0]);
+
+    const char *command = argv[2];
+    const bool takes_arg = strcmp(command, "info") != 0;
+    const char *arg = NULL;
+    query_t query = {
+        .frame_start = 0,
+        .frame_end = ~0ULL,
+        .pc_start = 0x0000,
+        .pc_end = 0xFFFF,
+        .filter = {0, 0},
+        .reg = -1,
+        .reg_value = 0,
+        .changes = false,
+    };
+    u64 before_frame = ~0ULL;
+
+    // Options can come before or after the query's argument, info has none
+    for (i32 i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            long long unsigned start, end;
+            if (sscanf(argv[++i], "%llu-%llu", &start, &end) != 2) {
+                fprintf(stderr, "Invalid frame range %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            query.frame_start = start;
+            query.frame_end = end;
+        } else if (!strcmp(argv[i], "--pc") && i + 1 < argc) {
+            unsigned start, end;
+            if (sscanf(argv[++i], "%x-%x", &start, &end) != 2) {
+                fprintf(stderr, "Invalid PC range %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            query.pc_start = start;
+            query.pc_end = end;
+        } else if (!strcmp(argv[i], "--reg") && i + 1 < argc) {
+            unsigned reg, value;
+            if (sscanf(argv[++i], "V%1x=%x", &reg, &value) == 2 || sscanf(argv[i], "v%1x=%x", &reg, &value) == 2) {
+                query.reg = reg;
+            } else if (sscanf(argv[i], "I=%x", &value) == 1) {
+                query.reg = TRACEDB_REG_I;
+            } else {
+                fprintf(stderr, "Invalid register test %s, e.g. VF=1 or I=300\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            query.reg_value = value;
+        } else if (!strcmp(argv[i], "--before-frame") && i + 1 < argc) {
+            before_frame = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--changes")) {
+            query.changes = true;
+        } else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+            if (!source_map.load(argv[++i])) {
+                fprintf(stderr, "Could not load source map %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (argv[i][0] != '-' && takes_arg && !arg) {
+            arg = argv[i];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    TraceDbReader db;
+    if (!db.open(argv[1]))
+        exit(EXIT_FAILURE);
+
+    if (!strcmp(command, "info")) {
+        printf("%llu instructions, %llu frames, %llu memory writes, %u bytes of ram\n",
+               (long long unsigned) db.meta.insts, (long long unsigned) db.meta.frames,
+               (long long unsigned) db.meta.writes, db.meta.ram_size);
+    } else if (!strcmp(command, "state") && arg) {
+        print_state(db, strtoull(arg, NULL, 0));
+    } else if (!strcmp(command, "writes") && arg) {
+        print_writes(db, strtoul(arg, NULL, 16) & (TRACEDB_ADDRESSES - 1), query);
+    } else if (!strcmp(command, "last-change") && arg) {
+        print_last_change(db, strtoul(arg, NULL, 16) & (TRACEDB_ADDRESSES - 1), before_frame);
+    } else if (!strcmp(command, "find") && arg) {
+        if (!parse_opcode_filter(arg, &query.filter)) {
+            fprintf(stderr, "Invalid opcode pattern %s\n", arg);
+            exit(EXIT_FAILURE);
+        }
+        find(db, query);
+    } else {
+        usage(argv[0]);
+    }
+
+    db.close();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../include/Debug.h"
+#include "../include/SourceMap.h"
+#include "../include/Trace.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace_file> [--pc <start>-<end>] [--op <pattern e.g. DXYN>] [--map <rom.map>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    u16 pc_start = 0x0000, pc_end = 0xFFFF;
+    opcode_filter_t filter = {0, 0};
+
+    for (i32 i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--pc") && i + 1 < argc) {
+            unsigned start, end;
+            if (sscanf(argv[++i], "%x-%x", &start, &end) != 2) {
+                fprintf(stderr, "Invalid PC range %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            pc_start = start;
+            pc_end = end;
+        } else if (!strcmp(argv[i], "--op") && i + 1 < argc) {
+            if (!parse_opcode_filter(argv[++i], &filter)) {
+                fprintf(stderr, "Invalid opcode pattern %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+            if (!source_map.load(argv[++i])) {
+                fprintf(stderr, "Could not load source map %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open trace file %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof header, 1, file) != 1 || strcmp(header.magic, TRACE_MAGIC) ||
+            header.version != TRACE_VERSION || header.record_size != sizeof(debug_record_t)) {
+        fprintf(stderr, "%s is not a trace file of this version\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    static debug_record_t records[DEBUG_BUFFER_SIZE];
+    size_t count;
+
+    while ((count = fread(records, sizeof(debug_record_t), DEBUG_BUFFER_SIZE, file)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const debug_record_t &record = records[i];
+
+            if (record.pc < pc_start || record.pc > pc_end)
+                continue;
+            if ((record.opcode & filter.mask) != filter.value)
+                continue;
+
+            debug_print(record);
+        }
+    }
+
+    fclose(file);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "../include/Watch.h"
+#include "../include/Assembler.h"
+#include "../include/Reverse.h"
+#include "../include/TraceDb.h"
+
+Watch watch;
+
+static const Address entry_point = 0x200;   // Where init_chip8 assembles the program
+
+// Directory part of a source path, "." if it has none
+static std::string directory(const std::string &path) {
+    const size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+static std::string base_name(const std::string &path) {
+    const size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool Watch::start(const Chip8 &chip8, const config_t &config, const char *file_path) {
+    stop();
+
+    const u32 file_path_len = strlen(file_path) + 1;
+    if (!strncmp(file_path + file_path_len - 5, ".ch8", 4)) {
+        SDL_Log("Only programs assembled from source can be watched, not %s\n", file_path);
+        return false;
+    }
+
+    // Same program as in ram, for the first diff
+    Assembler assembler;
+    assembly_t program;
+    assembler.optimize = config.optimize;
+    image.assign(chip8.ram_size - entry_point, 0);
+    if (!assembler.assemble(file_path, entry_point, image.data(), image.size(), &program)) {
+        SDL_Log("Couldn't assemble %s to watch it\n", file_path);
+        return false;
+    }
+    size = program.size;
+    map = std::move(program.map);
+    this->file_path = file_path;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        SDL_Log("Could not watch %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    if (!watch_files(map.files)) {
+        stop();
+        return false;
+    }
+    return true;    // Success
+}
+
+void Watch::stop() {
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    dirs.clear();
+    files.clear();
+    image.clear();
+    map.clear();
+    size = 0;
+}
+
+// (Re)watch the directories of the sources, includes may have come or gone
+bool Watch::watch_files(const std::vector<std::string> &sources) {
+    if (sources == files)
+        return true;
+
+    for (i32 wd : dirs)
+        inotify_rm_watch(fd, wd);
+    dirs.clear();
+
+    std::vector<std::string> watched;
+    for (const std::string &source : sources) {
+        const std::string dir = directory(source);
+        if (std::find(watched.begin(), watched.end(), dir) != watched.end())
+            continue;
+
+        const i32 wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            SDL_Log("Could not watch %s: %s\n", dir.c_str(), strerror(errno));
+            return false;
+        }
+        dirs.push_back(wd);
+        watched.push_back(dir);
+    }
+    files = sources;
+    return true;
+}
+
+// Whether any source was written since the last call, an editor saving a file
+// is often several events so they are all read at once
+bool Watch::saved() {
+    alignas(struct inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof buffer)) > 0) {
+        for (char *p = buffer; p < buffer + n;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (!event->len)
+                continue;
+            for (const std::string &file : files)
+                changed |= base_name(file) == event->name;
+        }
+    }
+    return changed;
+}
+
+// The running state still fits the new program if every label that is in both kept its
+// address and the PC and the return addresses on the stack are at the start of a line
+bool Watch::can_patch(const Chip8 &chip8, const SourceMap &next, u32 next_size) const {
+    std::unordered_map<std::string, u16> labels;
+    for (const source_symbol_t &symbol : map.symbols)
+        labels.emplace(symbol.name, symbol.addr);
+    for (const source_symbol_t &symbol : next.symbols) {
+        const auto it = labels.find(symbol.name);
+        if (it != labels.end() && it->second != symbol.addr)
+            return false;
+    }
+
+    // Code outside the program, e.g. in ram it wrote, is left alone
+    const u32 end = entry_point + std::max(size, next_size);
+    auto starts_line = [&](u32 addr) {
+        if (addr < entry_point || addr >= end)
+            return true;
+        const source_line_t *line = next.line_at(addr);
+        return line && line->addr == addr;
+    };
+
+    if (!starts_line(chip8.PC))
+        return false;
+    for (u32 i = chip8.SP; i < 15; i++) {
+        if (!starts_line(chip8.stack[i]))
+            return false;
+    }
+    return true;
+}
+
+bool Watch::poll(Chip8 *chip8, const config_t &config) {
+    if (!saved())
+        return false;
+
+    const u64 start_time = SDL_GetPerformanceCounter();
+    Assembler assembler;
+    assembly_t program;
+    std::vector<u8> next(chip8->ram_size - entry_point, 0);
+    assembler.optimize = config.optimize;
+    if (!assembler.assemble(file_path.c_str(), entry_point, next.data(), next.size(), &program)) {
+        for (const std::string &error : program.errors)
+            SDL_Log("%s: %s\n", file_path.c_str(), error.c_str());
+        SDL_Log("Keeping the running program until %s assembles\n", file_path.c_str());
+        watch_files(program.map.files);
+        return false;
+    }
+    watch_files(program.map.files);
+
+    u32 changed = 0;
+    const bool in_place = can_patch(*chip8, program.map, program.size);
+    if (in_place) {
+        // Only what the edit changed, bytes the program wrote since are kept
+        const u32 end = std::max(size, program.size);
+        for (u32 i = 0; i < end; i++) {
+            if (next[i] == image[i])
+                continue;
+            chip8->ram[entry_point + i] = next[i];
+            chip8->touch(entry_point + i, 1);
+            if (tracedb.active())
+                tracedb.patch(*chip8, entry_point + i, 1);
+            changed++;
+        }
+        patched++;
+    } else {
+        // Same as '-', minus reading and assembling the source again
+        std::vector<u8> before(XO_RAM_SIZE, 0);
+        memcpy(before.data(), chip8->ram, chip8->ram_size);
+        if (!chip8->init_chip8(&config, chip8->rom_name, next.data(), program.size))
+            return false;
+        if (tracedb.active())
+            tracedb.patch(*chip8, before.data());
+        chip8->draw = true;
+        resets++;
+    }
+
+    image.swap(next);
+    size = program.size;
+    map = program.map;
+    source_map = std::move(program.map);
+    if (reverse.active())
+        reverse.reset(*chip8);
+
+    const f64 elapsed = (f64) ((SDL_GetPerformanceCounter() - start_time) * 1000) / SDL_GetPerformanceFrequency();
+    if (in_place)
+        SDL_Log("%s: patched %u bytes in %.1fms\n", file_path.c_str(), changed, elapsed);
+    else
+        SDL_Log("%s: layout changed, reset in %.1fms\n", file_path.c_str(), elapsed);
+    return true;
+}